@@ -0,0 +1,63 @@
+#!/bin/sh
+# End-to-end transfer benchmark.
+#
+#   sweep.sh SIMULATE
+#     Runs one share and many downloads for every combination of file size,
+#     receiver count and loss rate and prints one CSV row per run.
+#     Runs use virtual time and fixed seeds so results are repeatable.
+#     Set CLOCK=real to run on the wall clock instead.
+#
+#   sweep.sh -compare BASELINE RESULTS
+#     Fails if goodput fell or requests per receiver rose by more than
+#     TOLERANCE percent (default 10) for any configuration.
+
+SIZES=${SIZES:-"65536 1048576 8388608"}
+NODES=${NODES:-"2 10 100"}
+LOSSES=${LOSSES:-"0 0.01 0.05"}
+TOLERANCE=${TOLERANCE:-10}
+
+if [ "$1" = "-compare" ]; then
+    if [ $# -ne 3 ]; then
+	echo "Usage: $0 -compare BASELINE RESULTS" >&2
+	exit 1
+    fi
+    # Key on nodes, file size, loss and clock.
+    awk -F, -v tol="$TOLERANCE" '
+	FNR == 1 { next }
+	NR == FNR { goodput[$1 "," $2 "," $3 "," $4] = $8; requests[$1 "," $2 "," $3 "," $4] = $9; next }
+	{
+	    key = $1 "," $2 "," $3 "," $4
+	    if (!(key in goodput)) next
+	    if ($8 < goodput[key] * (1 - tol / 100)) {
+		printf "regression %s: goodput %s -> %s\n", key, goodput[key], $8
+		bad = 1
+	    }
+	    if ($9 > requests[key] * (1 + tol / 100) && $9 - requests[key] > 1) {
+		printf "regression %s: requests per receiver %s -> %s\n", key, requests[key], $9
+		bad = 1
+	    }
+	}
+	END { exit bad }' "$2" "$3"
+    exit $?
+fi
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 SIMULATE" >&2
+    exit 1
+fi
+
+SIMULATE=$1
+FLAGS=
+if [ "$CLOCK" = "real" ]; then
+    FLAGS=-R
+fi
+
+echo "nodes,file_bytes,loss,clock,completed,seconds_median,seconds_max,goodput_bytes_per_second,requests_per_receiver,duplicate_fragments_per_receiver,datagrams_sent,bytes_sent,cpu_seconds_per_mb,real_seconds"
+for size in $SIZES; do
+    for nodes in $NODES; do
+	for loss in $LOSSES; do
+	    # A run that does not finish still prints its row.
+	    "$SIMULATE" $FLAGS -c -n "$nodes" -f "$size" -l "$loss" -r 1
+	done
+    done
+done
@@ -0,0 +1,55 @@
+#ifndef __capture_hpp__
+#define __capture_hpp__
+
+#include <cstdio>
+#include <stdint.h>
+#include <string>
+
+namespace mftp {
+
+  // A capture file is a capture_file_header followed by a capture_record_header and the bytes of each datagram.
+  struct capture_file_header
+  {
+    char magic[8];
+  };
+
+  struct capture_record_header
+  {
+    uint64_t time; // Microseconds.
+    uint32_t length;
+    uint32_t reserved;
+  };
+
+  const char CAPTURE_MAGIC[8] = { 'M', 'F', 'T', 'P', 'C', 'A', 'P', '1' };
+
+  // Records every datagram that reaches a channel, valid or not, with the time it arrived.
+  // The file is flushed every 100 milliseconds (of the time records carry) and at exit.
+  class capture {
+  public:
+    static void enable (const std::string& path);
+    static bool enabled ();
+    static void record (const std::string& datagram);
+  };
+
+  // Reads a capture file.
+  class capture_reader {
+  private:
+    FILE* m_fp;
+
+    // Non-copyable.
+    capture_reader (const capture_reader&);
+    capture_reader& operator= (const capture_reader&);
+
+  public:
+    // Exits if the file can't be read or isn't a capture.
+    capture_reader (const std::string& path);
+    ~capture_reader ();
+    // Returns false at the end of the file.
+    bool next (uint64_t& time,
+	       std::string& datagram);
+    void rewind ();
+  };
+
+}
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef __clock_hpp__
+#define __clock_hpp__
+
+#include <ioa/ioa.hpp>
+
+namespace mftp {
+
+  // The time seen by the protocol.
+  // It is real time unless a simulator_automaton has installed virtual time.
+  class clock
+  {
+  public:
+    static ioa::time now ();
+
+    // Virtual time.
+    static bool simulated ();
+    static ioa::aid_t simulator ();
+    static void simulate (const ioa::aid_t simulator,
+			  const ioa::time& start);
+    static void advance (const ioa::time& t);
+    static void stop_simulation ();
+  };
+
+  inline uint64_t to_microseconds (const ioa::time& t) {
+    return uint64_t (t.sec ()) * 1000000 + t.usec ();
+  }
+
+  inline ioa::time from_microseconds (const uint64_t us) {
+    return ioa::time (us / 1000000, us % 1000000);
+  }
+
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef __download_budget_hpp__
+#define __download_budget_hpp__
+
+#include <mftp/fileid.hpp>
+
+#include <cstddef>
+#include <map>
+#include <stdint.h>
+#include <vector>
+
+namespace mftp {
+
+  // How many downloads a node starts on its own (to check match candidates) and how much memory they may hold.
+  struct download_limits
+  {
+    size_t downloads; // Running at once.
+    uint64_t bytes; // Reserved by the running downloads.
+
+    download_limits () :
+      downloads (16),
+      bytes (uint64_t (256) << 20)
+    { }
+  };
+
+  // Downloads running under a set of limits and the bytes they have reserved.
+  // A download larger than the byte limit still runs when it would be the only one so that no file is refused forever.
+  class download_budget
+  {
+  private:
+    download_limits m_limits;
+    size_t m_downloads;
+    uint64_t m_bytes;
+
+  public:
+    explicit download_budget (const download_limits& limits) :
+      m_limits (limits),
+      m_downloads (0),
+      m_bytes (0)
+    { }
+
+    void set_limits (const download_limits& limits) {
+      m_limits = limits;
+    }
+
+    size_t downloads () const {
+      return m_downloads;
+    }
+
+    uint64_t bytes () const {
+      return m_bytes;
+    }
+
+    // Reserve room for a download of bytes if it fits.
+    bool reserve (const uint64_t bytes) {
+      if (m_downloads != 0 && (m_downloads >= m_limits.downloads || m_bytes + bytes > m_limits.bytes)) {
+	return false;
+      }
+      ++m_downloads;
+      m_bytes += bytes;
+      return true;
+    }
+
+    void release (const uint64_t bytes) {
+      --m_downloads;
+      m_bytes -= bytes;
+    }
+  };
+
+  // The downloads one automaton holds in a budget and when each is given up (in microseconds).
+  // A download that makes no progress for idle is expired so a file nobody serves doesn't hold its room forever.
+  class download_leases
+  {
+  private:
+    struct lease
+    {
+      uint64_t bytes;
+      uint64_t deadline;
+    };
+    typedef std::map<fileid, lease> map_type;
+
+    download_budget& m_budget;
+    uint64_t m_idle;
+    map_type m_leases;
+
+    // Not copyable.
+    download_leases (const download_leases&);
+    download_leases& operator= (const download_leases&);
+
+  public:
+    download_leases (download_budget& budget,
+		     const uint64_t idle) :
+      m_budget (budget),
+      m_idle (idle)
+    { }
+
+    ~download_leases () {
+      for (map_type::const_iterator pos = m_leases.begin (); pos != m_leases.end (); ++pos) {
+	m_budget.release (pos->second.bytes);
+      }
+    }
+
+    size_t size () const {
+      return m_leases.size ();
+    }
+
+    bool contains (const fileid& fid) const {
+      return m_leases.count (fid) != 0;
+    }
+
+    // Reserve room for fid if the budget has it.
+    bool acquire (const fileid& fid,
+		  const uint64_t bytes,
+		  const uint64_t now) {
+      if (contains (fid) || !m_budget.reserve (bytes)) {
+	return false;
+      }
+      lease& l = m_leases[fid];
+      l.bytes = bytes;
+      l.deadline = now + m_idle;
+      return true;
+    }
+
+    // Note that fid made progress at now.
+    void renew (const fileid& fid,
+		const uint64_t now) {
+      map_type::iterator pos = m_leases.find (fid);
+      if (pos != m_leases.end ()) {
+	pos->second.deadline = now + m_idle;
+      }
+    }
+
+    // Give back the room of fid and say if it was held.
+    bool release (const fileid& fid) {
+      map_type::iterator pos = m_leases.find (fid);
+      if (pos == m_leases.end ()) {
+	return false;
+      }
+      m_budget.release (pos->second.bytes);
+      m_leases.erase (pos);
+      return true;
+    }
+
+    // Release the leases whose deadline has passed and append their fileids to out.
+    void expire (const uint64_t now,
+		 std::vector<fileid>& out) {
+      map_type::iterator pos = m_leases.begin ();
+      while (pos != m_leases.end ()) {
+	if (pos->second.deadline <= now) {
+	  out.push_back (pos->first);
+	  m_budget.release (pos->second.bytes);
+	  m_leases.erase (pos++);
+	}
+	else {
+	  ++pos;
+	}
+      }
+    }
+
+    // The earliest deadline (0 when nothing is held).
+    uint64_t next_deadline () const {
+      uint64_t deadline = 0;
+      for (map_type::const_iterator pos = m_leases.begin (); pos != m_leases.end (); ++pos) {
+	if (deadline == 0 || pos->second.deadline < deadline) {
+	  deadline = pos->second.deadline;
+	}
+      }
+      return deadline;
+    }
+  };
+
+}
+
+#endif
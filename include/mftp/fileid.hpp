@@ -26,9 +26,7 @@ namespace mftp {
     }
 
     bool operator!= (const fileid& other) const {
-      return type != other.type &&
-	length != other.length &&
-	memcmp (hash, other.hash, HASH_SIZE) != 0;
+      return !(*this == other);
     }
 
     bool operator< (const fileid& other) const {
@@ -66,6 +64,24 @@ namespace mftp {
     }
   };
 
+  // The hash field is a SHA-256 digest so any prefix of it is already well distributed.
+  struct fileid_hash
+  {
+    size_t operator() (const fileid& fid) const {
+      size_t h;
+      memcpy (&h, fid.hash, sizeof (h));
+      return h ^ fid.type ^ fid.length;
+    }
+  };
+
+  // The data group (1 to groups) that carries a file.
+  // Hosts must agree on it so it comes from a big-endian word of the digest and must never change.
+  inline size_t data_group (const fileid& fid,
+			    const size_t groups) {
+    const uint32_t w = (uint32_t (fid.hash[4]) << 24) | (uint32_t (fid.hash[5]) << 16) | (uint32_t (fid.hash[6]) << 8) | uint32_t (fid.hash[7]);
+    return 1 + w % groups;
+  }
+
 }
 
 #endif
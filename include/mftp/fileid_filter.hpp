@@ -0,0 +1,38 @@
+#ifndef __fileid_filter_hpp__
+#define __fileid_filter_hpp__
+
+#include <mftp/fileid.hpp>
+
+#include <set>
+#include <utility>
+
+namespace mftp {
+
+  // A description of the datagrams a host wants to see that can be compiled to a classic BPF socket filter.
+  // Fragments and requests are matched on the first word of the hash so a few false positives get through.
+  // User space still checks the full fileid.
+  class fileid_filter
+  {
+  private:
+    std::set<uint32_t> m_prefixes;
+    std::set<std::pair<uint32_t, uint32_t> > m_kinds; // Type and length of the files whose fragments are accepted.
+    bool m_accept_fragments;
+
+  public:
+    fileid_filter ();
+
+    // Accept fragments and requests for this file.
+    void insert (const fileid& fid);
+    // Accept fragments for every file, i.e., somebody is looking for match candidates.
+    void accept_fragments ();
+    // Accept fragments for every file of this type and length, i.e., somebody is looking for those candidates.
+    void accept_fragments (const uint32_t type,
+			   const uint32_t length);
+
+    // Attach the filter to a socket.  Returns 0 or an errno.
+    int attach (int fd) const;
+  };
+
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef __loopback_medium_automaton_hpp__
+#define __loopback_medium_automaton_hpp__
+
+#include <mftp/capture.hpp>
+#include <mftp/loss_model.hpp>
+#include <mftp/mftp_receiver_automaton.hpp>
+#include <mftp/simulator_automaton.hpp>
+#include <ioa/alarm_automaton.hpp>
+#include <ioa/udp_sender_automaton.hpp>
+
+#include <map>
+#include <memory>
+#include <queue>
+#include <set>
+
+namespace mftp {
+
+  // Counts kept by a medium for whoever is running the experiment.
+  struct medium_stats
+  {
+    uint64_t sent; // Datagrams sent.
+    uint64_t bytes; // Bytes sent.
+    uint64_t delivered; // Datagrams that reached a node.
+    uint64_t lost; // Datagrams lost on the way to a node.
+    std::map<uint32_t, uint64_t> sent_by_type; // Datagrams sent by message type.
+    std::map<uint32_t, uint64_t> delivered_by_type; // Datagrams that reached a node by message type.
+
+    medium_stats () :
+      sent (0),
+      bytes (0),
+      delivered (0),
+      lost (0)
+    { }
+  };
+
+  // Properties of a simulated broadcast medium.
+  struct medium_config
+  {
+    double bandwidth; // Bytes per second shared by all senders, 0 for unlimited.
+    ioa::time delay; // Propagation delay.
+    ioa::time jitter; // Uniform extra delay per receiver, which reorders datagrams.
+    loss_model loss; // Loss on the path to each receiver (each path has its own state).
+    uint64_t seed; // Seed for loss and jitter.
+    medium_stats* stats; // Updated as datagrams move if not 0.
+    std::string replay; // Capture file played to every node instead of what the nodes send.
+    bool replay_fast; // Play the capture as fast as the nodes take it instead of at the recorded pace.
+
+    medium_config () :
+      bandwidth (0),
+      seed (1),
+      stats (0),
+      replay_fast (false)
+    { }
+  };
+
+  // Connects the channels of several nodes in one process.
+  // Every datagram sent by a channel is delivered to every attached channel (including the sender) unless it is lost.
+  // Under a simulator_automaton it runs on virtual time.
+  // When replaying a capture, the nodes hear the capture (from start on) and nothing they send.
+  class loopback_medium_automaton :
+    public ioa::automaton,
+    private ioa::observer
+  {
+  private:
+    enum alarm_state_t {
+      SET_READY,
+      INTERRUPT_WAIT,
+    };
+
+    enum event_type {
+      COMPLETE, // The datagram has left the sender.
+      DELIVER, // The datagram has reached a receiver.
+    };
+
+    struct event
+    {
+      event_type type;
+      ioa::aid_t aid;
+      ioa::const_shared_ptr<std::string> buffer;
+
+      event (const event_type t,
+	     const ioa::aid_t a,
+	     const ioa::const_shared_ptr<std::string>& b) :
+	type (t),
+	aid (a),
+	buffer (b)
+      { }
+    };
+
+    static const ioa::time MAX_WAIT;
+    static const size_t REPLAY_BATCH;
+
+    ioa::handle_manager<loopback_medium_automaton> m_self;
+    std::auto_ptr<ioa::handle_manager<simulator_automaton> > m_simulator;
+    const medium_config m_config;
+    prng m_prng;
+
+    std::set<ioa::aid_t> m_nodes; // Channels receiving from the medium.
+    std::map<ioa::aid_t, loss_model> m_paths; // Loss state to each node.
+    ioa::time m_busy_until; // When the medium finishes transmitting what it has.
+    std::multimap<ioa::time, event> m_events; // Future events in time order.
+    std::set<ioa::aid_t> m_completes; // Senders whose datagram has left.
+    std::map<ioa::aid_t, std::queue<mftp_receiver_automaton::receive_val> > m_deliveries; // Datagrams that have arrived.
+    alarm_state_t m_alarm_state;
+
+    // Replay.
+    std::auto_ptr<capture_reader> m_replay; // 0 when not replaying or when the capture has been played.
+    bool m_playing;
+    bool m_finished; // The capture has been played and delivered.
+    ioa::time m_replay_start; // When play began.
+    uint64_t m_replay_base; // Recorded time of the first datagram.
+    bool m_have_next; // m_next holds the next datagram of the capture.
+    uint64_t m_next_time;
+    ioa::const_shared_ptr<std::string> m_next;
+
+    void observe (ioa::observable* o);
+    static uint32_t type_of (const std::string& buffer);
+    void count (const std::string& buffer);
+    void release (const ioa::time& now);
+    ioa::time random_jitter ();
+    void deliver_all (const ioa::const_shared_ptr<std::string>& buffer);
+    bool read_next ();
+    ioa::time next_due ();
+    bool replay_waiting () const;
+    void play (const ioa::time& now);
+
+  public:
+    loopback_medium_automaton (const medium_config& config);
+
+  private:
+    void schedule () const;
+
+    void send_effect (const ioa::udp_sender_automaton::send_arg& arg,
+		      ioa::aid_t aid);
+    void send_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    V_AP_INPUT (loopback_medium_automaton, send, ioa::udp_sender_automaton::send_arg);
+
+  private:
+    bool send_complete_precondition (ioa::aid_t aid) const;
+    int send_complete_effect (ioa::aid_t aid);
+    void send_complete_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    V_AP_OUTPUT (loopback_medium_automaton, send_complete, int);
+
+  private:
+    bool receive_precondition (ioa::aid_t aid) const;
+    mftp_receiver_automaton::receive_val receive_effect (ioa::aid_t aid);
+    void receive_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    V_AP_OUTPUT (loopback_medium_automaton, receive, mftp_receiver_automaton::receive_val);
+
+  private:
+    bool set_alarm_precondition () const;
+    ioa::time set_alarm_effect ();
+    void set_alarm_schedule () const { schedule (); }
+    V_UP_OUTPUT (loopback_medium_automaton, set_alarm, ioa::time);
+
+    void alarm_interrupt_effect ();
+    void alarm_interrupt_schedule () const { schedule (); }
+    UV_UP_INPUT (loopback_medium_automaton, alarm_interrupt);
+
+    void start_effect ();
+    void start_schedule () const { schedule (); }
+  public:
+    // Start playing the capture.
+    UV_UP_INPUT (loopback_medium_automaton, start);
+
+  private:
+    bool finished_precondition () const;
+    void finished_effect ();
+    void finished_schedule () const { schedule (); }
+  public:
+    // The capture has been played and delivered.
+    UV_UP_OUTPUT (loopback_medium_automaton, finished);
+  };
+
+}
+
+#endif
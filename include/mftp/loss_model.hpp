@@ -0,0 +1,59 @@
+#ifndef __loss_model_hpp__
+#define __loss_model_hpp__
+
+#include <mftp/prng.hpp>
+
+namespace mftp {
+
+  // Gilbert-Elliott loss: a two state Markov chain with a loss probability per state.
+  // Bernoulli loss is the special case that never leaves the good state.
+  class loss_model
+  {
+  private:
+    double m_good_to_bad;
+    double m_bad_to_good;
+    double m_loss_good;
+    double m_loss_bad;
+    bool m_bad;
+
+  public:
+    // No loss.
+    loss_model () :
+      m_good_to_bad (0),
+      m_bad_to_good (1),
+      m_loss_good (0),
+      m_loss_bad (0),
+      m_bad (false)
+    { }
+
+    static loss_model bernoulli (const double loss) {
+      return gilbert_elliott (0, 1, loss, 0);
+    }
+
+    static loss_model gilbert_elliott (const double good_to_bad,
+				       const double bad_to_good,
+				       const double loss_good,
+				       const double loss_bad) {
+      loss_model m;
+      m.m_good_to_bad = good_to_bad;
+      m.m_bad_to_good = bad_to_good;
+      m.m_loss_good = loss_good;
+      m.m_loss_bad = loss_bad;
+      return m;
+    }
+
+    // Advance the chain by one packet and decide if that packet is lost.
+    bool drop (prng& r) {
+      if (m_bad) {
+	m_bad = !(r.uniform () < m_bad_to_good);
+      }
+      else {
+	m_bad = r.uniform () < m_good_to_bad;
+      }
+      return r.uniform () < (m_bad ? m_loss_bad : m_loss_good);
+    }
+  };
+
+}
+
+#endif
@@ -6,10 +6,50 @@
 
 namespace mftp {
 
+  // The type and length of a fileid, which is all most candidate predicates look at.
+  struct candidate_key
+  {
+    uint32_t type;
+    uint32_t length;
+
+    candidate_key () :
+      type (0),
+      length (0)
+    { }
+
+    candidate_key (const uint32_t t,
+		   const uint32_t l) :
+      type (t),
+      length (l)
+    { }
+
+    explicit candidate_key (const fileid& fid) :
+      type (fid.type),
+      length (fid.length)
+    { }
+
+    bool operator== (const candidate_key& other) const {
+      return type == other.type && length == other.length;
+    }
+  };
+
+  struct candidate_key_hash
+  {
+    size_t operator() (const candidate_key& k) const {
+      return size_t (k.type) * 2654435761u ^ size_t (k.length);
+    }
+  };
+
   struct match_candidate_predicate {
     virtual ~match_candidate_predicate () { }
     virtual bool operator() (const fileid& fid) const = 0;
     virtual match_candidate_predicate* clone () const = 0;
+
+    // Set k and return true if the predicate accepts exactly the fileids with the type and length of k.
+    // The channel then indexes the automaton by k and the predicate need not be called.
+    virtual bool key (candidate_key& /* k */) const {
+      return false;
+    }
   };
   
   struct match_predicate {
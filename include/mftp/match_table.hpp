@@ -0,0 +1,242 @@
+#ifndef __match_table_hpp__
+#define __match_table_hpp__
+
+#include <mftp/fileid.hpp>
+
+#include <cstddef>
+#include <vector>
+
+namespace mftp {
+
+  // What a matching automaton knows about another file.
+  enum match_state {
+    MATCH_UNKNOWN, // Never seen or forgotten.
+    MATCH_PENDING, // Being downloaded to be checked.
+    MATCH_YES, // Matches.
+    MATCH_NO, // Doesn't match.
+  };
+
+  // The match state of the files an automaton has seen and when each was last seen (in microseconds).
+  // Open addressing with linear probing on the fileid hash; removal shifts entries back so there are no tombstones.
+  // The table holds at most capacity entries and grows to that on demand.
+  // Entries not seen for ttl are forgotten (except pending ones), and a full table makes room by dropping the least recently seen of a few entries after a rotating cursor.
+  class match_table
+  {
+  public:
+    static const size_t SAMPLE = 8;
+    static const size_t MIN_SLOTS = 16;
+
+  private:
+    struct slot
+    {
+      fileid fid;
+      uint64_t seen;
+      match_state state; // MATCH_UNKNOWN for an empty slot.
+
+      slot () :
+	seen (0),
+	state (MATCH_UNKNOWN)
+      { }
+    };
+
+    std::vector<slot> m_slots; // Size is a power of two at least twice m_size.
+    size_t m_size;
+    size_t m_capacity;
+    uint64_t m_ttl; // 0 never forgets.
+    size_t m_counts[MATCH_NO + 1];
+    size_t m_cursor; // Where the next eviction looks.
+    uint64_t m_next_sweep; // When expire next looks at the whole table.
+
+    size_t home (const fileid& fid) const {
+      return fileid_hash () (fid) & (m_slots.size () - 1);
+    }
+
+    // The slot holding fid or the empty slot where it would go.
+    size_t probe (const fileid& fid) const {
+      const size_t mask = m_slots.size () - 1;
+      size_t idx = home (fid);
+      while (m_slots[idx].state != MATCH_UNKNOWN && !(m_slots[idx].fid == fid)) {
+	idx = (idx + 1) & mask;
+      }
+      return idx;
+    }
+
+    bool expired (const slot& s,
+		  const uint64_t now) const {
+      return m_ttl != 0 && s.state != MATCH_PENDING && now > s.seen && now - s.seen > m_ttl;
+    }
+
+    void remove (size_t idx) {
+      --m_counts[m_slots[idx].state];
+      --m_size;
+      m_slots[idx].state = MATCH_UNKNOWN;
+
+      // Pull back entries that probed past the hole.
+      const size_t mask = m_slots.size () - 1;
+      for (size_t next = (idx + 1) & mask; m_slots[next].state != MATCH_UNKNOWN; next = (next + 1) & mask) {
+	const size_t h = home (m_slots[next].fid);
+	const bool between = idx <= next ? (idx < h && h <= next) : (idx < h || h <= next);
+	if (!between) {
+	  m_slots[idx] = m_slots[next];
+	  m_slots[next].state = MATCH_UNKNOWN;
+	  idx = next;
+	}
+      }
+    }
+
+    void resize (const size_t slots) {
+      std::vector<slot> old (slots);
+      old.swap (m_slots);
+      for (size_t idx = 0; idx != old.size (); ++idx) {
+	if (old[idx].state != MATCH_UNKNOWN) {
+	  m_slots[probe (old[idx].fid)] = old[idx];
+	}
+      }
+      m_cursor = 0;
+    }
+
+    // Drop the least recently seen of the next SAMPLE entries, preferring those that are not pending.
+    void evict () {
+      const size_t mask = m_slots.size () - 1;
+      size_t victim = m_slots.size ();
+      size_t looked = 0;
+      size_t idx = m_cursor & mask;
+      for (size_t step = 0; step != m_slots.size () && looked != SAMPLE; ++step, idx = (idx + 1) & mask) {
+	const slot& s = m_slots[idx];
+	if (s.state == MATCH_UNKNOWN) {
+	  continue;
+	}
+	++looked;
+	if (victim == m_slots.size () ||
+	    (m_slots[victim].state == MATCH_PENDING) > (s.state == MATCH_PENDING) ||
+	    ((m_slots[victim].state == MATCH_PENDING) == (s.state == MATCH_PENDING) && s.seen < m_slots[victim].seen)) {
+	  victim = idx;
+	}
+      }
+      m_cursor = idx;
+      remove (victim);
+    }
+
+  public:
+    match_table (const size_t capacity,
+		 const uint64_t ttl) :
+      m_slots (MIN_SLOTS),
+      m_size (0),
+      m_capacity (capacity != 0 ? capacity : 1),
+      m_ttl (ttl),
+      m_cursor (0),
+      m_next_sweep (0)
+    {
+      for (size_t s = 0; s != MATCH_NO + 1; ++s) {
+	m_counts[s] = 0;
+      }
+    }
+
+    size_t size () const {
+      return m_size;
+    }
+
+    size_t capacity () const {
+      return m_capacity;
+    }
+
+    // Entries in state s (expired ones included until expire is called).
+    size_t count (const match_state s) const {
+      return m_counts[s];
+    }
+
+    match_state state (const fileid& fid,
+		       const uint64_t now) const {
+      const slot& s = m_slots[probe (fid)];
+      if (s.state == MATCH_UNKNOWN || expired (s, now)) {
+	return MATCH_UNKNOWN;
+      }
+      return s.state;
+    }
+
+    // Record the state of fid and that it was seen at now.
+    void set (const fileid& fid,
+	      const match_state state,
+	      const uint64_t now) {
+      if (state == MATCH_UNKNOWN) {
+	erase (fid);
+	return;
+      }
+
+      size_t idx = probe (fid);
+      if (m_slots[idx].state == MATCH_UNKNOWN) {
+	if (m_size == m_capacity) {
+	  evict ();
+	}
+	else if (2 * (m_size + 1) > m_slots.size ()) {
+	  resize (2 * m_slots.size ());
+	}
+	idx = probe (fid);
+	m_slots[idx].fid = fid;
+	++m_size;
+      }
+      else {
+	--m_counts[m_slots[idx].state];
+      }
+      m_slots[idx].state = state;
+      m_slots[idx].seen = now;
+      ++m_counts[state];
+    }
+
+    // Note that fid was seen at now if it is known.
+    void touch (const fileid& fid,
+		const uint64_t now) {
+      slot& s = m_slots[probe (fid)];
+      if (s.state != MATCH_UNKNOWN && s.seen < now) {
+	s.seen = now;
+      }
+    }
+
+    void erase (const fileid& fid) {
+      const size_t idx = probe (fid);
+      if (m_slots[idx].state != MATCH_UNKNOWN) {
+	remove (idx);
+      }
+    }
+
+    // Forget the entries that have not been seen for ttl.
+    // The table is swept at most four times per ttl so calling this often is cheap.
+    void expire (const uint64_t now) {
+      if (m_ttl == 0 || now < m_next_sweep) {
+	return;
+      }
+      m_next_sweep = now + m_ttl / 4;
+
+      std::vector<fileid> old;
+      for (size_t idx = 0; idx != m_slots.size (); ++idx) {
+	if (m_slots[idx].state != MATCH_UNKNOWN && expired (m_slots[idx], now)) {
+	  old.push_back (m_slots[idx].fid);
+	}
+      }
+      for (std::vector<fileid>::const_iterator pos = old.begin (); pos != old.end (); ++pos) {
+	erase (*pos);
+      }
+      // Give back memory after a burst.
+      size_t slots = m_slots.size ();
+      while (slots > MIN_SLOTS && 8 * m_size < slots) {
+	slots /= 2;
+      }
+      if (slots != m_slots.size ()) {
+	resize (slots);
+      }
+    }
+
+    // Append the fileids in state s to out.
+    void collect (const match_state s,
+		  std::vector<fileid>& out) const {
+      for (size_t idx = 0; idx != m_slots.size (); ++idx) {
+	if (m_slots[idx].state == s) {
+	  out.push_back (m_slots[idx].fid);
+	}
+      }
+    }
+  };
+
+}
+
+#endif
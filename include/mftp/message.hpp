@@ -7,9 +7,16 @@ namespace mftp {
   const uint32_t FRAGMENT = 0;
   const uint32_t REQUEST = 1;
   const uint32_t MATCH = 2;
+  const uint32_t CATALOG = 3;
+  const uint32_t MATCH_FILTER = 4;
 
   const uint32_t REQUEST_SIZE = 129;
   const uint32_t MATCHES_SIZE = 12;
+  const uint32_t CATALOG_SIZE = 13; // As many fileids as fit without making messages longer.
+  const uint32_t MATCH_FILTER_SIZE = 508; // Bytes of filter that fit without making messages longer.
+  const uint32_t MATCH_FILTER_HASHES = 11;
+  const uint32_t MAX_MATCH_FILTER_HASHES = 32;
+  const uint32_t MATCH_FILTER_CAPACITY = 256; // Fileids per filter for about one false positive in 2000.
 
   struct fragment
   {
@@ -89,6 +96,87 @@ namespace mftp {
     
   };
   
+  // The same as a match but as a Bloom filter over the fileids so a receiver can only test its own.
+  // The probes come from the digest (which is already uniform) so filters are the same on every host.
+  struct match_filter
+  {
+    fileid fid;
+    uint32_t match_count;
+    uint32_t hash_count;
+    uint8_t bits[MATCH_FILTER_SIZE];
+
+    static uint32_t word (const fileid& f,
+			  const size_t offset) {
+      return (uint32_t (f.hash[offset]) << 24) | (uint32_t (f.hash[offset + 1]) << 16) | (uint32_t (f.hash[offset + 2]) << 8) | uint32_t (f.hash[offset + 3]);
+    }
+
+    // Bit i of the k probed for f (Kirsch and Mitzenmacher).
+    static uint32_t probe (const fileid& f,
+			   const uint32_t i) {
+      const uint32_t h1 = word (f, 8) ^ f.type;
+      const uint32_t h2 = word (f, 12) ^ f.length;
+      return (h1 + i * h2 + i * i) % (8 * MATCH_FILTER_SIZE);
+    }
+
+    void insert (const fileid& f) {
+      for (uint32_t i = 0; i < hash_count; ++i) {
+	const uint32_t bit = probe (f, i);
+	bits[bit / 8] |= uint8_t (1 << (bit % 8));
+      }
+      ++match_count;
+    }
+
+    bool contains (const fileid& f) const {
+      for (uint32_t i = 0; i < hash_count; ++i) {
+	const uint32_t bit = probe (f, i);
+	if ((bits[bit / 8] & (1 << (bit % 8))) == 0) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+    void convert_to_network () {
+      fid.convert_to_network ();
+      match_count = htonl (match_count);
+      hash_count = htonl (hash_count);
+    }
+
+    bool convert_to_host () {
+      fid.convert_to_host ();
+      match_count = ntohl (match_count);
+      hash_count = ntohl (hash_count);
+      return match_count != 0 && hash_count != 0 && hash_count <= MAX_MATCH_FILTER_HASHES;
+    }
+  };
+
+  // Files held by the sender.
+  struct catalog
+  {
+    uint32_t fileid_count;
+    fileid fileids[CATALOG_SIZE];
+
+    void convert_to_network () {
+      for (uint32_t i = 0; i < fileid_count; ++i) {
+	fileids[i].convert_to_network ();
+      }
+      fileid_count = htonl (fileid_count);
+    }
+
+    bool convert_to_host () {
+      fileid_count = ntohl (fileid_count);
+
+      if (fileid_count == 0 || fileid_count > CATALOG_SIZE) {
+	return false;
+      }
+
+      for (uint32_t i = 0; i < fileid_count; ++i) {
+	fileids[i].convert_to_host ();
+      }
+      return true;
+    }
+  };
+
   struct message_header
   {
     uint32_t message_type;
@@ -105,6 +193,8 @@ namespace mftp {
   struct fragment_type { };
   struct request_type { };
   struct match_type { };
+  struct catalog_type { };
+  struct match_filter_type { };
 
   struct message
   {
@@ -113,6 +203,8 @@ namespace mftp {
       fragment frag;
       request req;
       match mat;
+      catalog cat;
+      match_filter filt;
     };
 
     message () { }
@@ -143,6 +235,22 @@ namespace mftp {
       mat.match_count = 0;
     }
 
+    message (catalog_type /* */)
+    {
+      header.message_type = CATALOG;
+      cat.fileid_count = 0;
+    }
+
+    message (match_filter_type /* */,
+	     const fileid& fid)
+    {
+      header.message_type = MATCH_FILTER;
+      filt.fid = fid;
+      filt.match_count = 0;
+      filt.hash_count = MATCH_FILTER_HASHES;
+      memset (filt.bits, 0, MATCH_FILTER_SIZE);
+    }
+
     void convert_to_network () {
       switch (header.message_type) {
       case FRAGMENT:
@@ -154,6 +262,12 @@ namespace mftp {
       case MATCH:
 	mat.convert_to_network ();
 	break;
+      case CATALOG:
+	cat.convert_to_network ();
+	break;
+      case MATCH_FILTER:
+	filt.convert_to_network ();
+	break;
       }
       header.convert_to_network ();
     }
@@ -167,6 +281,10 @@ namespace mftp {
 	return req.convert_to_host ();
       case MATCH:
 	return mat.convert_to_host ();
+      case CATALOG:
+	return cat.convert_to_host ();
+      case MATCH_FILTER:
+	return filt.convert_to_host ();
       default:
 	return false;
       }
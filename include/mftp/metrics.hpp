@@ -0,0 +1,303 @@
+#ifndef __metrics_hpp__
+#define __metrics_hpp__
+
+#include <mftp/fileid.hpp>
+
+#include <map>
+#include <pthread.h>
+#include <sstream>
+#include <string>
+#include <stdint.h>
+
+namespace mftp {
+
+  enum metric_type {
+    COUNTER,
+    GAUGE,
+  };
+
+  // A value updated by the protocol and read by an exporter thread.
+  // Updates are relaxed atomics so counting never takes a lock.
+  class metric {
+  private:
+    uint64_t m_value;
+
+  public:
+    metric () :
+      m_value (0)
+    { }
+
+    void add (const uint64_t n = 1) {
+      __atomic_fetch_add (&m_value, n, __ATOMIC_RELAXED);
+    }
+
+    void set (const uint64_t v) {
+      __atomic_store_n (&m_value, v, __ATOMIC_RELAXED);
+    }
+
+    uint64_t get () const {
+      return __atomic_load_n (&m_value, __ATOMIC_RELAXED);
+    }
+  };
+
+  // The metrics of a process by name and labels.
+  // Only creating and removing series takes the lock.
+  class metrics_registry {
+  private:
+    struct series
+    {
+      metric* value;
+      unsigned int references; // Owners that have asked for the series.
+
+      series () :
+	value (0),
+	references (0)
+      { }
+    };
+
+    typedef std::map<std::string, series> series_map; // By labels.
+
+    struct family
+    {
+      metric_type type;
+      std::string help;
+      series_map series;
+    };
+
+    mutable pthread_mutex_t m_lock;
+    std::map<std::string, family> m_families;
+
+    // Non-copyable.
+    metrics_registry (const metrics_registry&);
+    metrics_registry& operator= (const metrics_registry&);
+
+  public:
+    metrics_registry () {
+      pthread_mutex_init (&m_lock, 0);
+    }
+
+    ~metrics_registry () {
+      for (std::map<std::string, family>::iterator f = m_families.begin (); f != m_families.end (); ++f) {
+	for (series_map::iterator s = f->second.series.begin (); s != f->second.series.end (); ++s) {
+	  delete s->second.value;
+	}
+      }
+      pthread_mutex_destroy (&m_lock);
+    }
+
+    static metrics_registry& instance () {
+      static metrics_registry registry;
+      return registry;
+    }
+
+    // Returns the series with the given name and labels (e.g. fileid="...") creating it if necessary.
+    // Owners of the same series (an automaton and a reader of its counters) share it.
+    metric* get (const std::string& name,
+		 const std::string& labels,
+		 const metric_type type,
+		 const std::string& help) {
+      pthread_mutex_lock (&m_lock);
+      family& f = m_families[name];
+      f.type = type;
+      f.help = help;
+      series& s = f.series[labels];
+      if (s.value == 0) {
+	s.value = new metric ();
+      }
+      ++s.references;
+      metric* retval = s.value;
+      pthread_mutex_unlock (&m_lock);
+      return retval;
+    }
+
+    // Releases every series with the given labels once.
+    // A series is removed when its last owner releases it.
+    void release (const std::string& labels) {
+      pthread_mutex_lock (&m_lock);
+      for (std::map<std::string, family>::iterator f = m_families.begin (); f != m_families.end (); ++f) {
+	series_map::iterator s = f->second.series.find (labels);
+	if (s != f->second.series.end () && --s->second.references == 0) {
+	  delete s->second.value;
+	  f->second.series.erase (s);
+	}
+      }
+      pthread_mutex_unlock (&m_lock);
+    }
+
+    // The Prometheus text exposition format.
+    std::string render () const {
+      std::ostringstream out;
+      pthread_mutex_lock (&m_lock);
+      for (std::map<std::string, family>::const_iterator f = m_families.begin (); f != m_families.end (); ++f) {
+	if (f->second.series.empty ()) {
+	  continue;
+	}
+	out << "# HELP " << f->first << " " << f->second.help << "\n";
+	out << "# TYPE " << f->first << " " << (f->second.type == COUNTER ? "counter" : "gauge") << "\n";
+	for (series_map::const_iterator s = f->second.series.begin (); s != f->second.series.end (); ++s) {
+	  out << f->first;
+	  if (!s->first.empty ()) {
+	    out << "{" << s->first << "}";
+	  }
+	  out << " " << s->second.value->get () << "\n";
+	}
+      }
+      pthread_mutex_unlock (&m_lock);
+      return out.str ();
+    }
+  };
+
+  // How long the messages of one send class waited in a send queue (in microseconds).
+  // The sum and count give the mean delay over any interval.
+  struct queue_delay_metrics
+  {
+    const std::string labels;
+    metric* const dequeued;
+    metric* const delay;
+    metric* const max_delay;
+
+    queue_delay_metrics (const std::string& scope,
+			 const std::string& owner,
+			 const std::string& send_class) :
+      labels (owner + ",class=\"" + send_class + "\""),
+      dequeued (metrics_registry::instance ().get (scope + "_send_queue_dequeued_total", labels, COUNTER, "Messages taken from the send queue.")),
+      delay (metrics_registry::instance ().get (scope + "_send_queue_delay_microseconds_total", labels, COUNTER, "Time messages waited in the send queue.")),
+      max_delay (metrics_registry::instance ().get (scope + "_send_queue_delay_max_microseconds", labels, GAUGE, "Longest time a message waited in the send queue."))
+    { }
+
+    ~queue_delay_metrics () {
+      metrics_registry::instance ().release (labels);
+    }
+  };
+
+  // The delays of each send class of a queue (see send_queue.hpp).
+  struct send_queue_metrics
+  {
+    queue_delay_metrics control;
+    queue_delay_metrics announcement;
+    queue_delay_metrics data;
+
+    send_queue_metrics (const std::string& scope,
+			const std::string& owner) :
+      control (scope, owner, "control"),
+      announcement (scope, owner, "announcement"),
+      data (scope, owner, "data")
+    { }
+  };
+
+  // The series of the automaton aid for one file.
+  // Two automatons for the same file have series of their own so their gauges don't overwrite each other.
+  // They are released when the automaton goes away.
+  struct file_metrics
+  {
+    const std::string labels;
+    metric* const fragments_sent;
+    metric* const fragments_received;
+    metric* const fragments_duplicate;
+    metric* const fragments_corrupt;
+    metric* const fragments_suppressed;
+    metric* const requests_sent;
+    metric* const requests_received;
+    metric* const matches_sent;
+    metric* const matches_received;
+    metric* const bytes_sent;
+    metric* const send_queue_depth;
+    metric* const missing_intervals;
+    send_queue_metrics queue_delays;
+
+    static std::string make_labels (const fileid& fid,
+				    const int aid) {
+      std::ostringstream s;
+      s << "fileid=\"" << fid.to_string () << "\",aid=\"" << aid << "\"";
+      return s.str ();
+    }
+
+    file_metrics (const fileid& fid,
+		  const int aid) :
+      labels (make_labels (fid, aid)),
+      fragments_sent (metrics_registry::instance ().get ("mftp_file_fragments_sent_total", labels, COUNTER, "Fragments sent.")),
+      fragments_received (metrics_registry::instance ().get ("mftp_file_fragments_received_total", labels, COUNTER, "Fragments of the file received.")),
+      fragments_duplicate (metrics_registry::instance ().get ("mftp_file_fragments_duplicate_total", labels, COUNTER, "Fragments received that were already held.")),
+      fragments_corrupt (metrics_registry::instance ().get ("mftp_file_fragments_corrupt_total", labels, COUNTER, "Fragments received with an index outside the file.")),
+      fragments_suppressed (metrics_registry::instance ().get ("mftp_file_fragments_suppressed_total", labels, COUNTER, "Requested fragments not sent because a copy had just been sent.")),
+      requests_sent (metrics_registry::instance ().get ("mftp_file_requests_sent_total", labels, COUNTER, "Requests sent.")),
+      requests_received (metrics_registry::instance ().get ("mftp_file_requests_received_total", labels, COUNTER, "Requests received.")),
+      matches_sent (metrics_registry::instance ().get ("mftp_file_matches_sent_total", labels, COUNTER, "Match messages sent.")),
+      matches_received (metrics_registry::instance ().get ("mftp_file_matches_received_total", labels, COUNTER, "Match messages received.")),
+      bytes_sent (metrics_registry::instance ().get ("mftp_file_bytes_sent_total", labels, COUNTER, "Bytes of messages sent.")),
+      send_queue_depth (metrics_registry::instance ().get ("mftp_file_send_queue_depth", labels, GAUGE, "Messages waiting to be sent.")),
+      missing_intervals (metrics_registry::instance ().get ("mftp_file_missing_intervals", labels, GAUGE, "Runs of missing fragments (fragmentation of the interval set).")),
+      queue_delays ("mftp_file", labels)
+    { }
+
+    ~file_metrics () {
+      metrics_registry::instance ().release (labels);
+    }
+  };
+
+  // The series of one channel.
+  struct channel_metrics
+  {
+    const std::string labels;
+    metric* const datagrams_sent;
+    metric* const bytes_sent;
+    metric* const datagrams_received;
+    metric* const bytes_received;
+    metric* const datagrams_invalid;
+    metric* const datagrams_unrouted;
+    metric* const catalogs_sent;
+    metric* const catalogs_received;
+    metric* const send_queue_depth;
+    send_queue_metrics queue_delays;
+
+    static std::string make_labels (const int id) {
+      std::ostringstream s;
+      s << "channel=\"" << id << "\"";
+      return s.str ();
+    }
+
+    channel_metrics (const int id) :
+      labels (make_labels (id)),
+      datagrams_sent (metrics_registry::instance ().get ("mftp_channel_datagrams_sent_total", labels, COUNTER, "Datagrams sent.")),
+      bytes_sent (metrics_registry::instance ().get ("mftp_channel_bytes_sent_total", labels, COUNTER, "Bytes sent.")),
+      datagrams_received (metrics_registry::instance ().get ("mftp_channel_datagrams_received_total", labels, COUNTER, "Datagrams received.")),
+      bytes_received (metrics_registry::instance ().get ("mftp_channel_bytes_received_total", labels, COUNTER, "Bytes received.")),
+      datagrams_invalid (metrics_registry::instance ().get ("mftp_channel_datagrams_invalid_total", labels, COUNTER, "Datagrams that were not valid messages.")),
+      datagrams_unrouted (metrics_registry::instance ().get ("mftp_channel_datagrams_unrouted_total", labels, COUNTER, "Valid messages that no automaton wanted.")),
+      catalogs_sent (metrics_registry::instance ().get ("mftp_channel_catalogs_sent_total", labels, COUNTER, "Catalogs sent to announce the files held.")),
+      catalogs_received (metrics_registry::instance ().get ("mftp_channel_catalogs_received_total", labels, COUNTER, "Catalogs received.")),
+      send_queue_depth (metrics_registry::instance ().get ("mftp_channel_send_queue_depth", labels, GAUGE, "Messages waiting to be sent.")),
+      queue_delays ("mftp_channel", labels)
+    { }
+
+    ~channel_metrics () {
+      metrics_registry::instance ().release (labels);
+    }
+  };
+
+  // The series of the socket a channel reads one group on.
+  struct receiver_metrics
+  {
+    const std::string labels;
+    metric* const datagrams_dropped;
+
+    static std::string make_labels (const std::string& channel,
+				    const size_t group) {
+      std::ostringstream s;
+      s << channel << ",group=\"" << group << "\"";
+      return s.str ();
+    }
+
+    receiver_metrics (const std::string& l) :
+      labels (l),
+      datagrams_dropped (metrics_registry::instance ().get ("mftp_channel_datagrams_dropped_total", labels, COUNTER, "Datagrams dropped because the receive ring was full."))
+    { }
+
+    ~receiver_metrics () {
+      metrics_registry::instance ().release (labels);
+    }
+  };
+
+}
+
+#endif
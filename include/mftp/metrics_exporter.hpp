@@ -0,0 +1,48 @@
+#ifndef __metrics_exporter_hpp__
+#define __metrics_exporter_hpp__
+
+#include <mftp/metrics.hpp>
+
+#include <pthread.h>
+#include <string>
+
+namespace mftp {
+
+  // Publishes the metrics registry from a thread of its own.
+  // To a file, it rewrites the file atomically every interval.
+  // To a Unix socket, it writes the current metrics to each connection and closes it (e.g. socat - UNIX-CONNECT:path).
+  class metrics_exporter {
+  public:
+    enum export_mode {
+      FILE_EXPORT,
+      SOCKET_EXPORT,
+    };
+
+  private:
+    const std::string m_path;
+    const export_mode m_mode;
+    const unsigned int m_interval; // Seconds between writes of the file.
+    int m_fd; // Listening socket.
+    int m_stop;
+    pthread_t m_thread;
+
+    // Non-copyable.
+    metrics_exporter (const metrics_exporter&);
+    metrics_exporter& operator= (const metrics_exporter&);
+
+    void fail (const char* what,
+	       const int err) const;
+    static void* export_thread (void* arg);
+    void write_file () const;
+    void serve ();
+
+  public:
+    metrics_exporter (const std::string& path,
+		      const export_mode mode,
+		      const unsigned int interval = 10);
+    ~metrics_exporter ();
+  };
+
+}
+
+#endif
@@ -1,6 +1,10 @@
 #ifndef __mftp_hpp__
 #define __mftp_hpp__
 
+#include <mftp/capture.hpp>
+#include <mftp/metrics_exporter.hpp>
 #include <mftp/mftp_automaton.hpp>
+#include <mftp/profile.hpp>
+#include <mftp/trace.hpp>
 
 #endif
@@ -1,14 +1,56 @@
 #ifndef __mftp_automaton_hpp__
 #define	__mftp_automaton_hpp__
 
+#include <mftp/download_budget.hpp>
 #include <mftp/match.hpp>
+#include <mftp/match_table.hpp>
+#include <mftp/metrics.hpp>
 #include <mftp/mftp_channel_automaton.hpp>
-#include <ioa/alarm_automaton.hpp>
-
+#include <mftp/prng.hpp>
+#include <mftp/rerequest_estimator.hpp>
+#include <mftp/rtt_estimator.hpp>
+#include <mftp/send_queue.hpp>
+#include <mftp/serving_queue.hpp>
+#include <mftp/simulator_automaton.hpp>
+#include <mftp/trace.hpp>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
 #include <queue>
 #include <set>
 
 namespace mftp {
+
+  // How a download finishes.
+  // Once a download has worked its way down to few missing fragments, every one of them is requested at short, jittered intervals instead of waiting out the back-off.
+  // Rounds that bring nothing hand the download back to the back-off until a fragment arrives.
+  struct endgame_config
+  {
+    uint32_t threshold; // Missing fragments at which the endgame starts (0 never starts it).
+    ioa::time interval; // Mean time between endgame requests (ioa::time () for a round trip plus the time the missing fragments take to arrive).
+    uint32_t copies; // Requests sent each time so a lost request doesn't cost a round.
+    uint32_t rounds; // Unanswered rounds before falling back to the back-off.
+
+    endgame_config () :
+      threshold (REQUEST_SIZE),
+      copies (1),
+      rounds (4)
+    { }
+  };
+
+  // How much a matching automaton remembers about the files it has checked.
+  struct match_config
+  {
+    size_t capacity; // Files remembered (the least recently seen make room).
+    ioa::time ttl; // Files not seen for this long are forgotten (ioa::time () never).
+
+    match_config () :
+      capacity (65536),
+      ttl (3600, 0)
+    { }
+  };
     
   class mftp_automaton :
     public ioa::automaton
@@ -19,74 +61,145 @@ namespace mftp {
       SEND_COMPLETE_WAIT
     };
 
-    enum alarm_state_t {
-      SET_READY,
-      INTERRUPT_WAIT,
-    };
-
-    static const ioa::time ALARM_INTERVAL;
-    static const ioa::time INIT_INTERVAL;
+    static const ioa::time MIN_ALARM;
     static const ioa::time MAX_INTERVAL;
     static const uint32_t MAX_FRAGMENT_COUNT;
-    static const uint32_t SHUFFLE_LIMIT;
     static const uint32_t REREQUEST_NUMERATOR;
     static const uint32_t REREQUEST_DENOMINATOR;
+    static const uint64_t INIT_RTT;
+    static const uint64_t MIN_RTO;
+    static const uint64_t MAX_RTO;
+    static const uint32_t MAX_WINDOWS;
+    static const uint64_t MIN_SUPPRESS;
+    static const uint64_t MAX_SUPPRESS;
+    static const ioa::time ADMISSION_RETRY;
+    static const size_t MAX_QUEUED_CANDIDATES;
+    static const ioa::time MATCH_IDLE;
+    static const uint32_t MATCH_PROGRESS;
+
+    // Why a match candidate is worth downloading, best first.
+    enum candidate_source {
+      CLAIMED, // Somebody said it matches.
+      LISTED, // Somebody holds it.
+      HEARD, // A fragment of it went by.
+    };
+
+    // A match candidate waiting for room to download.
+    struct queued_candidate
+    {
+      candidate_source source;
+      fileid fid;
+
+      queued_candidate (const candidate_source s,
+			const fileid& f) :
+	source (s),
+	fid (f)
+      { }
+
+      // Best first and then smaller files.
+      bool operator< (const queued_candidate& other) const {
+	if (source != other.source) {
+	  return source < other.source;
+	}
+	if (fid.length != other.fid.length) {
+	  return fid.length < other.fid.length;
+	}
+	return fid < other.fid;
+      }
+    };
+
+    // A request whose fragments are still arriving.
+    struct request_window
+    {
+      ioa::time sent; // When the request left.
+      std::set<uint32_t> fragments; // Fragments it named.
+      uint32_t arrived; // Fragments it named that have arrived.
+      bool sampled; // It has produced a round-trip sample.
+
+      request_window () :
+	arrived (0),
+	sampled (false)
+      { }
+    };
 
     ioa::handle_manager<mftp_automaton> m_self;
     ioa::const_shared_ptr<file> m_file;
     file* m_file_ptr;
     const mfileid& m_mfileid;
     const fileid& m_fileid;
+    file_metrics m_metrics; // Exported counters.
 
     ioa::handle_manager<mftp_channel_automaton> m_channel; // The channel for sending/receiving.
+    std::auto_ptr<ioa::handle_manager<simulator_automaton> > m_simulator; // Source of timers in virtual time (the channel otherwise).
+    bool m_subscribed; // True when the channel knows what to deliver to us.
+    bool m_announced; // The channel lists the file in its catalogs.
 
     // Sending.
-    std::queue<ioa::const_shared_ptr<std::string> > m_sendq; // Send queue.
+    send_queue<ioa::const_shared_ptr<std::string> > m_sendq; // Send queue (control, then data).
     send_state_t m_send_state; // State of send state machine.
     uint32_t m_num_frag_in_sendq; // Number of fragments in the send queue.
     uint32_t m_num_req_in_sendq; // Number of requests in the send queue.
     uint32_t m_num_match_in_sendq; // Number of matches in the send queue.
 
     // Answering requests.
-    std::set<uint32_t> m_requests_set; // Set of fragments that have been requested.
-    std::deque<uint32_t> m_requests_deque; // Superset of set organized as deque.
-    uint32_t m_inserts_since_shuffle; // Number of inserts since shuffle.
+    serving_queue m_serving; // Requested fragments, most requested first.
+    std::map<uint32_t, ioa::time> m_recent_sends; // Fragments multicast within the suppression window and when.
+    std::deque<std::pair<ioa::time, uint32_t> > m_recent_order; // The same in time order for expiry.
+    rerequest_estimator m_rerequests; // How soon receivers ask again for a fragment.
 
     // Making requests.
     uint32_t m_request_idx; // Index for requests.
-    uint32_t m_last_request_size; // Number of fragments in last request (<= REQUEST_SIZE).
-    uint32_t m_fragments_since_request; // Number of fragments received since request.
+    prng m_prng; // Jitter for endgame requests.
+    ioa::time m_endgame_due; // When the next endgame request is sent.
+    const uint32_t m_initial_missing; // Fragments missing when the automaton started (the endgame is for downloads that started above its threshold).
+    uint32_t m_endgame_rounds; // Endgame rounds sent since a new fragment last arrived.
+    std::list<request_window> m_windows; // Outstanding requests (naming disjoint fragments while enough are missing), oldest first.
 
     // Timestamps for certain events.
     ioa::time m_frag_recv_time; // Time when this automaton last received a fragment (of this file).
     ioa::time m_request_timeout_start; // Time when this automaton last sent a request or received a fragment (of this file).
     ioa::time m_match_time; // Time when this automaton last received a match (of this file).
+    ioa::time m_last_arrival; // Time when this automaton last received a new fragment.
+
+    // Round-trip time and arrival rate.
+    rtt_estimator m_rtt; // Latency from sending a request to receiving a fragment it named.
+    uint64_t m_arrival_interval; // Smoothed microseconds between new fragments (0 until measured).
 
     // Periodic acitivities.
-    alarm_state_t m_alarm_state; // State of alarm state machine.
-    ioa::time m_announcement_interval; // Must wait this amount of time after m_fragment_time to send an announcement.
+    ioa::time m_armed; // Deadline the timer is set for (ioa::time () when it is not set).
     ioa::time m_request_interval; // Must wait this amount of time after m_request_time to send a request for timeout.
     ioa::time m_match_interval; // Must wait this amount of time after m_match_time to send a match.
 
     // Reporting progress.
     uint32_t m_fragments_since_report; // Number of fragments received since last progress report.
-    uint32_t m_progress_threshold; // Accumulate this many fragments before reporting progress.
+    uint32_t m_progress_threshold; // Accumulate this many fragments before reporting progress (the first fragment is reported at once).
 
     // Matching.
     const bool m_matching; // Try to find matches for this file.
     std::auto_ptr<match_candidate_predicate> m_match_candidate_predicate;
     std::auto_ptr<match_predicate> m_match_predicate;
+    candidate_key m_candidate_key;
+    bool m_candidate_keyed; // Candidates are exactly the fileids with the type and length of m_candidate_key.
     const bool m_get_matching_files; // Always get matching files.
-    std::set<fileid> m_pending_matches; // Fileids that are pending a download for matching.
-    std::set<fileid> m_matches; // Fileids that match.
-    std::set<fileid> m_non_matches; // Fileids that don't match.
+    match_table m_match_states; // Other files we have checked or are checking.
     std::queue<ioa::const_shared_ptr<file> > m_matching_files; // Queue of matching files.
+    bool m_match_heard; // A match naming this file has been heard.
+    bool m_match_heard_reported; // True when we have reported hearing a match.
+    std::set<queued_candidate> m_candidates; // Candidates waiting for room in the node's download budget.
+    download_leases m_downloading; // Candidates downloading under the budget.
+    std::map<fileid, ioa::automaton_manager<mftp_automaton>*> m_children; // The automatons downloading them.
+    ioa::time m_admission_time; // When the budget last turned a candidate away.
 
     // Termination.
     bool m_suicide_flag;  // Self-destruct when job is done.
     bool m_reported; // True when we have reported a complete download.
 
   public:
+    // Applies to every automaton in the process.
+    static void set_endgame (const endgame_config& config);
+    static void set_match_config (const match_config& config);
+    static void set_download_limits (const download_limits& limits);
+
     // Not matching.
     mftp_automaton (std::auto_ptr<file> file,
 		    const ioa::automaton_handle<mftp_channel_automaton>& channel,
@@ -118,12 +231,36 @@ namespace mftp {
   private:
     void create_bindings ();
     void schedule () const;
+    bool new_match_candidate (const fileid& fid);
+    void claimed_match (const fileid& fid);
+    void queue_match_candidate (const fileid& fid,
+				const candidate_source source);
+    void start_downloads ();
+    void expire_downloads ();
+    void fetch_match_candidate (std::auto_ptr<file> f);
     void process_match_candidate (const ioa::const_shared_ptr<file>& f);
     std::string* get_fragment (uint32_t idx);
-    void send_announcement ();
     void send_request ();
+    void queue_request (const ioa::time& now);
+    bool in_endgame () const;
+    ioa::time endgame_interval ();
     void send_match (bool reset);
     void add_match (const fileid& fid);
+    uint64_t suppress_window () const;
+    void note_sent (const uint32_t idx,
+		    const ioa::time& now);
+    void expire_sends (const ioa::time& now);
+    void note_requested (const uint32_t idx,
+			 const ioa::time& now);
+    ioa::time initial_interval () const;
+    ioa::time next_deadline () const;
+    ioa::time window_due (const request_window& w) const;
+    uint32_t target_windows () const;
+    void expire_windows (const ioa::time& now);
+    void fragment_arrived (const uint32_t idx,
+			   const ioa::time& now);
+    bool recently_sent (const uint32_t idx,
+			const ioa::time& now);
 
     bool send_precondition () const;
     ioa::const_shared_ptr<std::string> send_effect ();
@@ -134,6 +271,11 @@ namespace mftp {
     void send_complete_schedule () const { schedule (); }
     UV_UP_INPUT (mftp_automaton, send_complete);
 
+    bool subscribe_precondition () const;
+    subscription subscribe_effect ();
+    void subscribe_schedule () const { schedule (); }
+    V_UP_OUTPUT (mftp_automaton, subscribe, subscription);
+
     void receive_effect (const ioa::const_shared_ptr<message>& m);
     void receive_schedule () const { schedule (); }
     V_UP_INPUT (mftp_automaton, receive, ioa::const_shared_ptr<message>);
@@ -162,6 +304,11 @@ namespace mftp {
     void match_download_complete_schedule (ioa::aid_t) const { schedule (); }
     V_AP_INPUT (mftp_automaton, match_download_complete, ioa::const_shared_ptr<file>);
 
+    void match_download_progress_effect (const uint32_t& have,
+					 ioa::aid_t aid);
+    void match_download_progress_schedule (ioa::aid_t) const { schedule (); }
+    V_AP_INPUT (mftp_automaton, match_download_progress, uint32_t);
+
   private:
     bool fragment_count_precondition () const;
     uint32_t fragment_count_effect ();
@@ -182,6 +329,14 @@ namespace mftp {
     void match_complete_schedule () const { schedule (); }
   public:
     V_UP_OUTPUT (mftp_automaton, match_complete, ioa::const_shared_ptr<file>);
+
+  private:
+    bool match_heard_precondition () const;
+    void match_heard_effect ();
+    void match_heard_schedule () const { schedule (); }
+  public:
+    // The first match naming this file has been heard (before the matching file is fetched).
+    UV_UP_OUTPUT (mftp_automaton, match_heard);
   };
 }
 
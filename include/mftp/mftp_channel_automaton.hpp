@@ -2,26 +2,119 @@
 #define __mftp_channel_automaton_hpp__
 
 #include <ioa/udp_sender_automaton.hpp>
-#include <ioa/udp_receiver_automaton.hpp>
+#include <mftp/loopback_medium_automaton.hpp>
+#include <mftp/match.hpp>
+#include <mftp/mftp_receiver_automaton.hpp>
 #include <mftp/message.hpp>
+#include <mftp/metrics.hpp>
+#include <mftp/send_queue.hpp>
+#include <mftp/shard_map.hpp>
+#include <mftp/simulator_automaton.hpp>
+#include <mftp/timer_wheel.hpp>
+#include <ioa/alarm_automaton.hpp>
 
+#include <deque>
 #include <queue>
+#include <tr1/unordered_map>
 
 namespace mftp {
 
+  // What an automaton wants to receive from the channel.
+  struct subscription
+  {
+    fileid fid; // Fragments, requests, and matches for this file.
+    bool match_candidates; // Fragments, matches, and catalogs that could be candidates for a match.
+    bool held; // The automaton has some of the file so the channel lists it in catalogs.
+    bool keyed; // Candidates are only fileids with the type and length of key.
+    candidate_key key;
+
+    subscription () { }
+
+    subscription (const fileid& f,
+		  const bool candidates,
+		  const bool h,
+		  const bool k,
+		  const candidate_key& ck) :
+      fid (f),
+      match_candidates (candidates),
+      held (h),
+      keyed (k),
+      key (ck)
+    { }
+  };
+
+  // Besides moving messages, the channel keeps one timer for each automaton bound to set_timer.
+  // The timers share a timer_wheel and a few alarms so idle automatons cost nothing.
+  // It also announces the files its automatons hold with catalogs, CATALOG_SIZE files to a datagram.
+  // Catalogs back off while nothing changes and stop when nobody has requested or matched for a while.
   class mftp_channel_automaton :
     public ioa::automaton,
     private ioa::observer
   {
   private:
+    static const ioa::time TIMER_TICK;
+    static const ioa::time MAX_SLEEP;
+    static const size_t ALARM_COUNT;
+    static const ioa::time CATALOG_INTERVAL;
+    static const ioa::time MAX_CATALOG_INTERVAL;
+    static const ioa::time CATALOG_QUIET;
+    static const ioa::time MAX_CATALOG_WAIT;
+    static const size_t CATALOG_ECHOES;
+
+    enum alarm_state_t {
+      SET_READY,
+      INTERRUPT_WAIT,
+    };
+
     ioa::handle_manager<mftp_channel_automaton> m_self;
     typedef std::pair<ioa::const_shared_ptr<std::string>, ioa::aid_t> message_aid;
-    std::list<message_aid > m_outgoing_messages;
+    send_queue<message_aid> m_outgoing_messages; // Control messages go out before fragments.
     std::set<ioa::aid_t> m_outgoing_set;
     ioa::aid_t m_pending_aid;
     std::set<ioa::aid_t> m_outgoing_completes;
-    const ioa::inet_address m_send;
-    std::queue<ioa::const_shared_ptr<mftp::message> > m_incoming_messages;
+    const shard_map m_shards; // Where messages are sent.
+    const ioa::inet_address m_local;
+    const bool m_multicast;
+    const receiver_config m_receiver_config;
+    std::vector<ioa::automaton_manager<mftp_receiver_automaton>*> m_receivers; // One per joined group.
+    std::vector<size_t> m_group_members; // Subscriptions in each group (the channel counts as one in group 0).
+    std::auto_ptr<ioa::handle_manager<loopback_medium_automaton> > m_medium; // Replaces the sockets when set.
+
+    // Receiving.
+    typedef std::tr1::unordered_map<fileid, std::set<ioa::aid_t>, fileid_hash> fileid_map;
+    fileid_map m_owners; // Automatons subscribed to a fileid.
+    std::set<ioa::aid_t> m_match_listeners; // Automatons looking for match candidates.
+    typedef std::tr1::unordered_map<candidate_key, std::set<ioa::aid_t>, candidate_key_hash> key_map;
+    key_map m_keyed_listeners; // Match listeners that only take candidates of one type and length.
+    std::set<ioa::aid_t> m_open_listeners; // Match listeners that must see every candidate.
+    std::map<ioa::aid_t, subscription> m_subscriptions;
+    typedef std::map<ioa::aid_t, std::queue<ioa::const_shared_ptr<mftp::message> > > incoming_map;
+    incoming_map m_incoming_messages; // Only automatons with pending messages have an entry.
+
+    // Kernel filtering.
+    const bool m_kernel_filter; // Install a socket filter built from the subscriptions.
+    bool m_filter_changed; // The subscriptions have changed since the last filter.
+    channel_metrics m_metrics; // Exported counters.
+
+    // Timers.
+    const ioa::time m_epoch; // Tick 0 of the wheel.
+    timer_wheel<ioa::aid_t> m_timers; // Deadlines in ticks.
+    std::set<ioa::aid_t> m_fired; // Automatons whose deadline has passed.
+    std::map<ioa::aid_t, ioa::time> m_alarms; // The wakeup each alarm is set for (ioa::time () when idle).
+
+    // Catalogs.
+    const ioa::aid_t m_aid; // Catalogs wait in the outgoing queue under our own aid.
+    std::auto_ptr<ioa::handle_manager<simulator_automaton> > m_simulator; // Source of the catalog alarm in virtual time.
+    std::map<fileid, size_t> m_held; // Files held by some automaton and how many hold them.
+    bool m_catalog_pending; // A cycle through m_held is under way.
+    bool m_catalog_quiet; // Nobody has shown interest for CATALOG_QUIET so catalogs have stopped.
+    size_t m_catalog_listed; // Files listed in this cycle.
+    fileid m_catalog_last; // The last file listed in this cycle.
+    ioa::time m_catalog_time; // When the next cycle starts.
+    ioa::time m_catalog_interval; // Time between cycles, doubled after each.
+    ioa::time m_interest_time; // When the last request or match was heard.
+    std::deque<ioa::const_shared_ptr<std::string> > m_catalogs_sent; // Our latest catalogs so that their multicast loopback can be dropped.
+    alarm_state_t m_catalog_alarm_state;
 
     struct message_aid_equal {
       const ioa::aid_t m_aid;
@@ -38,11 +131,41 @@ namespace mftp {
   public:
     mftp_channel_automaton (const ioa::inet_address& send_address,
 			    const ioa::inet_address& local_address,
-			    const bool multicast);
+			    const bool multicast,
+			    const bool kernel_filter = false,
+			    const receiver_config& config = receiver_config ());
+
+    // Multicast on a control group with file data sharded across data groups.
+    mftp_channel_automaton (const shard_map& shards,
+			    const ioa::inet_address& local_address,
+			    const bool kernel_filter = false,
+			    const receiver_config& config = receiver_config ());
+
+    // Attached to a simulated medium instead of the network.
+    mftp_channel_automaton (const ioa::automaton_handle<loopback_medium_automaton>& medium);
   private:
+    void create_bindings ();
+    void join (const size_t group);
+    void leave (const size_t group);
+    size_t destination (const std::string& buffer) const;
     void schedule () const;
     void observe (ioa::observable* o);
     void purge (const ioa::aid_t aid);
+    void unsubscribe (const ioa::aid_t aid);
+    void add_owners (const fileid& fid,
+		     const bool listeners_only,
+		     std::set<ioa::aid_t>& targets) const;
+    void add_candidate_listeners (const fileid& fid,
+				  std::set<ioa::aid_t>& targets) const;
+    uint64_t tick_of (const ioa::time& t) const;
+    ioa::time time_of (const uint64_t tick) const;
+    void advance_timers ();
+    bool wakeup_needed () const;
+    void hold (const fileid& fid);
+    void release (const fileid& fid);
+    void note_interest (const ioa::time& now);
+    bool own_catalog (const std::string& buffer);
+    void queue_catalog (const ioa::time& now);
 
     void send_effect (const ioa::const_shared_ptr<std::string>& message,
 		      ioa::aid_t aid);
@@ -68,15 +191,61 @@ namespace mftp {
     UV_AP_OUTPUT (mftp_channel_automaton, send_complete);
 
   private:
-    void receive_in_effect (const ioa::udp_receiver_automaton::receive_val& rv);
+    void subscribe_effect (const subscription& s,
+			   ioa::aid_t aid);
+    void subscribe_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    V_AP_INPUT (mftp_channel_automaton, subscribe, subscription);
+
+  private:
+    bool filter_precondition () const;
+    ioa::const_shared_ptr<fileid_filter> filter_effect ();
+    void filter_schedule () const { schedule (); }
+    V_UP_OUTPUT (mftp_channel_automaton, filter, ioa::const_shared_ptr<fileid_filter>);
+
+    void receive_in_effect (const mftp_receiver_automaton::receive_val& rv);
     void receive_in_schedule () const { schedule (); }
-    V_UP_INPUT (mftp_channel_automaton, receive_in, ioa::udp_receiver_automaton::receive_val);
+    V_UP_INPUT (mftp_channel_automaton, receive_in, mftp_receiver_automaton::receive_val);
 
-    bool receive_precondition () const;
-    ioa::const_shared_ptr<mftp::message> receive_effect ();
-    void receive_schedule () const { schedule (); }
+    bool receive_precondition (ioa::aid_t aid) const;
+    ioa::const_shared_ptr<mftp::message> receive_effect (ioa::aid_t aid);
+    void receive_schedule (ioa::aid_t) const { schedule (); }
   public:
-    V_UP_OUTPUT (mftp_channel_automaton, receive, ioa::const_shared_ptr<mftp::message>);
+    V_AP_OUTPUT (mftp_channel_automaton, receive, ioa::const_shared_ptr<mftp::message>);
+
+  private:
+    void set_timer_effect (const ioa::time& interval,
+			   ioa::aid_t aid);
+    void set_timer_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    // Fire timer after interval, replacing any timer the automaton has.
+    V_AP_INPUT (mftp_channel_automaton, set_timer, ioa::time);
+
+  private:
+    bool timer_precondition (ioa::aid_t aid) const;
+    void timer_effect (ioa::aid_t aid);
+    void timer_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    UV_AP_OUTPUT (mftp_channel_automaton, timer);
+
+  private:
+    bool set_alarm_precondition (ioa::aid_t aid) const;
+    ioa::time set_alarm_effect (ioa::aid_t aid);
+    void set_alarm_schedule (ioa::aid_t) const { schedule (); }
+    V_AP_OUTPUT (mftp_channel_automaton, set_alarm, ioa::time);
+
+    void alarm_interrupt_effect (ioa::aid_t aid);
+    void alarm_interrupt_schedule (ioa::aid_t) const { schedule (); }
+    UV_AP_INPUT (mftp_channel_automaton, alarm_interrupt);
+
+    bool set_catalog_alarm_precondition () const;
+    ioa::time set_catalog_alarm_effect ();
+    void set_catalog_alarm_schedule () const { schedule (); }
+    V_UP_OUTPUT (mftp_channel_automaton, set_catalog_alarm, ioa::time);
+
+    void catalog_alarm_interrupt_effect ();
+    void catalog_alarm_interrupt_schedule () const { schedule (); }
+    UV_UP_INPUT (mftp_channel_automaton, catalog_alarm_interrupt);
   };
 
 }
@@ -0,0 +1,102 @@
+#ifndef __mftp_receiver_automaton_hpp__
+#define __mftp_receiver_automaton_hpp__
+
+#include <mftp/fileid_filter.hpp>
+#include <mftp/metrics.hpp>
+#include <mftp/spsc_ring.hpp>
+#include <ioa/ioa.hpp>
+
+#include <pthread.h>
+#include <queue>
+
+namespace mftp {
+
+  // How a receiver reads its socket.
+  struct receiver_config
+  {
+    bool io_thread; // Read the socket on a dedicated thread so protocol work can't overflow the socket buffer.
+    size_t ring_size; // Datagrams buffered between the I/O thread and the automaton.
+    int busy_poll; // Microseconds to busy poll the device when the socket is empty (SO_BUSY_POLL), 0 to disable.
+
+    receiver_config () :
+      io_thread (false),
+      ring_size (4096),
+      busy_poll (0)
+    { }
+  };
+
+  // Receives datagrams on a UDP socket that it owns so the socket can carry a filter.
+  class mftp_receiver_automaton :
+    public ioa::automaton
+  {
+  public:
+    struct receive_val
+    {
+      ioa::const_shared_ptr<std::string> buffer;
+
+      receive_val () { }
+
+      receive_val (const ioa::const_shared_ptr<std::string>& b) :
+	buffer (b)
+      { }
+    };
+
+  private:
+    static const size_t MAX_BATCH;
+
+    const receiver_config m_config;
+    int m_fd;
+    std::queue<receive_val> m_incoming;
+
+    // I/O thread.
+    pthread_t m_thread;
+    spsc_ring<std::string*>* m_ring; // Datagrams from the I/O thread.
+    int m_notify[2]; // Pipe used by the I/O thread to wake the automaton.
+    int m_wakeup; // Set by the I/O thread when it has written to the pipe.
+    int m_stop; // Set by the automaton to stop the I/O thread.
+    receiver_metrics m_metrics; // Exported counters (datagrams dropped because the ring was full).
+
+    void open_socket (const ioa::inet_address& local_address);
+    void start ();
+    void fail (const char* what,
+	       const int err) const;
+    static void* io_thread (void* arg);
+    void io_loop ();
+
+  public:
+    // Unicast.
+    // The labels name the series of the receiver (see receiver_metrics).
+    mftp_receiver_automaton (const ioa::inet_address& local_address,
+			     const std::string& metric_labels,
+			     const receiver_config& config = receiver_config ());
+    // Multicast.
+    mftp_receiver_automaton (const ioa::inet_address& group_address,
+			     const ioa::inet_address& local_address,
+			     const std::string& metric_labels,
+			     const receiver_config& config = receiver_config ());
+    ~mftp_receiver_automaton ();
+
+  private:
+    void schedule () const;
+
+    bool read_precondition () const;
+    void read_effect ();
+    void read_schedule () const;
+    UP_INTERNAL (mftp_receiver_automaton, read);
+
+    void set_filter_effect (const ioa::const_shared_ptr<fileid_filter>& filter);
+    void set_filter_schedule () const { schedule (); }
+  public:
+    V_UP_INPUT (mftp_receiver_automaton, set_filter, ioa::const_shared_ptr<fileid_filter>);
+
+  private:
+    bool receive_precondition () const;
+    receive_val receive_effect ();
+    void receive_schedule () const { schedule (); }
+  public:
+    V_UP_OUTPUT (mftp_receiver_automaton, receive, receive_val);
+  };
+
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef __prng_hpp__
+#define __prng_hpp__
+
+#include <stdint.h>
+
+namespace mftp {
+
+  // A small, fast, seedable generator (xorshift64*) so runs can be reproduced.
+  class prng
+  {
+  private:
+    uint64_t m_state;
+
+  public:
+    explicit prng (const uint64_t seed) :
+      m_state (seed != 0 ? seed : 0x9E3779B97F4A7C15ULL)
+    { }
+
+    uint64_t next () {
+      m_state ^= m_state >> 12;
+      m_state ^= m_state << 25;
+      m_state ^= m_state >> 27;
+      return m_state * 2685821657736338717ULL;
+    }
+
+    // Uniform in [0, 1).
+    double uniform () {
+      return (next () >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Uniform in [0, n).
+    uint32_t below (const uint32_t n) {
+      return static_cast<uint32_t> (next () % n);
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __profile_hpp__
+#define __profile_hpp__
+
+#include <stdint.h>
+#include <string>
+
+#if !defined (__i386__) && !defined (__x86_64__)
+#include <time.h>
+#endif
+
+namespace mftp {
+
+  // Cycles (or nanoseconds where there is no time stamp counter).
+  inline uint64_t cycles () {
+#if defined (__i386__) || defined (__x86_64__)
+    uint32_t lo;
+    uint32_t hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return (uint64_t (hi) << 32) | lo;
+#else
+    timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return uint64_t (ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+  }
+
+  // Counts samples by the power of two below them.
+  struct cycle_histogram
+  {
+    static const unsigned int BUCKETS = 64;
+
+    const char* name;
+    uint64_t count;
+    uint64_t total;
+    uint64_t buckets[BUCKETS];
+
+    void record (const uint64_t c) {
+      ++count;
+      total += c;
+      ++buckets[c == 0 ? 0 : 63 - __builtin_clzll (c)];
+    }
+  };
+
+  // Histograms of the cycles spent in actions.
+  // Instrumentation is compiled in by configure --enable-profiling (MFTP_PROFILE).
+  class profile {
+  public:
+    // True if the library was built with profiling.
+    static bool available ();
+    // Write the histograms to path at exit and whenever the process receives SIGUSR1.
+    static void enable (const std::string& path);
+    static void dump ();
+    // The histogram of a site, created on first use.
+    static cycle_histogram* get (const char* name);
+  };
+
+  // Records the cycles from construction to destruction.
+  class profile_scope {
+  private:
+    cycle_histogram* const m_histogram;
+    const uint64_t m_start;
+
+  public:
+    profile_scope (cycle_histogram* histogram) :
+      m_histogram (histogram),
+      m_start (cycles ())
+    { }
+
+    ~profile_scope () {
+      if (m_histogram != 0) {
+	m_histogram->record (cycles () - m_start);
+      }
+    }
+  };
+
+}
+
+// Profile the rest of the enclosing block.
+// Sources that use it include config.hpp first.
+#ifdef MFTP_PROFILE
+#define MFTP_PROFILE_SCOPE(name) \
+  static mftp::cycle_histogram* const mftp_profile_histogram = mftp::profile::get (name); \
+  mftp::profile_scope mftp_profile_scope (mftp_profile_histogram)
+#else
+#define MFTP_PROFILE_SCOPE(name)
+#endif
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __rerequest_estimator_hpp__
+#define __rerequest_estimator_hpp__
+
+#include <mftp/rtt_estimator.hpp>
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+
+namespace mftp {
+
+  // How soon receivers ask again for a fragment, as seen by a server (in microseconds).
+  // Requests don't say who sent them so a gap shorter than the window it is measured against is taken as a burst
+  // (several receivers missing the same fragment or copies of one request) and not sampled.
+  class rerequest_estimator
+  {
+  private:
+    rtt_estimator m_interval;
+    const uint64_t m_horizon; // Longer gaps are not measured.
+    std::map<uint32_t, uint64_t> m_last; // When each fragment within the horizon was last requested.
+    std::deque<std::pair<uint64_t, uint32_t> > m_order; // The same in time order for expiry.
+
+  public:
+    rerequest_estimator (const uint64_t initial,
+			 const uint64_t horizon) :
+      m_interval (initial),
+      m_horizon (horizon)
+    { }
+
+    bool sampled () const {
+      return m_interval.sampled ();
+    }
+
+    uint64_t interval () const {
+      return m_interval.srtt ();
+    }
+
+    // Note a request for idx at now where gaps shorter than burst belong to one round of requests.
+    void request (const uint32_t idx,
+		  const uint64_t now,
+		  const uint64_t burst) {
+      std::map<uint32_t, uint64_t>::iterator pos = m_last.find (idx);
+      if (pos != m_last.end ()) {
+	if (now < pos->second + burst) {
+	  // Same round so the round keeps its start.
+	  return;
+	}
+	m_interval.sample (now - pos->second);
+      }
+      m_last[idx] = now;
+      m_order.push_back (std::make_pair (now, idx));
+
+      while (m_order.front ().first + m_horizon <= now) {
+	pos = m_last.find (m_order.front ().second);
+	if (pos != m_last.end () && pos->second == m_order.front ().first) {
+	  m_last.erase (pos);
+	}
+	m_order.pop_front ();
+      }
+    }
+  };
+
+}
+
+#endif
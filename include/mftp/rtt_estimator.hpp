@@ -0,0 +1,59 @@
+#ifndef __rtt_estimator_hpp__
+#define __rtt_estimator_hpp__
+
+#include <stdint.h>
+
+namespace mftp {
+
+  // Smoothed round-trip time and its mean deviation in microseconds (the estimator of RFC 6298).
+  class rtt_estimator
+  {
+  private:
+    uint64_t m_srtt;
+    uint64_t m_rttvar;
+    bool m_sampled;
+
+  public:
+    // The estimate until the first sample.
+    rtt_estimator (const uint64_t initial) :
+      m_srtt (initial),
+      m_rttvar (initial / 2),
+      m_sampled (false)
+    { }
+
+    void sample (const uint64_t rtt) {
+      if (!m_sampled) {
+	m_srtt = rtt;
+	m_rttvar = rtt / 2;
+	m_sampled = true;
+      }
+      else {
+	const uint64_t err = rtt > m_srtt ? rtt - m_srtt : m_srtt - rtt;
+	m_rttvar = (3 * m_rttvar + err) / 4;
+	m_srtt = (7 * m_srtt + rtt) / 8;
+      }
+    }
+
+    bool sampled () const {
+      return m_sampled;
+    }
+
+    uint64_t srtt () const {
+      return m_srtt;
+    }
+
+    uint64_t rttvar () const {
+      return m_rttvar;
+    }
+
+    // How long to wait for an answer: srtt + 4 rttvar limited to [lo, hi].
+    uint64_t timeout (const uint64_t lo,
+		      const uint64_t hi) const {
+      const uint64_t t = m_srtt + 4 * m_rttvar;
+      return t < lo ? lo : (t > hi ? hi : t);
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef __send_queue_hpp__
+#define __send_queue_hpp__
+
+#include <mftp/clock.hpp>
+#include <mftp/message.hpp>
+#include <mftp/metrics.hpp>
+#include <ioa/ioa.hpp>
+
+#include <cassert>
+#include <deque>
+
+namespace mftp {
+
+  // Send classes in order of decreasing priority.
+  enum send_class_t {
+    CONTROL_CLASS, // Requests and matches.
+    ANNOUNCEMENT_CLASS, // Catalogs and unsolicited fragments advertising a file.
+    DATA_CLASS, // Requested fragments.
+    SEND_CLASS_COUNT
+  };
+
+  // Classify a message by its (host order) type when the sender's intent is unknown.
+  inline send_class_t message_class (const uint32_t message_type) {
+    switch (message_type) {
+    case FRAGMENT:
+      return DATA_CLASS;
+    case CATALOG:
+      return ANNOUNCEMENT_CLASS;
+    default:
+      return CONTROL_CLASS;
+    }
+  }
+
+  // Time spent waiting in a queue.
+  struct queue_delay
+  {
+    uint64_t count; // Number of items dequeued.
+    ioa::time total; // Sum of the delays.
+    ioa::time max; // Largest delay.
+
+    queue_delay () :
+      count (0)
+    { }
+
+    void record (const ioa::time& delay) {
+      ++count;
+      total += delay;
+      if (max < delay) {
+	max = delay;
+      }
+    }
+  };
+
+  // A strict-priority queue with one FIFO per send class.
+  // The front of the queue is the oldest item of the highest priority class that is not empty.
+  template <typename T>
+  class send_queue
+  {
+  private:
+    struct entry
+    {
+      T value;
+      ioa::time enqueued;
+
+      entry (const T& v,
+	     const ioa::time& t) :
+	value (v),
+	enqueued (t)
+      { }
+    };
+
+    typedef std::deque<entry> queue_type;
+    queue_type m_queues[SEND_CLASS_COUNT];
+    queue_delay m_delays[SEND_CLASS_COUNT];
+    size_t m_size;
+
+    size_t front_index () const {
+      for (size_t cls = 0; cls < SEND_CLASS_COUNT; ++cls) {
+	if (!m_queues[cls].empty ()) {
+	  return cls;
+	}
+      }
+      assert (false);
+      return SEND_CLASS_COUNT;
+    }
+
+  public:
+    send_queue () :
+      m_size (0)
+    { }
+
+    bool empty () const {
+      return m_size == 0;
+    }
+
+    size_t size () const {
+      return m_size;
+    }
+
+    size_t size (const send_class_t cls) const {
+      return m_queues[cls].size ();
+    }
+
+    void push (const send_class_t cls,
+	       const T& value,
+	       const ioa::time& now) {
+      m_queues[cls].push_back (entry (value, now));
+      ++m_size;
+    }
+
+    send_class_t front_class () const {
+      return static_cast<send_class_t> (front_index ());
+    }
+
+    const T& front () const {
+      return m_queues[front_index ()].front ().value;
+    }
+
+    void pop (const ioa::time& now) {
+      const size_t cls = front_index ();
+      m_delays[cls].record (now - m_queues[cls].front ().enqueued);
+      m_queues[cls].pop_front ();
+      --m_size;
+    }
+
+    // Remove the first item (in priority order) satisfying the predicate.
+    template <class Predicate>
+    bool erase_first (Predicate pred) {
+      for (size_t cls = 0; cls < SEND_CLASS_COUNT; ++cls) {
+	for (typename queue_type::iterator pos = m_queues[cls].begin ();
+	     pos != m_queues[cls].end ();
+	     ++pos) {
+	  if (pred (pos->value)) {
+	    m_queues[cls].erase (pos);
+	    --m_size;
+	    return true;
+	  }
+	}
+      }
+      return false;
+    }
+
+    const queue_delay& delay (const send_class_t cls) const {
+      return m_delays[cls];
+    }
+  };
+
+  inline void export_delay (const queue_delay& d,
+			    const queue_delay_metrics& m) {
+    m.dequeued->set (d.count);
+    m.delay->set (to_microseconds (d.total));
+    m.max_delay->set (to_microseconds (d.max));
+  }
+
+  // Copy the delays of each class to their series.
+  template <typename T>
+  void export_delays (const send_queue<T>& q,
+		      const send_queue_metrics& m) {
+    export_delay (q.delay (CONTROL_CLASS), m.control);
+    export_delay (q.delay (ANNOUNCEMENT_CLASS), m.announcement);
+    export_delay (q.delay (DATA_CLASS), m.data);
+  }
+
+}
+
+#endif
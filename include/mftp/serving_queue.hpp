@@ -0,0 +1,109 @@
+#ifndef __serving_queue_hpp__
+#define __serving_queue_hpp__
+
+#include <mftp/prng.hpp>
+
+#include <cstddef>
+#include <map>
+#include <set>
+
+namespace mftp {
+
+  // Requested fragments waiting to be sent.
+  // The fragment requested most often comes first so one send satisfies the most receivers.
+  // Ties are broken by a random tag drawn when a fragment enters so servers holding the same file tend to send different fragments.
+  // Every operation is O(log n).
+  class serving_queue
+  {
+  private:
+    struct key
+    {
+      uint32_t count;
+      uint64_t tag;
+      uint32_t idx;
+
+      key (const uint32_t c,
+	   const uint64_t t,
+	   const uint32_t i) :
+	count (c),
+	tag (t),
+	idx (i)
+      { }
+
+      bool operator< (const key& other) const {
+	if (count != other.count) {
+	  return count > other.count;
+	}
+	if (tag != other.tag) {
+	  return tag < other.tag;
+	}
+	return idx < other.idx;
+      }
+    };
+
+    typedef std::set<key> order_type;
+    typedef std::map<uint32_t, order_type::iterator> index_type;
+
+    order_type m_order;
+    index_type m_index;
+    prng m_prng;
+
+  public:
+    explicit serving_queue (const uint64_t seed) :
+      m_prng (seed)
+    { }
+
+    bool empty () const {
+      return m_index.empty ();
+    }
+
+    size_t size () const {
+      return m_index.size ();
+    }
+
+    bool contains (const uint32_t idx) const {
+      return m_index.count (idx) != 0;
+    }
+
+    // Times idx has been requested since it entered (0 if absent).
+    uint32_t count (const uint32_t idx) const {
+      index_type::const_iterator pos = m_index.find (idx);
+      return pos != m_index.end () ? pos->second->count : 0;
+    }
+
+    // Add a request for idx.
+    void request (const uint32_t idx) {
+      index_type::iterator pos = m_index.find (idx);
+      if (pos == m_index.end ()) {
+	m_index.insert (std::make_pair (idx, m_order.insert (key (1, m_prng.next (), idx)).first));
+      }
+      else {
+	const key k (pos->second->count + 1, pos->second->tag, idx);
+	m_order.erase (pos->second);
+	pos->second = m_order.insert (k).first;
+      }
+    }
+
+    // The most requested fragment.
+    uint32_t front () const {
+      return m_order.begin ()->idx;
+    }
+
+    void pop () {
+      m_index.erase (m_order.begin ()->idx);
+      m_order.erase (m_order.begin ());
+    }
+
+    // Forget idx (a copy has been heard).
+    void erase (const uint32_t idx) {
+      index_type::iterator pos = m_index.find (idx);
+      if (pos != m_index.end ()) {
+	m_order.erase (pos->second);
+	m_index.erase (pos);
+      }
+    }
+  };
+
+}
+
+#endif
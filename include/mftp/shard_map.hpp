@@ -0,0 +1,52 @@
+#ifndef __shard_map_hpp__
+#define __shard_map_hpp__
+
+#include <mftp/fileid.hpp>
+#include <ioa/ioa.hpp>
+
+#include <set>
+#include <vector>
+
+namespace mftp {
+
+  // Assigns files to multicast groups.
+  // Group 0 is the control group and carries discovery.
+  // The data of every other file is carried by a group chosen from its digest (see data_group).
+  class shard_map
+  {
+  private:
+    std::vector<ioa::inet_address> m_groups;
+    std::set<uint32_t> m_control_types; // Files of these types stay on the control group.
+
+  public:
+    shard_map (const ioa::inet_address& control) {
+      m_groups.push_back (control);
+    }
+
+    void add_data_group (const ioa::inet_address& group) {
+      m_groups.push_back (group);
+    }
+
+    void add_control_type (const uint32_t type) {
+      m_control_types.insert (type);
+    }
+
+    size_t size () const {
+      return m_groups.size ();
+    }
+
+    const ioa::inet_address& address (const size_t group) const {
+      return m_groups[group];
+    }
+
+    size_t group (const fileid& fid) const {
+      if (m_groups.size () == 1 || m_control_types.count (fid.type) != 0) {
+	return 0;
+      }
+      return data_group (fid, m_groups.size () - 1);
+    }
+  };
+
+}
+
+#endif
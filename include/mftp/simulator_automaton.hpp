@@ -0,0 +1,72 @@
+#ifndef __simulator_automaton_hpp__
+#define __simulator_automaton_hpp__
+
+#include <mftp/clock.hpp>
+#include <ioa/alarm_automaton.hpp>
+
+#include <map>
+#include <set>
+
+namespace mftp {
+
+  // A discrete-event driver for virtual time.
+  // Automatons created while it exists bind their alarms to it instead of to real alarms.
+  // Once nothing else can run, it advances the clock to the earliest deadline and fires the alarms due at that time.
+  // A 64 second back-off therefore costs no real time.
+  class simulator_automaton :
+    public ioa::automaton,
+    private ioa::observer
+  {
+  private:
+    enum idle_state_t {
+      IDLE_READY,
+      IDLE_WAIT,
+    };
+
+    typedef std::multimap<ioa::time, ioa::aid_t> deadline_map;
+
+    ioa::handle_manager<simulator_automaton> m_self;
+    deadline_map m_deadlines; // Alarms that have not fired.
+    std::map<ioa::aid_t, deadline_map::iterator> m_pending; // The deadline of each client.
+    std::set<ioa::aid_t> m_fired; // Clients whose alarm has fired but who have not been told.
+    idle_state_t m_idle_state;
+
+    void observe (ioa::observable* o);
+    void cancel (const ioa::aid_t aid);
+
+  public:
+    simulator_automaton (const ioa::time& start);
+    ~simulator_automaton ();
+
+  private:
+    void schedule () const;
+
+    void set_effect (const ioa::time& interval,
+		     ioa::aid_t aid);
+    void set_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    V_AP_INPUT (simulator_automaton, set, ioa::time);
+
+  private:
+    bool alarm_precondition (ioa::aid_t aid) const;
+    void alarm_effect (ioa::aid_t aid);
+    void alarm_schedule (ioa::aid_t) const { schedule (); }
+  public:
+    UV_AP_OUTPUT (simulator_automaton, alarm);
+
+  private:
+    // A zero length real alarm is delivered only when the scheduler has run everything that was runnable.
+    // That is the moment virtual time may move.
+    bool set_idle_precondition () const;
+    ioa::time set_idle_effect ();
+    void set_idle_schedule () const { schedule (); }
+    V_UP_OUTPUT (simulator_automaton, set_idle, ioa::time);
+
+    void idle_effect ();
+    void idle_schedule () const { schedule (); }
+    UV_UP_INPUT (simulator_automaton, idle);
+  };
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef __spsc_ring_hpp__
+#define __spsc_ring_hpp__
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+namespace mftp {
+
+  // A bounded lock-free ring for exactly one producer thread and one consumer thread.
+  // The capacity is rounded up to a power of two.
+  template <typename T>
+  class spsc_ring {
+  private:
+    std::vector<T> m_slots;
+    const size_t m_mask;
+    // Written only by the consumer.
+    size_t m_head;
+    char m_pad[64];
+    // Written only by the producer.
+    size_t m_tail;
+
+    static size_t round_up (size_t n) {
+      size_t p = 1;
+      while (p < n) {
+	p <<= 1;
+      }
+      return p;
+    }
+
+    // Non-copyable.
+    spsc_ring (const spsc_ring&);
+    spsc_ring& operator= (const spsc_ring&);
+
+  public:
+    explicit spsc_ring (size_t capacity) :
+      m_slots (round_up (capacity)),
+      m_mask (m_slots.size () - 1),
+      m_head (0),
+      m_tail (0)
+    { }
+
+    size_t capacity () const {
+      return m_slots.size ();
+    }
+
+    // Producer.  Returns false if the ring is full.
+    bool push (const T& t) {
+      const size_t tail = m_tail;
+      if (tail - __atomic_load_n (&m_head, __ATOMIC_ACQUIRE) == m_slots.size ()) {
+	return false;
+      }
+      m_slots[tail & m_mask] = t;
+      __atomic_store_n (&m_tail, tail + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    // Consumer.  Returns false if the ring is empty.
+    bool pop (T& t) {
+      const size_t head = m_head;
+      if (head == __atomic_load_n (&m_tail, __ATOMIC_ACQUIRE)) {
+	return false;
+      }
+      t = m_slots[head & m_mask];
+      __atomic_store_n (&m_head, head + 1, __ATOMIC_RELEASE);
+      return true;
+    }
+
+    // Consumer.
+    bool empty () const {
+      return m_head == __atomic_load_n (&m_tail, __ATOMIC_ACQUIRE);
+    }
+  };
+
+}
+
+#endif
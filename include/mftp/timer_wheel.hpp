@@ -0,0 +1,193 @@
+#ifndef __timer_wheel_hpp__
+#define __timer_wheel_hpp__
+
+#include <stdint.h>
+#include <algorithm>
+#include <list>
+#include <tr1/unordered_map>
+#include <vector>
+
+namespace mftp {
+
+  // Hierarchical timing wheel (Varghese and Lauck).
+  // Deadlines are in ticks. Each level has SLOTS slots, each covering SLOTS times the span of a slot below.
+  // Insertion and cancellation are O(1). A timer is moved at most once per level as its deadline approaches.
+  // Advancing skips stretches in which nothing can expire, so an idle wheel costs nothing.
+  template <class Id, class Hash = std::tr1::hash<Id> >
+  class timer_wheel
+  {
+  public:
+    static const unsigned int BITS = 8;
+    static const unsigned int SLOTS = 1 << BITS;
+    static const unsigned int LEVELS = 4;
+
+  private:
+    struct entry
+    {
+      Id id;
+      uint64_t deadline;
+
+      entry (const Id& i,
+	     const uint64_t d) :
+	id (i),
+	deadline (d)
+      { }
+    };
+
+    typedef std::list<entry> slot_type;
+
+    struct location
+    {
+      unsigned int level;
+      unsigned int slot;
+      typename slot_type::iterator pos;
+    };
+
+    typedef std::tr1::unordered_map<Id, location, Hash> index_type;
+
+    uint64_t m_now;
+    std::vector<slot_type> m_slots; // LEVELS * SLOTS
+    size_t m_level_count[LEVELS];
+    index_type m_index;
+
+    static uint64_t mask (const unsigned int level) {
+      return (uint64_t (1) << (BITS * level)) - 1;
+    }
+
+    // Put id in the slot for deadline but no earlier than the tick earliest.
+    void place (const Id& id,
+		uint64_t deadline,
+		const uint64_t earliest) {
+      if (deadline < earliest) {
+	deadline = earliest;
+      }
+      // Timers beyond the last level wait in its farthest slot and are placed again when it comes around.
+      const uint64_t when = std::min (deadline, m_now + mask (LEVELS));
+
+      const uint64_t delta = when - m_now;
+      unsigned int level = 0;
+      while (level + 1 < LEVELS && delta > mask (level + 1)) {
+	++level;
+      }
+      const unsigned int slot = (when >> (BITS * level)) & (SLOTS - 1);
+
+      slot_type& s = m_slots[level * SLOTS + slot];
+      location loc;
+      loc.level = level;
+      loc.slot = slot;
+      loc.pos = s.insert (s.end (), entry (id, deadline));
+      m_index[id] = loc;
+      ++m_level_count[level];
+    }
+
+    // Move the timers of a slot to lower levels.
+    void cascade (const unsigned int level,
+		  const unsigned int slot) {
+      slot_type moving;
+      moving.swap (m_slots[level * SLOTS + slot]);
+      m_level_count[level] -= moving.size ();
+      for (typename slot_type::const_iterator pos = moving.begin (); pos != moving.end (); ++pos) {
+	// Timers due now land in the slot about to expire.
+	place (pos->id, pos->deadline, m_now);
+      }
+    }
+
+  public:
+    timer_wheel () :
+      m_now (0),
+      m_slots (LEVELS * SLOTS)
+    {
+      for (unsigned int level = 0; level != LEVELS; ++level) {
+	m_level_count[level] = 0;
+      }
+    }
+
+    uint64_t now () const {
+      return m_now;
+    }
+
+    bool empty () const {
+      return m_index.empty ();
+    }
+
+    size_t size () const {
+      return m_index.size ();
+    }
+
+    bool contains (const Id& id) const {
+      return m_index.count (id) != 0;
+    }
+
+    // Set the deadline of id (replacing any it had).
+    void insert (const Id& id,
+		 const uint64_t deadline) {
+      cancel (id);
+      // Overdue timers expire on the next tick.
+      place (id, deadline, m_now + 1);
+    }
+
+    void cancel (const Id& id) {
+      typename index_type::iterator pos = m_index.find (id);
+      if (pos != m_index.end ()) {
+	m_slots[pos->second.level * SLOTS + pos->second.slot].erase (pos->second.pos);
+	--m_level_count[pos->second.level];
+	m_index.erase (pos);
+      }
+    }
+
+    // A tick no later than the earliest deadline (m_now if the wheel is empty).
+    // It is exact for deadlines within SLOTS ticks; otherwise it is when the earliest timers move down a level.
+    uint64_t next_expiry () const {
+      if (m_level_count[0] != 0) {
+	for (uint64_t t = m_now + 1; ; ++t) {
+	  if (!m_slots[t & (SLOTS - 1)].empty ()) {
+	    return t;
+	  }
+	}
+      }
+      for (unsigned int level = 1; level != LEVELS; ++level) {
+	if (m_level_count[level] != 0) {
+	  return (m_now | mask (level)) + 1;
+	}
+      }
+      return m_now;
+    }
+
+    // Move time forward to tick, appending the ids whose deadline has passed to expired.
+    void advance (const uint64_t tick,
+		  std::vector<Id>& expired) {
+      while (m_now < tick) {
+	if (m_index.empty ()) {
+	  m_now = tick;
+	  break;
+	}
+
+	// Nothing below the lowest occupied level can happen before its next slot boundary.
+	unsigned int lowest = 0;
+	while (m_level_count[lowest] == 0) {
+	  ++lowest;
+	}
+	if (lowest != 0 && (m_now & mask (lowest)) != mask (lowest)) {
+	  m_now = std::min (tick, m_now | mask (lowest));
+	  continue;
+	}
+
+	++m_now;
+	for (unsigned int level = 1; level != LEVELS && (m_now & mask (level)) == 0; ++level) {
+	  cascade (level, (m_now >> (BITS * level)) & (SLOTS - 1));
+	}
+
+	slot_type& s = m_slots[m_now & (SLOTS - 1)];
+	m_level_count[0] -= s.size ();
+	for (typename slot_type::const_iterator pos = s.begin (); pos != s.end (); ++pos) {
+	  expired.push_back (pos->id);
+	  m_index.erase (pos->id);
+	}
+	s.clear ();
+      }
+    }
+  };
+
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef __trace_hpp__
+#define __trace_hpp__
+
+#include <mftp/fileid.hpp>
+
+#include <stdint.h>
+#include <string>
+
+namespace mftp {
+
+  enum trace_event {
+    TRACE_FRAGMENT_RECEIVED = 1, // A new fragment of our file.
+    TRACE_FRAGMENT_DUPLICATE, // A fragment of our file that we already had.
+    TRACE_FRAGMENT_CORRUPT, // A fragment of our file with a bad index.
+    TRACE_FRAGMENT_REQUESTED, // We put the fragment in a request.
+    TRACE_FRAGMENT_QUEUED, // We queued the fragment in answer to a request.
+    // 6 was an announced fragment before catalogs replaced announcements; left unused so that numbers in old traces keep their meaning.
+    TRACE_FRAGMENT_SENT = 7, // The fragment left our send queue.
+    TRACE_REQUEST_SENT, // A request left our send queue.
+    TRACE_REQUEST_RECEIVED, // Somebody requested the fragment.
+    TRACE_MATCH_SENT,
+    TRACE_MATCH_RECEIVED,
+    TRACE_DATAGRAM_SENT, // The channel sent a message (message holds its type).
+    TRACE_DATAGRAM_RECEIVED, // The channel received a valid message.
+    TRACE_DATAGRAM_INVALID, // The channel received something that was not a message.
+    TRACE_DATAGRAM_UNROUTED, // The channel received a message that nobody wanted.
+  };
+
+  // One event.
+  // Files are identified by the first word of their hash.
+  struct trace_record
+  {
+    uint64_t time; // Microseconds (virtual under a simulator).
+    uint32_t file;
+    uint32_t index; // Fragment index.
+    uint16_t event;
+    uint16_t message; // Message type for datagram events.
+    uint32_t reserved;
+  };
+
+  // The dump is a trace_file_header followed by records in time order for each thread.
+  struct trace_file_header
+  {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t record_count;
+  };
+
+  const char TRACE_MAGIC[8] = { 'M', 'F', 'T', 'P', 'T', 'R', 'C', '1' };
+
+  // Records events in a fixed size ring per thread so tracing costs a few stores.
+  // Old events are overwritten.
+  class trace {
+  public:
+    // Start tracing.
+    // The rings are written to path at exit and whenever the process receives SIGUSR2.
+    static void enable (const std::string& path,
+			const uint32_t capacity = 65536);
+    static bool enabled ();
+    static void dump ();
+
+    static uint32_t file_key (const fileid& fid) {
+      return (uint32_t (fid.hash[0]) << 24) |
+	(uint32_t (fid.hash[1]) << 16) |
+	(uint32_t (fid.hash[2]) << 8) |
+	uint32_t (fid.hash[3]);
+    }
+
+    static void record (const trace_event event,
+			const fileid& fid,
+			const uint32_t index,
+			const uint16_t message = 0) {
+      if (enabled ()) {
+	append (event, file_key (fid), index, message);
+      }
+    }
+
+  private:
+    static void append (const trace_event event,
+			const uint32_t file,
+			const uint32_t index,
+			const uint16_t message);
+  };
+
+}
+
+#endif
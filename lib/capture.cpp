@@ -0,0 +1,94 @@
+#include <mftp/capture.hpp>
+#include <mftp/clock.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace mftp {
+
+  static FILE* s_capture = 0;
+  // The tail lost to a signal is at most this old.
+  static const uint64_t FLUSH_INTERVAL = 100000; // 100 milliseconds
+  static uint64_t s_flushed = 0;
+
+  static void close_capture () {
+    fclose (s_capture);
+  }
+
+  void capture::enable (const std::string& path) {
+    s_capture = fopen (path.c_str (), "w");
+    if (s_capture == NULL) {
+      perror ("fopen");
+      exit (EXIT_FAILURE);
+    }
+
+    capture_file_header header;
+    memcpy (header.magic, CAPTURE_MAGIC, sizeof (header.magic));
+    if (fwrite (&header, sizeof (header), 1, s_capture) != 1) {
+      perror ("fwrite");
+      exit (EXIT_FAILURE);
+    }
+
+    // Flush what is buffered when the process exits.
+    atexit (close_capture);
+  }
+
+  bool capture::enabled () {
+    return s_capture != 0;
+  }
+
+  void capture::record (const std::string& datagram) {
+    const ioa::time now = clock::now ();
+    capture_record_header header;
+    header.time = uint64_t (now.sec ()) * 1000000 + now.usec ();
+    header.length = datagram.size ();
+    header.reserved = 0;
+    // A short write leaves a truncated last record, which the reader ignores.
+    fwrite (&header, sizeof (header), 1, s_capture);
+    fwrite (datagram.data (), 1, datagram.size (), s_capture);
+    if (header.time - s_flushed >= FLUSH_INTERVAL) {
+      fflush (s_capture);
+      s_flushed = header.time;
+    }
+  }
+
+  capture_reader::capture_reader (const std::string& path) :
+    m_fp (fopen (path.c_str (), "r"))
+  {
+    if (m_fp == NULL) {
+      perror ("fopen");
+      exit (EXIT_FAILURE);
+    }
+    rewind ();
+  }
+
+  capture_reader::~capture_reader () {
+    fclose (m_fp);
+  }
+
+  void capture_reader::rewind () {
+    ::rewind (m_fp);
+    capture_file_header header;
+    if (fread (&header, sizeof (header), 1, m_fp) != 1 ||
+	memcmp (header.magic, CAPTURE_MAGIC, sizeof (header.magic)) != 0) {
+      std::cerr << "Not a capture file" << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  }
+
+  bool capture_reader::next (uint64_t& time,
+			     std::string& datagram) {
+    capture_record_header header;
+    if (fread (&header, sizeof (header), 1, m_fp) != 1) {
+      return false;
+    }
+    datagram.resize (header.length);
+    if (header.length != 0 && fread (&datagram[0], 1, header.length, m_fp) != header.length) {
+      return false;
+    }
+    time = header.time;
+    return true;
+  }
+
+}
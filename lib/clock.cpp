@@ -0,0 +1,39 @@
+#include <mftp/clock.hpp>
+
+#include <cassert>
+
+namespace mftp {
+
+  static ioa::aid_t s_simulator = -1;
+  static ioa::time s_now;
+
+  ioa::time clock::now () {
+    return s_simulator == -1 ? ioa::time::now () : s_now;
+  }
+
+  bool clock::simulated () {
+    return s_simulator != -1;
+  }
+
+  ioa::aid_t clock::simulator () {
+    return s_simulator;
+  }
+
+  void clock::simulate (const ioa::aid_t simulator,
+			const ioa::time& start) {
+    s_simulator = simulator;
+    s_now = start;
+  }
+
+  void clock::advance (const ioa::time& t) {
+    assert (s_simulator != -1);
+    if (s_now < t) {
+      s_now = t;
+    }
+  }
+
+  void clock::stop_simulation () {
+    s_simulator = -1;
+  }
+
+}
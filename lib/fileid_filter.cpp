@@ -0,0 +1,142 @@
+#include <mftp/fileid_filter.hpp>
+#include <mftp/message.hpp>
+
+#include <config.hpp>
+#include <cerrno>
+#include <vector>
+
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#include <sys/socket.h>
+#endif
+
+namespace mftp {
+
+  fileid_filter::fileid_filter () :
+    m_accept_fragments (false)
+  { }
+
+  void fileid_filter::insert (const fileid& fid) {
+    m_prefixes.insert ((uint32_t (fid.hash[0]) << 24) |
+		       (uint32_t (fid.hash[1]) << 16) |
+		       (uint32_t (fid.hash[2]) << 8) |
+		       uint32_t (fid.hash[3]));
+  }
+
+  void fileid_filter::accept_fragments () {
+    m_accept_fragments = true;
+  }
+
+  void fileid_filter::accept_fragments (const uint32_t type,
+					const uint32_t length) {
+    m_kinds.insert (std::make_pair (type, length));
+  }
+
+#ifdef HAVE_LINUX_FILTER_H
+
+  // Socket filters on UDP sockets see the UDP header.
+  static const uint32_t PAYLOAD = 8;
+  static const uint32_t ACCEPT = 0xFFFFFFFF;
+  static const uint32_t DROP = 0;
+  // The first word of the hash in a fragment or request.
+  static const uint32_t HASH_OFFSET = PAYLOAD + sizeof (message_header) + offsetof (fileid, hash);
+  // The type and length of the file in a fragment.
+  static const uint32_t TYPE_OFFSET = PAYLOAD + sizeof (message_header) + offsetof (fileid, type);
+  static const uint32_t LENGTH_OFFSET = PAYLOAD + sizeof (message_header) + offsetof (fileid, length);
+  // Instructions to test one type and length.
+  static const uint32_t KIND_SIZE = 5;
+  // Kinds the fragment test can skip over with a short jump.
+  static const uint32_t MAX_KINDS = 50;
+
+  static sock_filter statement (uint16_t code,
+				uint32_t k) {
+    sock_filter s = { code, 0, 0, k };
+    return s;
+  }
+
+  static sock_filter jump (uint16_t code,
+			   uint32_t k,
+			   uint8_t jt,
+			   uint8_t jf) {
+    sock_filter s = { code, jt, jf, k };
+    return s;
+  }
+
+  int fileid_filter::attach (int fd) const {
+    std::vector<sock_filter> program;
+
+    // Drop anything that isn't the size of a message.
+    program.push_back (statement (BPF_LD | BPF_W | BPF_LEN, 0));
+    program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, PAYLOAD + sizeof (message), 1, 0));
+    program.push_back (statement (BPF_RET | BPF_K, DROP));
+
+    // Matches and catalogs are addressed by their contents so they always go to user space.
+    program.push_back (statement (BPF_LD | BPF_W | BPF_ABS, PAYLOAD));
+    program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, MATCH, 2, 0));
+    program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, MATCH_FILTER, 1, 0));
+    program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, CATALOG, 0, 1));
+    program.push_back (statement (BPF_RET | BPF_K, ACCEPT));
+
+    // Too many kinds to test is the same as wanting every fragment.
+    if (m_accept_fragments || m_kinds.size () > MAX_KINDS) {
+      program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, FRAGMENT, 0, 1));
+      program.push_back (statement (BPF_RET | BPF_K, ACCEPT));
+    }
+    else if (!m_kinds.empty ()) {
+      // Fragments of a kind somebody is looking for.
+      // A fragment of another kind may still be for a registered file so it goes on to the hash comparison.
+      const uint8_t skip = uint8_t (KIND_SIZE * m_kinds.size () + 1);
+      program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, FRAGMENT, 0, skip));
+      for (std::set<std::pair<uint32_t, uint32_t> >::const_iterator pos = m_kinds.begin ();
+	   pos != m_kinds.end ();
+	   ++pos) {
+	program.push_back (statement (BPF_LD | BPF_W | BPF_ABS, TYPE_OFFSET));
+	program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, pos->first, 0, 3));
+	program.push_back (statement (BPF_LD | BPF_W | BPF_ABS, LENGTH_OFFSET));
+	program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, pos->second, 0, 1));
+	program.push_back (statement (BPF_RET | BPF_K, ACCEPT));
+      }
+      // Over the type dispatch below.
+      program.push_back (statement (BPF_JMP | BPF_JA, 3));
+    }
+
+    // Let user space decide about message types we don't know.
+    program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, FRAGMENT, 2, 0));
+    program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, REQUEST, 1, 0));
+    program.push_back (statement (BPF_RET | BPF_K, ACCEPT));
+
+    // Compare the hash prefix against every registered file.
+    // Each comparison jumps over a single return so the program never needs a long jump.
+    program.push_back (statement (BPF_LD | BPF_W | BPF_ABS, HASH_OFFSET));
+    for (std::set<uint32_t>::const_iterator pos = m_prefixes.begin ();
+	 pos != m_prefixes.end ();
+	 ++pos) {
+      program.push_back (jump (BPF_JMP | BPF_JEQ | BPF_K, *pos, 0, 1));
+      program.push_back (statement (BPF_RET | BPF_K, ACCEPT));
+    }
+    program.push_back (statement (BPF_RET | BPF_K, DROP));
+
+    if (program.size () > BPF_MAXINSNS) {
+      // Too many files to filter in the kernel.
+      program.clear ();
+      program.push_back (statement (BPF_RET | BPF_K, ACCEPT));
+    }
+
+    sock_fprog fprog;
+    fprog.len = program.size ();
+    fprog.filter = &program[0];
+    if (setsockopt (fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof (fprog)) == -1) {
+      return errno;
+    }
+    return 0;
+  }
+
+#else
+
+  int fileid_filter::attach (int fd) const {
+    return ENOSYS;
+  }
+
+#endif
+
+}
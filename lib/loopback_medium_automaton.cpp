@@ -0,0 +1,332 @@
+#include <mftp/loopback_medium_automaton.hpp>
+
+#include <mftp/message.hpp>
+
+namespace mftp {
+
+  const ioa::time loopback_medium_automaton::MAX_WAIT (0, 10000); // 10 milliseconds
+  const size_t loopback_medium_automaton::REPLAY_BATCH (64);
+
+  static ioa::time from_seconds (const double s) {
+    const long sec = static_cast<long> (s);
+    return ioa::time (sec, static_cast<long> ((s - sec) * 1000000.0));
+  }
+
+  static double to_seconds (const ioa::time& t) {
+    return double (t.sec ()) + double (t.usec ()) / 1000000.0;
+  }
+
+  loopback_medium_automaton::loopback_medium_automaton (const medium_config& config) :
+    m_self (ioa::get_aid ()),
+    m_config (config),
+    m_prng (config.seed),
+    m_alarm_state (SET_READY),
+    m_playing (false),
+    m_finished (false),
+    m_replay_base (0),
+    m_have_next (false),
+    m_next_time (0)
+  {
+    if (!m_config.replay.empty ()) {
+      m_replay.reset (new capture_reader (m_config.replay));
+    }
+
+    add_observable (&receive);
+
+    if (clock::simulated ()) {
+      m_simulator.reset (new ioa::handle_manager<simulator_automaton> (clock::simulator ()));
+      ioa::make_binding_manager (this,
+				 &m_self,
+				 &loopback_medium_automaton::set_alarm,
+				 m_simulator.get (),
+				 &simulator_automaton::set);
+      ioa::make_binding_manager (this,
+				 m_simulator.get (),
+				 &simulator_automaton::alarm,
+				 &m_self,
+				 &loopback_medium_automaton::alarm_interrupt);
+    }
+    else {
+      ioa::automaton_manager<ioa::alarm_automaton>* alarm = new ioa::automaton_manager<ioa::alarm_automaton> (this, ioa::make_generator<ioa::alarm_automaton> ());
+      ioa::make_binding_manager (this,
+				 &m_self,
+				 &loopback_medium_automaton::set_alarm,
+				 alarm,
+				 &ioa::alarm_automaton::set);
+      ioa::make_binding_manager (this,
+				 alarm,
+				 &ioa::alarm_automaton::alarm,
+				 &m_self,
+				 &loopback_medium_automaton::alarm_interrupt);
+    }
+
+    schedule ();
+  }
+
+  void loopback_medium_automaton::observe (ioa::observable* o) {
+    if (o == &receive) {
+      const ioa::aid_t aid = receive.recent_parameter;
+      if (receive.recent_op == ioa::BOUND) {
+	m_nodes.insert (aid);
+	m_paths.insert (std::make_pair (aid, m_config.loss));
+      }
+      else if (receive.recent_op == ioa::UNBOUND) {
+	m_nodes.erase (aid);
+	m_paths.erase (aid);
+	m_deliveries.erase (aid);
+	m_completes.erase (aid);
+      }
+    }
+  }
+
+  void loopback_medium_automaton::schedule () const {
+    for (std::set<ioa::aid_t>::const_iterator pos = m_completes.begin ();
+	 pos != m_completes.end ();
+	 ++pos) {
+      if (send_complete_precondition (*pos)) {
+	ioa::schedule (&loopback_medium_automaton::send_complete, *pos);
+      }
+    }
+    for (std::map<ioa::aid_t, std::queue<mftp_receiver_automaton::receive_val> >::const_iterator pos = m_deliveries.begin ();
+	 pos != m_deliveries.end ();
+	 ++pos) {
+      if (receive_precondition (pos->first)) {
+	ioa::schedule (&loopback_medium_automaton::receive, pos->first);
+      }
+    }
+    if (set_alarm_precondition ()) {
+      ioa::schedule (&loopback_medium_automaton::set_alarm);
+    }
+    if (finished_precondition ()) {
+      ioa::schedule (&loopback_medium_automaton::finished);
+    }
+  }
+
+  ioa::time loopback_medium_automaton::random_jitter () {
+    if (m_config.jitter == ioa::time ()) {
+      return ioa::time ();
+    }
+    return from_seconds (m_prng.uniform () * to_seconds (m_config.jitter));
+  }
+
+  uint32_t loopback_medium_automaton::type_of (const std::string& buffer) {
+    message_header header;
+    if (buffer.size () < sizeof (message_header)) {
+      return 0;
+    }
+    memcpy (&header, buffer.data (), sizeof (message_header));
+    return ntohl (header.message_type);
+  }
+
+  void loopback_medium_automaton::count (const std::string& buffer) {
+    medium_stats* stats = m_config.stats;
+    if (stats == 0) {
+      return;
+    }
+    ++stats->sent;
+    stats->bytes += buffer.size ();
+    ++stats->sent_by_type[type_of (buffer)];
+  }
+
+  void loopback_medium_automaton::release (const ioa::time& now) {
+    // Move events that are due to the output queues.
+    while (!m_events.empty () && m_events.begin ()->first <= now) {
+      const event& e = m_events.begin ()->second;
+      switch (e.type) {
+      case COMPLETE:
+	m_completes.insert (e.aid);
+	break;
+      case DELIVER:
+	if (m_nodes.count (e.aid) != 0) {
+	  m_deliveries[e.aid].push (mftp_receiver_automaton::receive_val (e.buffer));
+	}
+	break;
+      }
+      m_events.erase (m_events.begin ());
+    }
+  }
+
+  void loopback_medium_automaton::send_effect (const ioa::udp_sender_automaton::send_arg& arg,
+					       ioa::aid_t aid) {
+    const ioa::time now = clock::now ();
+
+    count (*arg.buffer);
+
+    // Datagrams are serialized on the medium.
+    ioa::time start = now;
+    if (start < m_busy_until) {
+      start = m_busy_until;
+    }
+    m_busy_until = start;
+    if (m_config.bandwidth != 0) {
+      m_busy_until += from_seconds (double (arg.buffer->size ()) / m_config.bandwidth);
+    }
+
+    m_events.insert (std::make_pair (m_busy_until, event (COMPLETE, aid, arg.buffer)));
+
+    // The capture stands in for the network.
+    if (!m_config.replay.empty ()) {
+      release (now);
+      return;
+    }
+
+    for (std::set<ioa::aid_t>::const_iterator pos = m_nodes.begin ();
+	 pos != m_nodes.end ();
+	 ++pos) {
+      if (!m_paths[*pos].drop (m_prng)) {
+	m_events.insert (std::make_pair (m_busy_until + m_config.delay + random_jitter (), event (DELIVER, *pos, arg.buffer)));
+	if (m_config.stats != 0) {
+	  ++m_config.stats->delivered;
+	  ++m_config.stats->delivered_by_type[type_of (*arg.buffer)];
+	}
+      }
+      else if (m_config.stats != 0) {
+	++m_config.stats->lost;
+      }
+    }
+
+    release (now);
+  }
+
+  bool loopback_medium_automaton::send_complete_precondition (ioa::aid_t aid) const {
+    return m_completes.count (aid) != 0 && ioa::binding_count (&loopback_medium_automaton::send_complete, aid) != 0;
+  }
+
+  int loopback_medium_automaton::send_complete_effect (ioa::aid_t aid) {
+    m_completes.erase (aid);
+    return 0;
+  }
+
+  bool loopback_medium_automaton::receive_precondition (ioa::aid_t aid) const {
+    return m_deliveries.count (aid) != 0 && ioa::binding_count (&loopback_medium_automaton::receive, aid) != 0;
+  }
+
+  mftp_receiver_automaton::receive_val loopback_medium_automaton::receive_effect (ioa::aid_t aid) {
+    std::map<ioa::aid_t, std::queue<mftp_receiver_automaton::receive_val> >::iterator pos = m_deliveries.find (aid);
+    mftp_receiver_automaton::receive_val rv = pos->second.front ();
+    pos->second.pop ();
+    if (pos->second.empty ()) {
+      m_deliveries.erase (pos);
+    }
+    return rv;
+  }
+
+  bool loopback_medium_automaton::set_alarm_precondition () const {
+    return m_alarm_state == SET_READY && (!m_events.empty () || replay_waiting ()) && ioa::binding_count (&loopback_medium_automaton::set_alarm) != 0;
+  }
+
+  ioa::time loopback_medium_automaton::set_alarm_effect () {
+    m_alarm_state = INTERRUPT_WAIT;
+
+    // Wake for the next event but not so late that an earlier event inserted in the meantime waits long.
+    const ioa::time now = clock::now ();
+    ioa::time next = now + MAX_WAIT;
+    if (!m_events.empty ()) {
+      next = std::min (next, m_events.begin ()->first);
+    }
+    if (replay_waiting ()) {
+      next = std::min (next, next_due ());
+    }
+    if (next <= now) {
+      return ioa::time ();
+    }
+    return next - now;
+  }
+
+  void loopback_medium_automaton::alarm_interrupt_effect () {
+    assert (m_alarm_state == INTERRUPT_WAIT);
+    m_alarm_state = SET_READY;
+    const ioa::time now = clock::now ();
+    release (now);
+    play (now);
+  }
+
+  void loopback_medium_automaton::deliver_all (const ioa::const_shared_ptr<std::string>& buffer) {
+    for (std::set<ioa::aid_t>::const_iterator pos = m_nodes.begin ();
+	 pos != m_nodes.end ();
+	 ++pos) {
+      m_deliveries[*pos].push (mftp_receiver_automaton::receive_val (buffer));
+      if (m_config.stats != 0) {
+	++m_config.stats->delivered;
+	++m_config.stats->delivered_by_type[type_of (*buffer)];
+      }
+    }
+  }
+
+  bool loopback_medium_automaton::read_next () {
+    if (m_have_next) {
+      return true;
+    }
+    if (m_replay.get () == 0) {
+      return false;
+    }
+
+    std::string* datagram = new std::string;
+    uint64_t time;
+    if (!m_replay->next (time, *datagram)) {
+      delete datagram;
+      m_replay.reset ();
+      return false;
+    }
+
+    if (m_replay_base == 0) {
+      m_replay_base = time;
+    }
+    m_next_time = time;
+    m_next = ioa::const_shared_ptr<std::string> (datagram);
+    m_have_next = true;
+    return true;
+  }
+
+  ioa::time loopback_medium_automaton::next_due () {
+    if (m_config.replay_fast || !read_next ()) {
+      return ioa::time ();
+    }
+    const uint64_t offset = m_next_time - m_replay_base;
+    return m_replay_start + ioa::time (offset / 1000000, offset % 1000000);
+  }
+
+  bool loopback_medium_automaton::replay_waiting () const {
+    if (!m_playing || (m_replay.get () == 0 && !m_have_next)) {
+      return false;
+    }
+    // Going fast, the next batch waits until the nodes have taken the last one.
+    return !m_config.replay_fast || m_deliveries.empty ();
+  }
+
+  void loopback_medium_automaton::play (const ioa::time& now) {
+    if (!replay_waiting ()) {
+      return;
+    }
+
+    if (m_config.replay_fast) {
+      for (size_t count = 0; count != REPLAY_BATCH && read_next (); ++count) {
+	deliver_all (m_next);
+	m_have_next = false;
+      }
+    }
+    else {
+      while (read_next () && next_due () <= now) {
+	deliver_all (m_next);
+	m_have_next = false;
+      }
+    }
+  }
+
+  void loopback_medium_automaton::start_effect () {
+    if (!m_playing) {
+      m_playing = true;
+      m_replay_start = clock::now ();
+      play (m_replay_start);
+    }
+  }
+
+  bool loopback_medium_automaton::finished_precondition () const {
+    return m_playing && !m_finished && m_replay.get () == 0 && !m_have_next && m_deliveries.empty () && ioa::binding_count (&loopback_medium_automaton::finished) != 0;
+  }
+
+  void loopback_medium_automaton::finished_effect () {
+    m_finished = true;
+  }
+
+}
@@ -0,0 +1,136 @@
+#include <mftp/metrics_exporter.hpp>
+
+#include <config.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace mftp {
+
+  metrics_exporter::metrics_exporter (const std::string& path,
+				      const export_mode mode,
+				      const unsigned int interval) :
+    m_path (path),
+    m_mode (mode),
+    m_interval (interval == 0 ? 1 : interval),
+    m_fd (-1),
+    m_stop (0)
+  {
+    if (m_mode == SOCKET_EXPORT) {
+      sockaddr_un addr;
+      if (m_path.size () >= sizeof (addr.sun_path)) {
+	fail ("Metrics socket path is too long", ENAMETOOLONG);
+      }
+      memset (&addr, 0, sizeof (addr));
+      addr.sun_family = AF_UNIX;
+      strcpy (addr.sun_path, m_path.c_str ());
+
+      m_fd = socket (AF_UNIX, SOCK_STREAM, 0);
+      if (m_fd == -1) {
+	fail ("Couldn't create metrics socket", errno);
+      }
+      // Remove a socket left by an earlier run.
+      unlink (m_path.c_str ());
+      if (bind (m_fd, reinterpret_cast<sockaddr*> (&addr), sizeof (addr)) == -1) {
+	fail ("Couldn't bind metrics socket", errno);
+      }
+      if (listen (m_fd, 8) == -1) {
+	fail ("Couldn't listen on metrics socket", errno);
+      }
+    }
+
+    const int err = pthread_create (&m_thread, 0, export_thread, this);
+    if (err != 0) {
+      fail ("Couldn't create metrics thread", err);
+    }
+  }
+
+  metrics_exporter::~metrics_exporter () {
+    __atomic_store_n (&m_stop, 1, __ATOMIC_RELEASE);
+    pthread_join (m_thread, 0);
+    if (m_mode == SOCKET_EXPORT) {
+      close (m_fd);
+      unlink (m_path.c_str ());
+    }
+    else {
+      // One last time so short runs are seen.
+      write_file ();
+    }
+  }
+
+  void metrics_exporter::fail (const char* what,
+			       const int err) const {
+    char buf[256];
+#ifdef STRERROR_R_CHAR_P
+    std::cerr << what << ": " << strerror_r (err, buf, 256) << std::endl;
+#else
+    strerror_r (err, buf, 256);
+    std::cerr << what << ": " << buf << std::endl;
+#endif
+    exit (EXIT_FAILURE);
+  }
+
+  void* metrics_exporter::export_thread (void* arg) {
+    static_cast<metrics_exporter*> (arg)->serve ();
+    return 0;
+  }
+
+  void metrics_exporter::write_file () const {
+    // Readers never see a partial file.
+    const std::string tmp = m_path + ".tmp";
+    FILE* fp = fopen (tmp.c_str (), "w");
+    if (fp == NULL) {
+      return;
+    }
+    const std::string text = metrics_registry::instance ().render ();
+    const bool ok = fwrite (text.data (), 1, text.size (), fp) == text.size ();
+    if (fclose (fp) != 0 || !ok) {
+      unlink (tmp.c_str ());
+      return;
+    }
+    rename (tmp.c_str (), m_path.c_str ());
+  }
+
+  void metrics_exporter::serve () {
+    // Wake up every 100 milliseconds to check if we should stop.
+    unsigned int ticks = 0;
+    while (!__atomic_load_n (&m_stop, __ATOMIC_ACQUIRE)) {
+      if (m_mode == FILE_EXPORT) {
+	if (ticks == 0) {
+	  write_file ();
+	}
+	ticks = (ticks + 1) % (m_interval * 10);
+	usleep (100000);
+      }
+      else {
+	pollfd p;
+	p.fd = m_fd;
+	p.events = POLLIN;
+	if (poll (&p, 1, 100) == 1) {
+	  const int fd = accept (m_fd, 0, 0);
+	  if (fd != -1) {
+	    const std::string text = metrics_registry::instance ().render ();
+	    size_t offset = 0;
+	    while (offset != text.size ()) {
+	      // A scraper that hangs up early must not kill us with SIGPIPE.
+	      const ssize_t w = send (fd, text.data () + offset, text.size () - offset, MSG_NOSIGNAL);
+	      if (w <= 0) {
+		break;
+	      }
+	      offset += w;
+	    }
+	    close (fd);
+	  }
+	}
+      }
+    }
+  }
+
+}
@@ -1,13 +1,45 @@
+// Before anything that includes profile.hpp so MFTP_PROFILE is seen.
+#include <config.hpp>
+
 #include <mftp/mftp_automaton.hpp>
 
+#include <mftp/profile.hpp>
+
 namespace mftp {
-  const ioa::time mftp_automaton::ALARM_INTERVAL (1, 0); // 1 second
-  const ioa::time mftp_automaton::INIT_INTERVAL (1, 0); // 1 second
+  const ioa::time mftp_automaton::MIN_ALARM (0, 1000); // 1 millisecond
   const ioa::time mftp_automaton::MAX_INTERVAL (64, 0); // slightly over 1 minute
   const uint32_t mftp_automaton::MAX_FRAGMENT_COUNT (1); // Number of fragments allowed in sendq.
-  const uint32_t mftp_automaton::SHUFFLE_LIMIT (REQUEST_SIZE);
   const uint32_t mftp_automaton::REREQUEST_NUMERATOR (9);
   const uint32_t mftp_automaton::REREQUEST_DENOMINATOR (10);
+  const uint64_t mftp_automaton::INIT_RTT (100000); // 100 milliseconds
+  const uint64_t mftp_automaton::MIN_RTO (10000); // 10 milliseconds
+  const uint64_t mftp_automaton::MAX_RTO (10000000); // 10 seconds
+  const uint32_t mftp_automaton::MAX_WINDOWS (8);
+  const uint64_t mftp_automaton::MIN_SUPPRESS (1000); // 1 millisecond
+  const uint64_t mftp_automaton::MAX_SUPPRESS (500000); // 500 milliseconds
+  const ioa::time mftp_automaton::ADMISSION_RETRY (0, 100000); // 100 milliseconds
+  const size_t mftp_automaton::MAX_QUEUED_CANDIDATES (1024);
+  const ioa::time mftp_automaton::MATCH_IDLE (30, 0); // 30 seconds
+  const uint32_t mftp_automaton::MATCH_PROGRESS (16); // Fragments between progress reports from a candidate download.
+
+  static endgame_config endgame;
+
+  void mftp_automaton::set_endgame (const endgame_config& config) {
+    endgame = config;
+  }
+
+  static match_config match_limits;
+
+  void mftp_automaton::set_match_config (const match_config& config) {
+    match_limits = config;
+  }
+
+  // Shared by every automaton in the process so a burst of candidates can't start more downloads than the node can hold.
+  static download_budget downloads ((download_limits ()));
+
+  void mftp_automaton::set_download_limits (const download_limits& limits) {
+    downloads.set_limits (limits);
+  }
 
   // Not matching.
   mftp_automaton::mftp_automaton (std::auto_ptr<file> file,
@@ -18,23 +50,34 @@ namespace mftp {
     m_file (file.get ()),
     m_mfileid (file->get_mfileid ()),
     m_fileid (m_mfileid.get_fileid ()),
+    m_metrics (m_fileid, ioa::get_aid ()),
     m_channel (channel),
+    m_subscribed (false),
+    m_announced (false),
     m_send_state (SEND_READY),
     m_num_frag_in_sendq (0),
     m_num_req_in_sendq (0),
     m_num_match_in_sendq (0),
-    m_inserts_since_shuffle (0),
+    m_serving ((uint64_t (ioa::get_aid ()) << 32) ^ to_microseconds (clock::now ())),
+    m_rerequests (INIT_RTT, 2 * MAX_SUPPRESS),
     m_request_idx (0),
-    m_last_request_size (0),
-    m_fragments_since_request (0),
-    m_alarm_state (SET_READY),
-    m_announcement_interval (INIT_INTERVAL),
-    m_request_interval (INIT_INTERVAL),
-    m_match_interval (INIT_INTERVAL),
+    m_prng (uint64_t (ioa::get_aid ()) ^ to_microseconds (clock::now ())),
+    m_endgame_due (clock::now ()),
+    m_initial_missing (m_mfileid.get_fragment_count () - m_file->have_count ()),
+    m_endgame_rounds (0),
+    m_rtt (INIT_RTT),
+    m_arrival_interval (0),
+    m_request_interval (initial_interval ()),
+    m_match_interval (initial_interval ()),
     m_fragments_since_report (0),
     m_progress_threshold (progress_threshold),
     m_matching (false),
+    m_candidate_keyed (false),
     m_get_matching_files (false),
+    m_match_states (match_limits.capacity, to_microseconds (match_limits.ttl)),
+    m_match_heard (false),
+    m_match_heard_reported (false),
+    m_downloading (downloads, to_microseconds (MATCH_IDLE)),
     m_suicide_flag (suicide),
     m_reported (m_file->complete ())
   {
@@ -51,23 +94,34 @@ namespace mftp {
     m_file_ptr (0),
     m_mfileid (file->get_mfileid ()),
     m_fileid (m_mfileid.get_fileid ()),
+    m_metrics (m_fileid, ioa::get_aid ()),
     m_channel (channel),
+    m_subscribed (false),
+    m_announced (false),
     m_send_state (SEND_READY),
     m_num_frag_in_sendq (0),
     m_num_req_in_sendq (0),
     m_num_match_in_sendq (0),
-    m_inserts_since_shuffle (0),
+    m_serving ((uint64_t (ioa::get_aid ()) << 32) ^ to_microseconds (clock::now ())),
+    m_rerequests (INIT_RTT, 2 * MAX_SUPPRESS),
     m_request_idx (0),
-    m_last_request_size (0),
-    m_fragments_since_request (0),
-    m_alarm_state (SET_READY),
-    m_announcement_interval (INIT_INTERVAL),
-    m_request_interval (INIT_INTERVAL),
-    m_match_interval (INIT_INTERVAL),
+    m_prng (uint64_t (ioa::get_aid ()) ^ to_microseconds (clock::now ())),
+    m_endgame_due (clock::now ()),
+    m_initial_missing (m_mfileid.get_fragment_count () - m_file->have_count ()),
+    m_endgame_rounds (0),
+    m_rtt (INIT_RTT),
+    m_arrival_interval (0),
+    m_request_interval (initial_interval ()),
+    m_match_interval (initial_interval ()),
     m_fragments_since_report (0),
     m_progress_threshold (progress_threshold),
     m_matching (false),
+    m_candidate_keyed (false),
     m_get_matching_files (false),
+    m_match_states (match_limits.capacity, to_microseconds (match_limits.ttl)),
+    m_match_heard (false),
+    m_match_heard_reported (false),
+    m_downloading (downloads, to_microseconds (MATCH_IDLE)),
     m_suicide_flag (suicide),
     m_reported (m_file->complete ())
   {
@@ -86,25 +140,36 @@ namespace mftp {
     m_file (file.get ()),
     m_mfileid (file->get_mfileid ()),
     m_fileid (m_mfileid.get_fileid ()),
+    m_metrics (m_fileid, ioa::get_aid ()),
     m_channel (channel),
+    m_subscribed (false),
+    m_announced (false),
     m_send_state (SEND_READY),
     m_num_frag_in_sendq (0),
     m_num_req_in_sendq (0),
     m_num_match_in_sendq (0),
-    m_inserts_since_shuffle (0),
+    m_serving ((uint64_t (ioa::get_aid ()) << 32) ^ to_microseconds (clock::now ())),
+    m_rerequests (INIT_RTT, 2 * MAX_SUPPRESS),
     m_request_idx (0),
-    m_last_request_size (0),
-    m_fragments_since_request (0),
-    m_alarm_state (SET_READY),
-    m_announcement_interval (INIT_INTERVAL),
-    m_request_interval (INIT_INTERVAL),
-    m_match_interval (INIT_INTERVAL),
+    m_prng (uint64_t (ioa::get_aid ()) ^ to_microseconds (clock::now ())),
+    m_endgame_due (clock::now ()),
+    m_initial_missing (m_mfileid.get_fragment_count () - m_file->have_count ()),
+    m_endgame_rounds (0),
+    m_rtt (INIT_RTT),
+    m_arrival_interval (0),
+    m_request_interval (initial_interval ()),
+    m_match_interval (initial_interval ()),
     m_fragments_since_report (0),
     m_progress_threshold (progress_threshold),
     m_matching (true),
     m_match_candidate_predicate (match_candidate_pred.clone ()),
     m_match_predicate (match_pred.clone ()),
+    m_candidate_keyed (match_candidate_pred.key (m_candidate_key)),
     m_get_matching_files (get_matching_files),
+    m_match_states (match_limits.capacity, to_microseconds (match_limits.ttl)),
+    m_match_heard (false),
+    m_match_heard_reported (false),
+    m_downloading (downloads, to_microseconds (MATCH_IDLE)),
     m_suicide_flag (suicide),
     m_reported (m_file->complete ())
   {
@@ -124,25 +189,36 @@ namespace mftp {
     m_file_ptr (0),
     m_mfileid (file->get_mfileid ()),
     m_fileid (m_mfileid.get_fileid ()),
+    m_metrics (m_fileid, ioa::get_aid ()),
     m_channel (channel),
+    m_subscribed (false),
+    m_announced (false),
     m_send_state (SEND_READY),
     m_num_frag_in_sendq (0),
     m_num_req_in_sendq (0),
     m_num_match_in_sendq (0),
-    m_inserts_since_shuffle (0),
+    m_serving ((uint64_t (ioa::get_aid ()) << 32) ^ to_microseconds (clock::now ())),
+    m_rerequests (INIT_RTT, 2 * MAX_SUPPRESS),
     m_request_idx (0),
-    m_last_request_size (0),
-    m_fragments_since_request (0),
-    m_alarm_state (SET_READY),
-    m_announcement_interval (INIT_INTERVAL),
-    m_request_interval (INIT_INTERVAL),
-    m_match_interval (INIT_INTERVAL),
+    m_prng (uint64_t (ioa::get_aid ()) ^ to_microseconds (clock::now ())),
+    m_endgame_due (clock::now ()),
+    m_initial_missing (m_mfileid.get_fragment_count () - m_file->have_count ()),
+    m_endgame_rounds (0),
+    m_rtt (INIT_RTT),
+    m_arrival_interval (0),
+    m_request_interval (initial_interval ()),
+    m_match_interval (initial_interval ()),
     m_fragments_since_report (0),
     m_progress_threshold (progress_threshold),
     m_matching (true),
     m_match_candidate_predicate (match_candidate_pred.clone ()),
     m_match_predicate (match_pred.clone ()),
+    m_candidate_keyed (match_candidate_pred.key (m_candidate_key)),
     m_get_matching_files (get_matching_files),
+    m_match_states (match_limits.capacity, to_microseconds (match_limits.ttl)),
+    m_match_heard (false),
+    m_match_heard_reported (false),
+    m_downloading (downloads, to_microseconds (MATCH_IDLE)),
     m_suicide_flag (suicide),
     m_reported (m_file->complete ())
   {
@@ -150,6 +226,10 @@ namespace mftp {
   }
 
   void mftp_automaton::create_bindings () {
+    ioa::make_binding_manager (this,
+			       &m_self, &mftp_automaton::subscribe,
+			       &m_channel, &mftp_channel_automaton::subscribe);
+
     ioa::make_binding_manager (this,
 			       &m_self, &mftp_automaton::send,
 			       &m_channel, &mftp_channel_automaton::send);
@@ -163,24 +243,47 @@ namespace mftp {
 			       &m_self, &mftp_automaton::receive);
 
 
-    ioa::automaton_manager<ioa::alarm_automaton>* alarm = new ioa::automaton_manager<ioa::alarm_automaton> (this, ioa::make_generator<ioa::alarm_automaton> ());
-    ioa::make_binding_manager (this,
-			       &m_self,
-			       &mftp_automaton::set_alarm,
-			       alarm,
-			       &ioa::alarm_automaton::set);
-    ioa::make_binding_manager (this,
-			       alarm,
-			       &ioa::alarm_automaton::alarm,
-			       &m_self,
-			       &mftp_automaton::alarm_interrupt);
+    if (clock::simulated ()) {
+      m_simulator.reset (new ioa::handle_manager<simulator_automaton> (clock::simulator ()));
+      ioa::make_binding_manager (this,
+				 &m_self,
+				 &mftp_automaton::set_alarm,
+				 m_simulator.get (),
+				 &simulator_automaton::set);
+      ioa::make_binding_manager (this,
+				 m_simulator.get (),
+				 &simulator_automaton::alarm,
+				 &m_self,
+				 &mftp_automaton::alarm_interrupt);
+    }
+    else {
+      // The channel keeps the timers of all its automatons.
+      ioa::make_binding_manager (this,
+				 &m_self,
+				 &mftp_automaton::set_alarm,
+				 &m_channel,
+				 &mftp_channel_automaton::set_timer);
+      ioa::make_binding_manager (this,
+				 &m_channel,
+				 &mftp_channel_automaton::timer,
+				 &m_self,
+				 &mftp_automaton::alarm_interrupt);
+    }
 
-    send_announcement ();
     send_request ();
     schedule ();
   }
 
   void mftp_automaton::schedule () const {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::schedule");
+    // Gauges are refreshed after every action.
+    m_metrics.send_queue_depth->set (m_sendq.size ());
+    m_metrics.missing_intervals->set (m_file->m_dont_have.size ());
+    export_delays (m_sendq, m_metrics.queue_delays);
+
+    if (subscribe_precondition ()) {
+      ioa::schedule (&mftp_automaton::subscribe);
+    }
     if (send_precondition ()) {
       ioa::schedule (&mftp_automaton::send);
     }
@@ -202,93 +305,212 @@ namespace mftp {
     if (fragment_count_precondition ()) {
       ioa::schedule (&mftp_automaton::fragment_count);
     }
-  }
-
-  void mftp_automaton::send_announcement () {
-    // We need at least one fragment.
-    // If there are requests, then fragments are forthcoming so don't do anything.
-    // There is room in the sendq for another fragment.
-    if (!m_file->empty () && m_requests_set.empty () && m_num_frag_in_sendq < MAX_FRAGMENT_COUNT) {
-      const ioa::time now = ioa::time::now ();
-      if (m_frag_recv_time + m_announcement_interval <= now) {
-	// Send a fragment.
-	m_sendq.push (ioa::const_shared_ptr<std::string> (get_fragment (m_file->get_first_fragment_index ())));
-	++m_num_frag_in_sendq;
-	m_announcement_interval += m_announcement_interval;
-	m_announcement_interval = std::min (m_announcement_interval, MAX_INTERVAL);
-      }
+    if (match_heard_precondition ()) {
+      ioa::schedule (&mftp_automaton::match_heard);
     }
   }
-  
+
   void mftp_automaton::send_request () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::send_request");
     // We have requests to send.
     // There are no requests in the sendq.
-    // Enough time has elapsed since we sent a request or received a new fragment.
-    // We have received some fraction of the fragments that we last requested.
+    // Fewer requests are outstanding than it takes to keep fragments arriving for a round trip.
     if (!m_file->complete () &&
 	m_num_req_in_sendq == 0) {
 
-      const ioa::time now = ioa::time::now ();
-      const bool timeout = m_request_timeout_start + m_request_interval <= now;
-      const bool percent = REREQUEST_DENOMINATOR * m_fragments_since_request >= REREQUEST_NUMERATOR * m_last_request_size;
+      const ioa::time now = clock::now ();
+
+      if (in_endgame ()) {
+	if (m_endgame_due <= now) {
+	  // Each request names every missing fragment so it replaces those outstanding.
+	  m_windows.clear ();
+	  const uint32_t copies = std::max (endgame.copies, uint32_t (1));
+	  for (uint32_t copy = 0; copy != copies; ++copy) {
+	    queue_request (now);
+	    // Fragments requested more than once give ambiguous round trips.
+	    m_windows.back ().sampled = true;
+	  }
+	  m_endgame_due = now + endgame_interval ();
+	  ++m_endgame_rounds;
+	}
+	return;
+      }
 
-      if (timeout) {
+      if (m_request_timeout_start + m_request_interval <= now) {
+	// Nothing has arrived for a while so what is outstanding was lost.
+	m_windows.clear ();
 	// Increase the interval.
 	m_request_interval += m_request_interval;
 	m_request_interval = std::min (m_request_interval, MAX_INTERVAL);
       }
+      expire_windows (now);
+
+      if (m_windows.size () < target_windows ()) {
+	queue_request (now);
+      }
+    }
+  }
+
+  void mftp_automaton::queue_request (const ioa::time& now) {
+    interval_set<uint32_t>::const_iterator pos = m_file->m_dont_have.lower_bound (std::make_pair (m_request_idx, m_request_idx + 1));
+    if (pos == m_file->m_dont_have.end ()) {
+      pos = m_file->m_dont_have.begin ();
+    }
+
+    m_windows.push_back (request_window ());
+    request_window& w = m_windows.back ();
+    w.sent = now;
+    message m (request_type (), m_fileid);
 
-      if (timeout || percent) {
-	interval_set<uint32_t>::const_iterator pos = m_file->m_dont_have.lower_bound (std::make_pair (m_request_idx, m_request_idx + 1));
+    // The cursor continues from the last request so successive requests name different fragments.
+    uint32_t idx = 0;
+    while (idx < REQUEST_SIZE) {
+      if (interval_set<uint32_t>::intersect (*pos, std::make_pair (m_request_idx, m_request_idx + 1))) {
+	w.fragments.insert (m_request_idx);
+	trace::record (TRACE_FRAGMENT_REQUESTED, m_fileid, m_request_idx);
+	m.req.fragments[idx++] = m_request_idx++;
+      }
+      else {
+	++pos;
 	if (pos == m_file->m_dont_have.end ()) {
 	  pos = m_file->m_dont_have.begin ();
 	}
+	m_request_idx = pos->first;
+      }
+    }
 
-	std::set<uint32_t> frags;
-	message m (request_type (), m_fileid);
+    m.convert_to_network ();
+    m_sendq.push (CONTROL_CLASS, ioa::const_shared_ptr<std::string> (new std::string (reinterpret_cast<char *> (&m), sizeof (m))), now);
+    ++m_num_req_in_sendq;
 
-	uint32_t idx = 0;
-	while (idx < REQUEST_SIZE) {
-	  if (interval_set<uint32_t>::intersect (*pos, std::make_pair (m_request_idx, m_request_idx + 1))) {
-	    frags.insert (m_request_idx);
-	    m.req.fragments[idx++] = m_request_idx++;
-	  }
-	  else {
-	    ++pos;
-	    if (pos == m_file->m_dont_have.end ()) {
-	      pos = m_file->m_dont_have.begin ();
-	    }
-	    m_request_idx = pos->first;
-	  }
-	}
+    // Reset.
+    m_request_timeout_start = now;
+  }
+
+  bool mftp_automaton::in_endgame () const {
+    const uint32_t missing = m_mfileid.get_fragment_count () - m_file->have_count ();
+    return missing != 0 && missing <= endgame.threshold &&
+      m_initial_missing > endgame.threshold &&
+      m_endgame_rounds < endgame.rounds;
+  }
+
+  ioa::time mftp_automaton::endgame_interval () {
+    // By default, the time for an answer to come back.
+    uint64_t mean = to_microseconds (endgame.interval);
+    if (endgame.interval == ioa::time ()) {
+      const uint64_t missing = m_mfileid.get_fragment_count () - m_file->have_count ();
+      mean = m_rtt.srtt () + missing * m_arrival_interval;
+    }
+    // Uniform over half to one and a half times the mean so downloaders that finish together spread their requests.
+    const uint64_t interval = static_cast<uint64_t> (mean * (0.5 + m_prng.uniform ()));
+    return std::max (from_microseconds (interval), MIN_ALARM);
+  }
+
+  ioa::time mftp_automaton::initial_interval () const {
+    // Back-off starts from the retransmission timeout.
+    return from_microseconds (m_rtt.timeout (MIN_RTO, MAX_RTO));
+  }
+
+  static void take_earliest (ioa::time& deadline,
+			     const ioa::time& t) {
+    if (deadline == ioa::time () || t < deadline) {
+      deadline = t;
+    }
+  }
 
-	m_last_request_size = frags.size ();
+  ioa::time mftp_automaton::next_deadline () const {
+    // The channel announces the file so a complete file without matches has nothing to wait for.
+    ioa::time deadline;
+    if (in_endgame ()) {
+      take_earliest (deadline, m_endgame_due);
+    }
+    else if (!m_file->complete ()) {
+      take_earliest (deadline, m_request_timeout_start + m_request_interval);
+      for (std::list<request_window>::const_iterator pos = m_windows.begin (); pos != m_windows.end (); ++pos) {
+	take_earliest (deadline, window_due (*pos));
+      }
+    }
+    if (m_match_states.count (MATCH_YES) != 0) {
+      take_earliest (deadline, m_match_time + m_match_interval);
+    }
+    if (!m_candidates.empty ()) {
+      take_earliest (deadline, m_admission_time + ADMISSION_RETRY);
+    }
+    if (m_downloading.size () != 0) {
+      take_earliest (deadline, from_microseconds (m_downloading.next_deadline ()));
+    }
+    return deadline;
+  }
 
-	m.convert_to_network ();
-	m_sendq.push (ioa::const_shared_ptr<std::string> (new std::string (reinterpret_cast<char *> (&m), sizeof (m))));
-	++m_num_req_in_sendq;
+  ioa::time mftp_automaton::window_due (const request_window& w) const {
+    // A window gets a round trip plus the time its fragments take at the current rate.
+    return w.sent + from_microseconds (m_rtt.timeout (MIN_RTO, MAX_RTO) + w.fragments.size () * m_arrival_interval);
+  }
 
-	// Reset.
-	m_request_timeout_start = now;
-	m_fragments_since_request = 0;
-	m_last_request_size = 0;
+  uint32_t mftp_automaton::target_windows () const {
+    // Fragments that arrive during one round trip at the current rate.
+    const uint64_t in_flight = m_arrival_interval != 0 ? m_rtt.srtt () / m_arrival_interval : 0;
+    uint64_t windows = 1 + in_flight / REQUEST_SIZE;
+    // More would name the same fragments again.
+    const uint64_t missing = m_mfileid.get_fragment_count () - m_file->have_count ();
+    windows = std::min (windows, (missing + REQUEST_SIZE - 1) / REQUEST_SIZE);
+    windows = std::min (windows, uint64_t (MAX_WINDOWS));
+    return std::max (windows, uint64_t (1));
+  }
+
+  void mftp_automaton::expire_windows (const ioa::time& now) {
+    std::list<request_window>::iterator pos = m_windows.begin ();
+    while (pos != m_windows.end ()) {
+      if (window_due (*pos) <= now) {
+	pos = m_windows.erase (pos);
+      }
+      else {
+	++pos;
+      }
+    }
+  }
+
+  void mftp_automaton::fragment_arrived (const uint32_t idx,
+					 const ioa::time& now) {
+    if (!m_windows.empty () && m_last_arrival != ioa::time ()) {
+      const uint64_t interval = to_microseconds (now - m_last_arrival);
+      m_arrival_interval = m_arrival_interval == 0 ? interval : (7 * m_arrival_interval + interval) / 8;
+    }
+    m_last_arrival = now;
+
+    for (std::list<request_window>::iterator pos = m_windows.begin (); pos != m_windows.end (); ++pos) {
+      if (pos->fragments.count (idx) != 0) {
+	if (!pos->sampled) {
+	  m_rtt.sample (to_microseconds (now - pos->sent));
+	  pos->sampled = true;
+	}
+	++pos->arrived;
+	// A window that has mostly arrived makes room for the next request.
+	if (REREQUEST_DENOMINATOR * pos->arrived >= REREQUEST_NUMERATOR * pos->fragments.size ()) {
+	  m_windows.erase (pos);
+	}
+	break;
       }
     }
   }
 
   void mftp_automaton::send_match (bool reset) {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::send_match");
     // Reset if required.
     if (reset) {
       m_match_time = ioa::time ();
-      m_match_interval = INIT_INTERVAL;
+      m_match_interval = initial_interval ();
     }
 
+    // Forget files we haven't seen in a while.
+    const ioa::time now = clock::now ();
+    m_match_states.expire (to_microseconds (now));
+
     // We have matches to send.
     // There are no matches in the sendq.
-    if (!m_matches.empty () && m_num_match_in_sendq == 0) {
+    if (m_match_states.count (MATCH_YES) != 0 && m_num_match_in_sendq == 0) {
 
       // Enough time has elapsed.
-      const ioa::time now = ioa::time::now ();
       if (m_match_time + m_match_interval <= now) {
 
 	// Update the interval.
@@ -296,16 +518,29 @@ namespace mftp {
 	m_match_interval = std::min (m_match_interval, MAX_INTERVAL);
 
 	// Create match messages.
-	std::set<fileid>::const_iterator pos = m_matches.begin ();
-	while (pos != m_matches.end ()) {
+	// A few matches are listed so that others matching our file can use them.
+	// More go in filters that hold many times as many.
+	std::vector<fileid> matches;
+	m_match_states.collect (MATCH_YES, matches);
+	std::vector<fileid>::const_iterator pos = matches.begin ();
+	while (pos != matches.end ()) {
 	  message m (match_type (), m_fileid);
-	  while (m.mat.match_count < MATCHES_SIZE && pos != m_matches.end ()) {
-	    m.mat.matches[m.mat.match_count++] = *pos;
-	    ++pos;
+	  if (matches.size () <= MATCHES_SIZE) {
+	    while (m.mat.match_count < MATCHES_SIZE && pos != matches.end ()) {
+	      m.mat.matches[m.mat.match_count++] = *pos;
+	      ++pos;
+	    }
+	  }
+	  else {
+	    m = message (match_filter_type (), m_fileid);
+	    while (m.filt.match_count < MATCH_FILTER_CAPACITY && pos != matches.end ()) {
+	      m.filt.insert (*pos);
+	      ++pos;
+	    }
 	  }
 
 	  m.convert_to_network ();
-	  m_sendq.push (ioa::const_shared_ptr<std::string> (new std::string (reinterpret_cast<char *> (&m), sizeof (m))));
+	  m_sendq.push (CONTROL_CLASS, ioa::const_shared_ptr<std::string> (new std::string (reinterpret_cast<char *> (&m), sizeof (m))), now);
 	  ++m_num_match_in_sendq;
 	}
       }
@@ -313,41 +548,118 @@ namespace mftp {
   }
 
   void mftp_automaton::add_match (const fileid& fid) {
-    assert (m_matches.count (fid) == 0);
-    m_matches.insert (fid);
+    // A candidate forgotten while pending may have been checked twice.
+    const uint64_t now = to_microseconds (clock::now ());
+    if (m_match_states.state (fid, now) == MATCH_YES) {
+      return;
+    }
+    m_match_states.set (fid, MATCH_YES, now);
     // Reset the interval because we have something new.
     send_match (true);
   }
 
+  uint64_t mftp_automaton::suppress_window () const {
+    // Requests sent before the requester heard the fragment arrive within about one round trip of it.
+    // A server has no round trip of its own so it stays well inside the time receivers take to ask again.
+    uint64_t w = MIN_RTO;
+    if (m_rtt.sampled ()) {
+      w = m_rtt.srtt ();
+    }
+    else if (m_rerequests.sampled ()) {
+      w = m_rerequests.interval () / 2;
+    }
+    return std::max (MIN_SUPPRESS, std::min (MAX_SUPPRESS, w));
+  }
+
+  void mftp_automaton::note_requested (const uint32_t idx,
+				       const ioa::time& now) {
+    // Requests within the window are the same round (and suppressed anyway).
+    // Longer intervals than twice MAX_SUPPRESS don't change the window.
+    m_rerequests.request (idx, to_microseconds (now), suppress_window ());
+  }
+
+  void mftp_automaton::note_sent (const uint32_t idx,
+				  const ioa::time& now) {
+    m_recent_sends[idx] = now;
+    m_recent_order.push_back (std::make_pair (now, idx));
+    expire_sends (now);
+  }
+
+  void mftp_automaton::expire_sends (const ioa::time& now) {
+    const ioa::time window = from_microseconds (suppress_window ());
+    while (!m_recent_order.empty () && m_recent_order.front ().first + window <= now) {
+      std::map<uint32_t, ioa::time>::iterator pos = m_recent_sends.find (m_recent_order.front ().second);
+      // A later send of the same fragment is still recorded.
+      if (pos != m_recent_sends.end () && pos->second == m_recent_order.front ().first) {
+	m_recent_sends.erase (pos);
+      }
+      m_recent_order.pop_front ();
+    }
+  }
+
+  bool mftp_automaton::recently_sent (const uint32_t idx,
+				      const ioa::time& now) {
+    expire_sends (now);
+    return m_recent_sends.count (idx) != 0;
+  }
+
   bool mftp_automaton::send_precondition () const {
     return !m_sendq.empty () && m_send_state == SEND_READY && ioa::binding_count (&mftp_automaton::send) != 0;
   }
 
   ioa::const_shared_ptr<std::string> mftp_automaton::send_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::send_effect");
     ioa::const_shared_ptr<std::string> m = m_sendq.front ();
-    m_sendq.pop ();
+    m_sendq.pop (clock::now ());
     const message* msg = reinterpret_cast<const message*> (m->data ());
     switch (ntohl (msg->header.message_type)) {
     case FRAGMENT:
       --m_num_frag_in_sendq;
+      note_sent (ntohl (msg->frag.idx), clock::now ());
+      m_metrics.fragments_sent->add ();
+      trace::record (TRACE_FRAGMENT_SENT, m_fileid, ntohl (msg->frag.idx));
       break;
     case REQUEST:
       --m_num_req_in_sendq;
+      // The newest window is the request that just left.
+      if (!m_windows.empty ()) {
+	m_windows.back ().sent = clock::now ();
+      }
+      m_metrics.requests_sent->add ();
+      trace::record (TRACE_REQUEST_SENT, m_fileid, 0);
       break;
     case MATCH:
+    case MATCH_FILTER:
       --m_num_match_in_sendq;
+      m_metrics.matches_sent->add ();
+      trace::record (TRACE_MATCH_SENT, m_fileid, 0);
       break;
     }
+    m_metrics.bytes_sent->add (m->size ());
     
     m_send_state = SEND_COMPLETE_WAIT;
     return m;
   }
 
   void mftp_automaton::send_complete_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::send_complete_effect");
     m_send_state = SEND_READY;
   }
 
+  bool mftp_automaton::subscribe_precondition () const {
+    // Subscribe again once there is something to announce.
+    return (!m_subscribed || m_announced == m_file->empty ()) && ioa::binding_count (&mftp_automaton::subscribe) != 0;
+  }
+
+  subscription mftp_automaton::subscribe_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::subscribe_effect");
+    m_subscribed = true;
+    m_announced = !m_file->empty ();
+    return subscription (m_fileid, m_matching, m_announced, m_candidate_keyed, m_candidate_key);
+  }
+
   void mftp_automaton::receive_effect (const ioa::const_shared_ptr<message>& m) {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::receive_effect");
     switch (m->header.message_type) {
     case FRAGMENT:
       {
@@ -356,52 +668,51 @@ namespace mftp {
 	  // If we are looking for our own file, it must be a fragment from our file and the offset must be correct.
 	  if (m->frag.fid == m_fileid) {
 	    // Record the time.
-	    m_frag_recv_time = ioa::time::now ();
+	    m_frag_recv_time = clock::now ();
+	    m_metrics.fragments_received->add ();
 
 	    // Remove fragment from requests.
-	    m_requests_set.erase (m->frag.idx);
+	    // The copy just heard answers requests that cross it.
+	    m_serving.erase (m->frag.idx);
+	    note_sent (m->frag.idx, m_frag_recv_time);
 
 	    // Save the fragment.
-	    if (!m_file->complete ()) {
-	      if (m_file_ptr->write_chunk (m->frag.idx, m->frag.data)) {
-		// Just received an new fragment.  Push the time to send a request.
-		m_request_timeout_start = ioa::time::now ();
-		++m_fragments_since_report;
-	      }
+	    if (!m_file->complete () && m_file_ptr->write_chunk (m->frag.idx, m->frag.data)) {
+	      // Just received an new fragment.  Push the time to send a request.
+	      m_request_timeout_start = clock::now ();
+	      ++m_fragments_since_report;
+	      fragment_arrived (m->frag.idx, m_frag_recv_time);
+	      // The sender is back so start the back-off over.
+	      m_request_interval = initial_interval ();
+	      m_endgame_rounds = 0;
+	      trace::record (TRACE_FRAGMENT_RECEIVED, m_fileid, m->frag.idx);
+	    }
+	    else {
+	      m_metrics.fragments_duplicate->add ();
+	      trace::record (TRACE_FRAGMENT_DUPLICATE, m_fileid, m->frag.idx);
 	    }
 
 	    // Send a request, possibly.
-	    ++m_fragments_since_request;
 	    send_request ();
 	  }
 
 	  // Otherwise, we could be looking for files that might match our file.
 	  // If we are matching, we have not already checked this one AND it is interesting:
-	  else if (m_matching &&
-		   m_pending_matches.count (m->frag.fid) == 0 &&
-		   m_matches.count (m->frag.fid) == 0 &&
-		   m_non_matches.count (m->frag.fid) == 0 &&
-		   (*m_match_candidate_predicate) (m->frag.fid)) {
-	  
-	    m_pending_matches.insert (m->frag.fid);
-
-	    std::auto_ptr<file> f (new file (m->frag.fid));
-	    f->write_chunk (m->frag.idx, m->frag.data);
-
-	    if (f->complete()) {
-	      // We received the whole file.
+	  else if (m_matching && new_match_candidate (m->frag.fid)) {
+	    if (mfileid (m->frag.fid).get_fragment_count () == 1) {
+	      // The fragment is the whole file.
+	      std::auto_ptr<file> f (new file (m->frag.fid));
+	      f->write_chunk (m->frag.idx, m->frag.data);
 	      process_match_candidate (ioa::const_shared_ptr<file> (f.release ()));
 	    }
 	    else {
-	      // Create an mftp_automaton with MATCHING FALSE and PROGRESS FALSE to download other file.
-	      // Perform matching when the download is complete.
-	      ioa::automaton_manager<mftp_automaton>* new_file_home = new ioa::automaton_manager<mftp_automaton> (this, ioa::make_generator<mftp_automaton> (f, m_channel.get_handle(), true, 0));
-	      
-	      ioa::make_binding_manager (this,
-					 new_file_home, &mftp_automaton::download_complete,
-					 &m_self, &mftp_automaton::match_download_complete);
+	      queue_match_candidate (m->frag.fid, HEARD);
 	    }
-	  } 
+	  }
+	}
+	else if (m->frag.fid == m_fileid) {
+	  m_metrics.fragments_corrupt->add ();
+	  trace::record (TRACE_FRAGMENT_CORRUPT, m_fileid, m->frag.idx);
 	}
       }
       break;
@@ -410,26 +721,49 @@ namespace mftp {
       {
 	// Requests must be for our file.
 	if (m->req.fid == m_fileid) {
+	  m_metrics.requests_received->add ();
 
 	  // TODO:  Do somethign with the rate.
 	  //std::cout << "Rate: " << m->req.fragment_rate << std::endl;
 
 	  // Add the requests to the current set of requests.
+	  const ioa::time now = clock::now ();
+	  // A request for fewer than REQUEST_SIZE fragments repeats them but counts once toward popularity.
+	  std::set<uint32_t> counted;
 	  for (uint32_t idx = 0; idx < REQUEST_SIZE; ++idx) {
+	    const uint32_t frag = m->req.fragments[idx];
+	    trace::record (TRACE_REQUEST_RECEIVED, m_fileid, frag);
+	    if (!counted.insert (frag).second) {
+	      continue;
+	    }
+	    note_requested (frag, now);
+	    // A copy was just multicast so the request crossed it.
+	    if (recently_sent (frag, now)) {
+	      m_metrics.fragments_suppressed->add ();
+	      continue;
+	    }
 	    // If we have the fragment.
-	    if (m_file->m_dont_have.find_first_intersect (std::make_pair (m->req.fragments[idx], m->req.fragments[idx] + 1)) == m_file->m_dont_have.end ()) {
-	      std::pair<std::set<uint32_t>::iterator, bool> p = m_requests_set.insert (m->req.fragments[idx]);
-	    // If the fragment was not already requested.
-	    if (p.second) {
-	      // Add to the set of requested fragments.
-	      m_requests_deque.push_back (m->req.fragments[idx]);
-	      ++m_inserts_since_shuffle;
-	      if (m_inserts_since_shuffle >= SHUFFLE_LIMIT) {
-		std::random_shuffle (m_requests_deque.begin (), m_requests_deque.end ());
-		m_inserts_since_shuffle = 0;
-	      }
+	    if (m_file->m_dont_have.find_first_intersect (std::make_pair (frag, frag + 1)) == m_file->m_dont_have.end ()) {
+	      m_serving.request (frag);
 	    }
 	  }
+	}
+      }
+      break;
+
+    case CATALOG:
+      {
+	for (uint32_t idx = 0; idx < m->cat.fileid_count; ++idx) {
+	  const fileid& fid = m->cat.fileids[idx];
+	  if (fid == m_fileid) {
+	    if (!m_file->complete ()) {
+	      // Somebody has the file so ask without waiting out the back-off.
+	      m_request_interval = initial_interval ();
+	      send_request ();
+	    }
+	  }
+	  else if (m_matching && new_match_candidate (fid)) {
+	    queue_match_candidate (fid, LISTED);
 	  }
 	}
       }
@@ -438,63 +772,28 @@ namespace mftp {
     case MATCH:
       {
 	if (m_matching) {
+	  m_metrics.matches_received->add ();
+	  trace::record (TRACE_MATCH_RECEIVED, m_fileid, 0);
 	  if (m->mat.fid != m_fileid) {
 	    // Search for our fileid in the set of matches.
 	    for (uint32_t idx = 0; idx < m->mat.match_count; ++idx) {
+	      if (m->mat.matches[idx] == m_fileid) {
+		m_match_heard = true;
+	      }
 	      if (m->mat.matches[idx] == m_fileid &&
-		  m_pending_matches.count (m->mat.fid) == 0 &&
-		  m_matches.count (m->mat.fid) == 0 &&
-		  m_non_matches.count (m->mat.fid) == 0 &&
-		  (*m_match_candidate_predicate) (m->mat.fid)) {
-		// We have never seen this before.
-		if (m_get_matching_files) {
-		  // We need to get the file.
-		  m_pending_matches.insert (m->mat.fid);
-
-		  // Create an mftp_automaton with MATCHING FALSE to download other file.
-		  // Perform matching when the download is complete.
-		  std::auto_ptr<file> f (new file (m->mat.fid));
-		  ioa::automaton_manager<mftp_automaton>* new_file_home = new ioa::automaton_manager<mftp_automaton> (this, ioa::make_generator<mftp_automaton> (f, m_channel.get_handle(), true, 0));
-		    
-		  ioa::make_binding_manager (this,
-					     new_file_home, &mftp_automaton::download_complete,
-					     &m_self, &mftp_automaton::match_download_complete);
-		}
-		else {
-		  // We can just add it to the set.
-		  add_match (m->mat.fid);
-		}
+		  new_match_candidate (m->mat.fid)) {
+		claimed_match (m->mat.fid);
 	      }
 	    }
 	  }
 	  else {
 	    // Record the time.
-	    m_match_time = ioa::time::now ();
+	    m_match_time = clock::now ();
 
 	    // Add all matches in the set.
 	    for (uint32_t idx = 0; idx < m->mat.match_count; ++idx) {
-	      if (m_pending_matches.count (m->mat.matches[idx]) == 0 &&
-		  m_matches.count (m->mat.matches[idx]) == 0 &&
-		  m_non_matches.count (m->mat.matches[idx]) == 0 &&
-		  (*m_match_candidate_predicate) (m->mat.matches[idx])) {
-		// We have never seen this before.
-		if (m_get_matching_files) {
-		  // We need to get the file.
-		  m_pending_matches.insert (m->mat.matches[idx]);
-
-		  // Create an mftp_automaton with MATCHING FALSE to download other file.
-		  // Perform matching when the download is complete.
-		  std::auto_ptr<file> f (new file (m->mat.matches[idx]));
-		  ioa::automaton_manager<mftp_automaton>* new_file_home = new ioa::automaton_manager<mftp_automaton> (this, ioa::make_generator<mftp_automaton> (f, m_channel.get_handle(), true, 0));
-		    
-		  ioa::make_binding_manager (this,
-					     new_file_home, &mftp_automaton::download_complete,
-					     &m_self, &mftp_automaton::match_download_complete);
-		}
-		else {
-		  // We can just add it to the set.
-		  add_match (m->mat.matches[idx]);
-		}
+	      if (new_match_candidate (m->mat.matches[idx])) {
+		claimed_match (m->mat.matches[idx]);
 	      }
 	    }
 	  }
@@ -502,6 +801,29 @@ namespace mftp {
       }
       break;
 
+    case MATCH_FILTER:
+      {
+	if (m_matching) {
+	  m_metrics.matches_received->add ();
+	  trace::record (TRACE_MATCH_RECEIVED, m_fileid, 0);
+	  if (m->filt.fid != m_fileid) {
+	    // Test our fileid against the filter.
+	    if (m->filt.contains (m_fileid)) {
+	      m_match_heard = true;
+	      // A filter can be wrong so the claim is checked before it is advertised.
+	      if (new_match_candidate (m->filt.fid)) {
+		queue_match_candidate (m->filt.fid, CLAIMED);
+	      }
+	    }
+	  }
+	  else {
+	    // The matches can't be read out of a filter but they were sent.
+	    m_match_time = clock::now ();
+	  }
+	}
+      }
+      break;
+
     default:
       // Unknown message type.
       break;
@@ -510,40 +832,47 @@ namespace mftp {
   }
 
   bool mftp_automaton::set_alarm_precondition () const {
-    return m_alarm_state == SET_READY && ioa::binding_count (&mftp_automaton::set_alarm) != 0;
+    if (ioa::binding_count (&mftp_automaton::set_alarm) == 0) {
+      return false;
+    }
+    // Set the timer when there is a deadline and the timer would miss it.
+    const ioa::time deadline = next_deadline ();
+    return deadline != ioa::time () && (m_armed == ioa::time () || deadline < m_armed);
   }
 
   ioa::time mftp_automaton::set_alarm_effect () {
-    m_alarm_state = INTERRUPT_WAIT;
-    return ALARM_INTERVAL;
+    MFTP_PROFILE_SCOPE ("mftp_automaton::set_alarm_effect");
+    const ioa::time now = clock::now ();
+    m_armed = next_deadline ();
+    if (m_armed <= now + MIN_ALARM) {
+      return MIN_ALARM;
+    }
+    return m_armed - now;
   }
 
   void mftp_automaton::alarm_interrupt_effect () {
-    assert (m_alarm_state == INTERRUPT_WAIT);
-    m_alarm_state = SET_READY;
+    MFTP_PROFILE_SCOPE ("mftp_automaton::alarm_interrupt_effect");
+    m_armed = ioa::time ();
 
-    send_announcement ();
     send_request ();
     send_match (false);
+    expire_downloads ();
+    start_downloads ();
   }
 
   bool mftp_automaton::send_fragment_precondition () const {
-    return !m_requests_deque.empty () && m_num_frag_in_sendq < MAX_FRAGMENT_COUNT;
+    return !m_serving.empty () && m_num_frag_in_sendq < MAX_FRAGMENT_COUNT;
   }
 
   void mftp_automaton::send_fragment_effect () {
-    uint32_t idx = m_requests_deque.front ();
-    m_requests_deque.pop_front ();
+    MFTP_PROFILE_SCOPE ("mftp_automaton::send_fragment_effect");
+    const uint32_t idx = m_serving.front ();
+    m_serving.pop ();
     
-    std::set<uint32_t>::const_iterator pos = m_requests_set.find (idx);
-    if (pos != m_requests_set.end ()) {
-      // Remove it from the requests.
-      m_requests_set.erase (pos);
-      
-      // Get the fragment for that index.
-      m_sendq.push (ioa::const_shared_ptr<std::string> (get_fragment (idx)));
-      ++m_num_frag_in_sendq;
-    }
+    // Get the fragment for that index.
+    m_sendq.push (DATA_CLASS, ioa::const_shared_ptr<std::string> (get_fragment (idx)), clock::now ());
+    ++m_num_frag_in_sendq;
+    trace::record (TRACE_FRAGMENT_QUEUED, m_fileid, idx);
   }
 
   bool mftp_automaton::download_complete_precondition () const {
@@ -551,6 +880,7 @@ namespace mftp {
   }
 
   ioa::const_shared_ptr<file> mftp_automaton::download_complete_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::download_complete_effect");
     m_reported = true;
     return m_file;
   }
@@ -560,20 +890,132 @@ namespace mftp {
   }
 
   void mftp_automaton::suicide_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::suicide_effect");
     m_suicide_flag = false;
     self_destruct ();
   }
 
   void mftp_automaton::match_download_complete_effect (const ioa::const_shared_ptr<file>& f,
 						       ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::match_download_complete_effect");
     //For use when the child has reported a download_complete.
     process_match_candidate (f);
   }
 
+  void mftp_automaton::match_download_progress_effect (const uint32_t& have,
+						       ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::match_download_progress_effect");
+    std::map<fileid, ioa::automaton_manager<mftp_automaton>*>::const_iterator pos;
+    for (pos = m_children.begin (); pos != m_children.end () && pos->second->get_handle () != aid; ++pos) { ; }
+    if (pos != m_children.end ()) {
+      m_downloading.renew (pos->first, to_microseconds (clock::now ()));
+    }
+  }
+
+  bool mftp_automaton::new_match_candidate (const fileid& fid) {
+    // A keyed predicate needs no call.
+    if (m_candidate_keyed ? !(candidate_key (fid) == m_candidate_key) : !(*m_match_candidate_predicate) (fid)) {
+      return false;
+    }
+    const uint64_t now = to_microseconds (clock::now ());
+    if (m_match_states.state (fid, now) != MATCH_UNKNOWN) {
+      // Seen again so remember it longer.
+      m_match_states.touch (fid, now);
+      return false;
+    }
+    m_match_states.set (fid, MATCH_PENDING, now);
+    return true;
+  }
+
+  void mftp_automaton::claimed_match (const fileid& fid) {
+    // We have never seen this before.
+    if (m_get_matching_files) {
+      // We need to get the file and check it.
+      queue_match_candidate (fid, CLAIMED);
+    }
+    else {
+      // We can just add it to the set.
+      add_match (fid);
+    }
+  }
+
+  void mftp_automaton::queue_match_candidate (const fileid& fid,
+					      const candidate_source source) {
+    m_candidates.insert (queued_candidate (source, fid));
+    if (m_candidates.size () > MAX_QUEUED_CANDIDATES) {
+      // Forget the worst so it can be found again.
+      std::set<queued_candidate>::iterator worst = m_candidates.end ();
+      --worst;
+      m_match_states.erase (worst->fid);
+      m_candidates.erase (worst);
+    }
+    start_downloads ();
+  }
+
+  void mftp_automaton::start_downloads () {
+    while (!m_candidates.empty ()) {
+      const fileid fid = m_candidates.begin ()->fid;
+      if (m_downloading.contains (fid)) {
+	// Queued again after being forgotten.
+	m_candidates.erase (m_candidates.begin ());
+	continue;
+      }
+      if (!m_downloading.acquire (fid, mfileid (fid).get_final_length (), to_microseconds (clock::now ()))) {
+	// Other automatons may make room so look again later.
+	m_admission_time = clock::now ();
+	return;
+      }
+      m_candidates.erase (m_candidates.begin ());
+      std::auto_ptr<file> f (new file (fid));
+      fetch_match_candidate (f);
+    }
+  }
+
+  void mftp_automaton::expire_downloads () {
+    // Nobody is serving these so give their room to other candidates.
+    std::vector<fileid> idle;
+    const uint64_t now = to_microseconds (clock::now ());
+    m_downloading.expire (now, idle);
+    for (std::vector<fileid>::const_iterator pos = idle.begin (); pos != idle.end (); ++pos) {
+      std::map<fileid, ioa::automaton_manager<mftp_automaton>*>::iterator child = m_children.find (*pos);
+      if (child != m_children.end ()) {
+	child->second->destroy ();
+	m_children.erase (child);
+      }
+      // Not downloaded again until it is forgotten.
+      m_match_states.set (*pos, MATCH_NO, now);
+    }
+  }
+
+  void mftp_automaton::fetch_match_candidate (std::auto_ptr<file> f) {
+    if (f->complete()) {
+      // We received the whole file.
+      process_match_candidate (ioa::const_shared_ptr<file> (f.release ()));
+    }
+    else {
+      // Create an mftp_automaton with MATCHING FALSE to download other file.
+      // Perform matching when the download is complete.
+      // Its progress reports keep it from being given up as idle.
+      const fileid fid = f->get_mfileid ().get_fileid ();
+      ioa::automaton_manager<mftp_automaton>* new_file_home = new ioa::automaton_manager<mftp_automaton> (this, ioa::make_generator<mftp_automaton> (f, m_channel.get_handle(), true, MATCH_PROGRESS));
+      m_children[fid] = new_file_home;
+
+      ioa::make_binding_manager (this,
+				 new_file_home, &mftp_automaton::download_complete,
+				 &m_self, &mftp_automaton::match_download_complete);
+
+      ioa::make_binding_manager (this,
+				 new_file_home, &mftp_automaton::fragment_count,
+				 &m_self, &mftp_automaton::match_download_progress);
+    }
+  }
+
   void mftp_automaton::process_match_candidate (const ioa::const_shared_ptr<file>& f) {
-    // Remove from pending.
+    // No longer pending.
     fileid fid = f->get_mfileid ().get_fileid ();
-    m_pending_matches.erase (fid);
+    const bool downloaded = m_downloading.release (fid);
+    // The child destroys itself after reporting.
+    m_children.erase (fid);
 
     if ((*m_match_predicate) (*f)) {
       add_match (fid);
@@ -582,7 +1024,12 @@ namespace mftp {
       }
     }
     else {
-      m_non_matches.insert (fid);
+      m_match_states.set (fid, MATCH_NO, to_microseconds (clock::now ()));
+    }
+
+    if (downloaded) {
+      // Room for the next candidate.
+      start_downloads ();
     }
   }
 
@@ -591,6 +1038,7 @@ namespace mftp {
   }
 
   ioa::const_shared_ptr<file> mftp_automaton::match_complete_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::match_complete_effect");
     ioa::const_shared_ptr<file> f = m_matching_files.front ();
     m_matching_files.pop ();
     return f;
@@ -604,7 +1052,11 @@ namespace mftp {
 
   bool mftp_automaton::fragment_count_precondition () const {
     if (m_progress_threshold != 0) {
-      if (!m_file->complete () && m_fragments_since_report >= m_progress_threshold) {
+      if (m_fragments_since_report != 0 && m_fragments_since_report == m_file->have_count ()) {
+	// The first fragments of the download.
+	return true;
+      }
+      else if (!m_file->complete () && m_fragments_since_report >= m_progress_threshold) {
 	return true;
       }
       else if (m_file->complete () && m_fragments_since_report != 0) {
@@ -615,8 +1067,18 @@ namespace mftp {
   }
 
   uint32_t mftp_automaton::fragment_count_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::fragment_count_effect");
     m_fragments_since_report = 0;
     return m_file->have_count ();
   }
 
+  bool mftp_automaton::match_heard_precondition () const {
+    return m_match_heard && !m_match_heard_reported && ioa::binding_count (&mftp_automaton::match_heard) != 0;
+  }
+
+  void mftp_automaton::match_heard_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_automaton::match_heard_effect");
+    m_match_heard_reported = true;
+  }
+
 }
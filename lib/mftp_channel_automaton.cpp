@@ -1,19 +1,155 @@
+// Before anything that includes profile.hpp so MFTP_PROFILE is seen.
+#include <config.hpp>
+
 #include <mftp/mftp_channel_automaton.hpp>
 
-#include <config.hpp>
+#include <mftp/capture.hpp>
+#include <mftp/clock.hpp>
+#include <mftp/profile.hpp>
+#include <mftp/trace.hpp>
+
 #include <iostream>
 
 namespace mftp {
 
+  const ioa::time mftp_channel_automaton::TIMER_TICK (0, 1000); // 1 millisecond
+  const ioa::time mftp_channel_automaton::MAX_SLEEP (1, 0); // 1 second
+  const size_t mftp_channel_automaton::ALARM_COUNT (4);
+  const ioa::time mftp_channel_automaton::CATALOG_INTERVAL (0, 100000); // 100 milliseconds
+  const ioa::time mftp_channel_automaton::MAX_CATALOG_INTERVAL (64, 0); // slightly over 1 minute
+  const ioa::time mftp_channel_automaton::CATALOG_QUIET (120, 0); // 2 minutes
+  const ioa::time mftp_channel_automaton::MAX_CATALOG_WAIT (1, 0); // 1 second
+  const size_t mftp_channel_automaton::CATALOG_ECHOES = 16;
+
   mftp_channel_automaton::mftp_channel_automaton (const ioa::inet_address& send_address,
 						  const ioa::inet_address& local_address,
-						  const bool multicast) :
+						  const bool multicast,
+						  const bool kernel_filter,
+						  const receiver_config& config) :
+    m_self (ioa::get_aid ()),
+    m_pending_aid (-1),
+    m_shards (send_address),
+    m_local (local_address),
+    m_multicast (multicast),
+    m_receiver_config (config),
+    m_kernel_filter (kernel_filter),
+    m_filter_changed (true),
+    m_metrics (ioa::get_aid ()),
+    m_epoch (clock::now ()),
+    m_aid (ioa::get_aid ()),
+    m_catalog_pending (false),
+    m_catalog_quiet (false),
+    m_catalog_listed (0),
+    m_catalog_interval (CATALOG_INTERVAL),
+    m_interest_time (clock::now ()),
+    m_catalog_alarm_state (SET_READY)
+  {
+    create_bindings ();
+  }
+
+  mftp_channel_automaton::mftp_channel_automaton (const shard_map& shards,
+						  const ioa::inet_address& local_address,
+						  const bool kernel_filter,
+						  const receiver_config& config) :
     m_self (ioa::get_aid ()),
     m_pending_aid (-1),
-    m_send (send_address)
+    m_shards (shards),
+    m_local (local_address),
+    m_multicast (true),
+    m_receiver_config (config),
+    m_kernel_filter (kernel_filter),
+    m_filter_changed (true),
+    m_metrics (ioa::get_aid ()),
+    m_epoch (clock::now ()),
+    m_aid (ioa::get_aid ()),
+    m_catalog_pending (false),
+    m_catalog_quiet (false),
+    m_catalog_listed (0),
+    m_catalog_interval (CATALOG_INTERVAL),
+    m_interest_time (clock::now ()),
+    m_catalog_alarm_state (SET_READY)
   {
+    create_bindings ();
+  }
+
+  mftp_channel_automaton::mftp_channel_automaton (const ioa::automaton_handle<loopback_medium_automaton>& medium) :
+    m_self (ioa::get_aid ()),
+    m_pending_aid (-1),
+    m_shards (ioa::inet_address ()),
+    m_multicast (false),
+    m_medium (new ioa::handle_manager<loopback_medium_automaton> (medium)),
+    m_kernel_filter (false),
+    m_filter_changed (false),
+    m_metrics (ioa::get_aid ()),
+    m_epoch (clock::now ()),
+    m_aid (ioa::get_aid ()),
+    m_catalog_pending (false),
+    m_catalog_quiet (false),
+    m_catalog_listed (0),
+    m_catalog_interval (CATALOG_INTERVAL),
+    m_interest_time (clock::now ()),
+    m_catalog_alarm_state (SET_READY)
+  {
+    create_bindings ();
+  }
+
+  void mftp_channel_automaton::create_bindings () {
     add_observable (&send);
     add_observable (&send_complete);
+    add_observable (&subscribe);
+    add_observable (&receive);
+    add_observable (&set_timer);
+    add_observable (&timer);
+    add_observable (&set_alarm);
+
+    // Catalogs have an alarm of their own.
+    // The timers of automatons use a pool: a pending alarm can't be moved earlier, so a new earliest deadline takes another alarm.
+    // Under a simulator, automatons take their timers from it instead.
+    if (clock::simulated ()) {
+      m_simulator.reset (new ioa::handle_manager<simulator_automaton> (clock::simulator ()));
+      ioa::make_binding_manager (this,
+				 &m_self, &mftp_channel_automaton::set_catalog_alarm,
+				 m_simulator.get (), &simulator_automaton::set);
+      ioa::make_binding_manager (this,
+				 m_simulator.get (), &simulator_automaton::alarm,
+				 &m_self, &mftp_channel_automaton::catalog_alarm_interrupt);
+    }
+    else {
+      ioa::automaton_manager<ioa::alarm_automaton>* catalog_alarm = new ioa::automaton_manager<ioa::alarm_automaton> (this, ioa::make_generator<ioa::alarm_automaton> ());
+      ioa::make_binding_manager (this,
+				 &m_self, &mftp_channel_automaton::set_catalog_alarm,
+				 catalog_alarm, &ioa::alarm_automaton::set);
+      ioa::make_binding_manager (this,
+				 catalog_alarm, &ioa::alarm_automaton::alarm,
+				 &m_self, &mftp_channel_automaton::catalog_alarm_interrupt);
+
+      for (size_t count = 0; count != ALARM_COUNT; ++count) {
+	ioa::automaton_manager<ioa::alarm_automaton>* alarm = new ioa::automaton_manager<ioa::alarm_automaton> (this, ioa::make_generator<ioa::alarm_automaton> ());
+	ioa::make_binding_manager (this,
+				   &m_self, &mftp_channel_automaton::set_alarm,
+				   alarm, &ioa::alarm_automaton::set);
+	ioa::make_binding_manager (this,
+				   alarm, &ioa::alarm_automaton::alarm,
+				   &m_self, &mftp_channel_automaton::alarm_interrupt);
+      }
+    }
+
+    if (m_medium.get () != 0) {
+      ioa::make_binding_manager (this,
+				 &m_self, &mftp_channel_automaton::send_out,
+				 m_medium.get (), &loopback_medium_automaton::send);
+
+      ioa::make_binding_manager (this,
+				 m_medium.get (), &loopback_medium_automaton::send_complete,
+				 &m_self, &mftp_channel_automaton::send_in_complete);
+
+      ioa::make_binding_manager (this,
+				 m_medium.get (), &loopback_medium_automaton::receive,
+				 &m_self, &mftp_channel_automaton::receive_in);
+
+      schedule ();
+      return;
+    }
 
     ioa::automaton_manager<ioa::udp_sender_automaton>* sender = new ioa::automaton_manager<ioa::udp_sender_automaton> (this, ioa::make_generator<ioa::udp_sender_automaton> (sizeof (message)));
 
@@ -25,22 +161,79 @@ namespace mftp {
 			       sender, &ioa::udp_sender_automaton::send_complete,
 			       &m_self, &mftp_channel_automaton::send_in_complete);
 
-    ioa::automaton_manager<ioa::udp_receiver_automaton>* receiver;
-    if (multicast) {
-      receiver = new ioa::automaton_manager<ioa::udp_receiver_automaton> (this, ioa::make_generator<ioa::udp_receiver_automaton> (send_address, local_address));
+    // Data groups are joined when somebody subscribes to a file in them and left when the last one goes.
+    m_receivers.resize (m_shards.size (), 0);
+    m_group_members.resize (m_shards.size (), 0);
+    join (0);
+
+    schedule ();
+  }
+
+  void mftp_channel_automaton::join (const size_t group) {
+    if (m_medium.get () != 0) {
+      return;
+    }
+    ++m_group_members[group];
+    if (m_receivers[group] != 0) {
+      return;
+    }
+
+    const std::string labels (receiver_metrics::make_labels (m_metrics.labels, group));
+    ioa::automaton_manager<mftp_receiver_automaton>* receiver;
+    if (m_multicast) {
+      receiver = new ioa::automaton_manager<mftp_receiver_automaton> (this, ioa::make_generator<mftp_receiver_automaton> (m_shards.address (group), m_local, labels, m_receiver_config));
     }
     else {
-      receiver = new ioa::automaton_manager<ioa::udp_receiver_automaton> (this, ioa::make_generator<ioa::udp_receiver_automaton> (local_address));
+      receiver = new ioa::automaton_manager<mftp_receiver_automaton> (this, ioa::make_generator<mftp_receiver_automaton> (m_local, labels, m_receiver_config));
     }
+    m_receivers[group] = receiver;
 
     ioa::make_binding_manager (this,
-			       receiver, &ioa::udp_receiver_automaton::receive,
+			       receiver, &mftp_receiver_automaton::receive,
 			       &m_self, &mftp_channel_automaton::receive_in);
 
-    schedule ();
+    ioa::make_binding_manager (this,
+			       &m_self, &mftp_channel_automaton::filter,
+			       receiver, &mftp_receiver_automaton::set_filter);
+
+    // The new socket needs a filter.
+    m_filter_changed = true;
+  }
+
+  void mftp_channel_automaton::leave (const size_t group) {
+    if (m_medium.get () != 0) {
+      return;
+    }
+    // The channel's own membership keeps the control group.
+    if (--m_group_members[group] == 0) {
+      m_receivers[group]->destroy ();
+      m_receivers[group] = 0;
+    }
+  }
+
+  size_t mftp_channel_automaton::destination (const std::string& buffer) const {
+    const message* msg = reinterpret_cast<const message*> (buffer.data ());
+    fileid fid;
+    switch (ntohl (msg->header.message_type)) {
+    case FRAGMENT:
+      fid = msg->frag.fid;
+      break;
+    case REQUEST:
+      fid = msg->req.fid;
+      break;
+    default:
+      // Matches are discovery.
+      return 0;
+    }
+    fid.convert_to_host ();
+    return m_shards.group (fid);
   }
 
   void mftp_channel_automaton::schedule () const {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::schedule");
+    m_metrics.send_queue_depth->set (m_outgoing_messages.size ());
+    export_delays (m_outgoing_messages, m_metrics.queue_delays);
+
     if (send_out_precondition ()) {
       ioa::schedule (&mftp_channel_automaton::send_out);
     }
@@ -51,8 +244,36 @@ namespace mftp {
 	ioa::schedule (&mftp_channel_automaton::send_complete, *pos);
       }
     }
-    if (receive_precondition ()) {
-      ioa::schedule (&mftp_channel_automaton::receive);
+    if (filter_precondition ()) {
+      ioa::schedule (&mftp_channel_automaton::filter);
+    }
+    for (incoming_map::const_iterator pos = m_incoming_messages.begin ();
+	 pos != m_incoming_messages.end ();
+	 ++pos) {
+      if (receive_precondition (pos->first)) {
+	ioa::schedule (&mftp_channel_automaton::receive, pos->first);
+      }
+    }
+    for (std::set<ioa::aid_t>::const_iterator pos = m_fired.begin ();
+	 pos != m_fired.end ();
+	 ++pos) {
+      if (timer_precondition (*pos)) {
+	ioa::schedule (&mftp_channel_automaton::timer, *pos);
+      }
+    }
+    if (set_catalog_alarm_precondition ()) {
+      ioa::schedule (&mftp_channel_automaton::set_catalog_alarm);
+    }
+    if (wakeup_needed ()) {
+      // One idle alarm is enough.
+      for (std::map<ioa::aid_t, ioa::time>::const_iterator pos = m_alarms.begin ();
+	   pos != m_alarms.end ();
+	   ++pos) {
+	if (set_alarm_precondition (pos->first)) {
+	  ioa::schedule (&mftp_channel_automaton::set_alarm, pos->first);
+	  break;
+	}
+      }
     }
   }
 
@@ -63,15 +284,35 @@ namespace mftp {
     else if (o == &send_complete && send_complete.recent_op == ioa::UNBOUND) {
       purge (send_complete.recent_parameter);
     }
+    else if (o == &subscribe && subscribe.recent_op == ioa::UNBOUND) {
+      unsubscribe (subscribe.recent_parameter);
+    }
+    else if (o == &receive && receive.recent_op == ioa::UNBOUND) {
+      unsubscribe (receive.recent_parameter);
+      m_incoming_messages.erase (receive.recent_parameter);
+    }
+    else if (o == &set_timer && set_timer.recent_op == ioa::UNBOUND) {
+      m_timers.cancel (set_timer.recent_parameter);
+      m_fired.erase (set_timer.recent_parameter);
+    }
+    else if (o == &timer && timer.recent_op == ioa::UNBOUND) {
+      m_timers.cancel (timer.recent_parameter);
+      m_fired.erase (timer.recent_parameter);
+    }
+    else if (o == &set_alarm) {
+      if (set_alarm.recent_op == ioa::BOUND) {
+	m_alarms.insert (std::make_pair (set_alarm.recent_parameter, ioa::time ()));
+      }
+      else if (set_alarm.recent_op == ioa::UNBOUND) {
+	m_alarms.erase (set_alarm.recent_parameter);
+      }
+    }
   }
 
   void mftp_channel_automaton::purge (const ioa::aid_t aid) {
     if (m_outgoing_set.count (aid) != 0) {
-      std::list<message_aid>::iterator pos = std::find_if (m_outgoing_messages.begin (),
-							   m_outgoing_messages.end (),
-							   message_aid_equal (aid));
-      assert (pos != m_outgoing_messages.end ());
-      m_outgoing_messages.erase (pos);
+      const bool erased = m_outgoing_messages.erase_first (message_aid_equal (aid));
+      assert (erased);
       m_outgoing_set.erase (aid);
     }
 
@@ -82,13 +323,46 @@ namespace mftp {
     m_outgoing_completes.erase (aid);
   }
 
+  void mftp_channel_automaton::unsubscribe (const ioa::aid_t aid) {
+    std::map<ioa::aid_t, subscription>::iterator pos = m_subscriptions.find (aid);
+    if (pos != m_subscriptions.end ()) {
+      fileid_map::iterator owners = m_owners.find (pos->second.fid);
+      assert (owners != m_owners.end ());
+      owners->second.erase (aid);
+      if (owners->second.empty ()) {
+	m_owners.erase (owners);
+      }
+      if (pos->second.match_candidates) {
+	m_match_listeners.erase (aid);
+	if (pos->second.keyed) {
+	  key_map::iterator listeners = m_keyed_listeners.find (pos->second.key);
+	  listeners->second.erase (aid);
+	  if (listeners->second.empty ()) {
+	    m_keyed_listeners.erase (listeners);
+	  }
+	}
+	else {
+	  m_open_listeners.erase (aid);
+	}
+      }
+      if (pos->second.held) {
+	release (pos->second.fid);
+      }
+      leave (m_shards.group (pos->second.fid));
+      m_subscriptions.erase (pos);
+      m_filter_changed = true;
+    }
+  }
+
   void mftp_channel_automaton::send_effect (const ioa::const_shared_ptr<std::string>& message,
 					    ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::send_effect");
     
     if (m_outgoing_set.count (aid) == 0 &&
 	m_pending_aid != aid &&
 	m_outgoing_completes.count (aid) == 0) {
-      m_outgoing_messages.push_back (std::make_pair (message, aid));
+      const mftp::message* msg = reinterpret_cast<const mftp::message*> (message->data ());
+      m_outgoing_messages.push (message_class (ntohl (msg->header.message_type)), std::make_pair (message, aid), clock::now ());
       m_outgoing_set.insert (aid);
     }
   }
@@ -98,14 +372,31 @@ namespace mftp {
   }
 
   ioa::udp_sender_automaton::send_arg mftp_channel_automaton::send_out_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::send_out_effect");
     message_aid m = m_outgoing_messages.front ();
-    m_outgoing_messages.pop_front ();
+    m_outgoing_messages.pop (clock::now ());
     m_pending_aid = m.second;
     m_outgoing_set.erase (m_pending_aid);
-    return ioa::udp_sender_automaton::send_arg (m_send, m.first);
+    m_metrics.datagrams_sent->add ();
+    m_metrics.bytes_sent->add (m.first->size ());
+    if (m_pending_aid == m_aid) {
+      m_metrics.catalogs_sent->add ();
+      m_catalogs_sent.push_back (m.first);
+      if (m_catalogs_sent.size () > CATALOG_ECHOES) {
+	m_catalogs_sent.pop_front ();
+      }
+    }
+    if (trace::enabled ()) {
+      const message* msg = reinterpret_cast<const message*> (m.first->data ());
+      const uint32_t type = ntohl (msg->header.message_type);
+      // A catalog is about many files.
+      trace::record (TRACE_DATAGRAM_SENT, type != CATALOG ? msg->frag.fid : fileid (), type == FRAGMENT ? ntohl (msg->frag.idx) : 0, type);
+    }
+    return ioa::udp_sender_automaton::send_arg (m_shards.address (destination (*m.first)), m.first);
   }
 
   void mftp_channel_automaton::send_in_complete_effect (const int& result) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::send_in_complete_effect");
     if (result != 0) {
       char buf[256];
 #ifdef STRERROR_R_CHAR_P
@@ -116,6 +407,11 @@ namespace mftp {
 #endif
       exit(EXIT_FAILURE);
     }
+    else if (m_pending_aid == m_aid) {
+      // Our own catalog so nobody waits for the completion.
+      m_pending_aid = -1;
+      queue_catalog (clock::now ());
+    }
     else {
       m_outgoing_completes.insert (m_pending_aid);
       m_pending_aid = -1;
@@ -127,27 +423,367 @@ namespace mftp {
   }
 
   void mftp_channel_automaton::send_complete_effect (ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::send_complete_effect");
     m_outgoing_completes.erase (aid);
   }
 
-  void mftp_channel_automaton::receive_in_effect (const ioa::udp_receiver_automaton::receive_val& rv) {
-    if (rv.buffer.get () != 0 && rv.buffer->size () == sizeof (mftp::message)) {
+  void mftp_channel_automaton::subscribe_effect (const subscription& s,
+						 ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::subscribe_effect");
+    unsubscribe (aid);
+    join (m_shards.group (s.fid));
+
+    m_subscriptions.insert (std::make_pair (aid, s));
+    m_owners[s.fid].insert (aid);
+    if (s.match_candidates) {
+      m_match_listeners.insert (aid);
+      if (s.keyed) {
+	m_keyed_listeners[s.key].insert (aid);
+      }
+      else {
+	m_open_listeners.insert (aid);
+      }
+    }
+    if (s.held) {
+      hold (s.fid);
+    }
+    m_filter_changed = true;
+  }
+
+  bool mftp_channel_automaton::filter_precondition () const {
+    return m_kernel_filter && m_filter_changed && ioa::binding_count (&mftp_channel_automaton::filter) != 0;
+  }
+
+  ioa::const_shared_ptr<fileid_filter> mftp_channel_automaton::filter_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::filter_effect");
+    std::auto_ptr<fileid_filter> f (new fileid_filter ());
+    for (fileid_map::const_iterator pos = m_owners.begin ();
+	 pos != m_owners.end ();
+	 ++pos) {
+      f->insert (pos->first);
+    }
+    // Keyed listeners only need fragments of their kind.
+    if (!m_open_listeners.empty ()) {
+      f->accept_fragments ();
+    }
+    else {
+      for (key_map::const_iterator pos = m_keyed_listeners.begin ();
+	   pos != m_keyed_listeners.end ();
+	   ++pos) {
+	f->accept_fragments (pos->first.type, pos->first.length);
+      }
+    }
+    m_filter_changed = false;
+    return ioa::const_shared_ptr<fileid_filter> (f.release ());
+  }
+
+  void mftp_channel_automaton::add_owners (const fileid& fid,
+					   const bool listeners_only,
+					   std::set<ioa::aid_t>& targets) const {
+    fileid_map::const_iterator owners = m_owners.find (fid);
+    if (owners != m_owners.end ()) {
+      for (std::set<ioa::aid_t>::const_iterator pos = owners->second.begin ();
+	   pos != owners->second.end ();
+	   ++pos) {
+	if (!listeners_only || m_match_listeners.count (*pos) != 0) {
+	  targets.insert (*pos);
+	}
+      }
+    }
+  }
+
+  void mftp_channel_automaton::add_candidate_listeners (const fileid& fid,
+							std::set<ioa::aid_t>& targets) const {
+    // One lookup stands for every predicate on the type and length.
+    targets.insert (m_open_listeners.begin (), m_open_listeners.end ());
+    key_map::const_iterator listeners = m_keyed_listeners.find (candidate_key (fid));
+    if (listeners != m_keyed_listeners.end ()) {
+      targets.insert (listeners->second.begin (), listeners->second.end ());
+    }
+  }
+
+  void mftp_channel_automaton::receive_in_effect (const mftp_receiver_automaton::receive_val& rv) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::receive_in_effect");
+    if (rv.buffer.get () == 0) {
+      return;
+    }
+    if (capture::enabled ()) {
+      capture::record (*rv.buffer);
+    }
+    m_metrics.datagrams_received->add ();
+    m_metrics.bytes_received->add (rv.buffer->size ());
+    if (rv.buffer->size () != sizeof (mftp::message)) {
+      m_metrics.datagrams_invalid->add ();
+      trace::record (TRACE_DATAGRAM_INVALID, fileid (), 0);
+    }
+    else if (own_catalog (*rv.buffer)) {
+      // Multicast loops our catalogs back to us.
+      // Routing them would tell a partial download that somebody holds its file every cycle.
+      m_metrics.datagrams_unrouted->add ();
+      trace::record (TRACE_DATAGRAM_UNROUTED, fileid (), 0, CATALOG);
+    }
+    else {
       std::auto_ptr<mftp::message> m (new mftp::message);
       memcpy (m.get (), rv.buffer->data (), rv.buffer->size ());
-      if (m.get ()->convert_to_host ()) {
-	m_incoming_messages.push (ioa::const_shared_ptr<mftp::message> (m.release ()));
+      if (!m.get ()->convert_to_host ()) {
+	m_metrics.datagrams_invalid->add ();
+	trace::record (TRACE_DATAGRAM_INVALID, fileid (), 0);
+      }
+      else {
+	// Every message but a catalog starts with the fileid it concerns.
+	const fileid about = m->header.message_type != CATALOG ? m->frag.fid : fileid ();
+	trace::record (TRACE_DATAGRAM_RECEIVED, about, m->header.message_type == FRAGMENT ? m->frag.idx : 0, m->header.message_type);
+
+	// Find the automatons that care about this message.
+	std::set<ioa::aid_t> targets;
+	switch (m->header.message_type) {
+	case FRAGMENT:
+	  // The owners of the file and anybody who could take it as a candidate.
+	  add_owners (m->frag.fid, false, targets);
+	  add_candidate_listeners (m->frag.fid, targets);
+	  break;
+	case REQUEST:
+	  add_owners (m->req.fid, false, targets);
+	  note_interest (clock::now ());
+	  break;
+	case CATALOG:
+	  // Anybody who could take a listed file as a candidate and the owners of the files listed (who now know where to ask).
+	  m_metrics.catalogs_received->add ();
+	  for (uint32_t idx = 0; idx < m->cat.fileid_count; ++idx) {
+	    add_owners (m->cat.fileids[idx], false, targets);
+	    add_candidate_listeners (m->cat.fileids[idx], targets);
+	  }
+	  break;
+	case MATCH:
+	  // Matching automatons for the file that sent the match and for the files that it matched.
+	  add_owners (m->mat.fid, true, targets);
+	  for (uint32_t idx = 0; idx < m->mat.match_count; ++idx) {
+	    add_owners (m->mat.matches[idx], true, targets);
+	  }
+	  note_interest (clock::now ());
+	  break;
+	case MATCH_FILTER:
+	  // The same but the matched files are those of our matching automatons that pass the filter.
+	  add_owners (m->filt.fid, true, targets);
+	  for (std::set<ioa::aid_t>::const_iterator pos = m_match_listeners.begin ();
+	       pos != m_match_listeners.end ();
+	       ++pos) {
+	    if (m->filt.contains (m_subscriptions.find (*pos)->second.fid)) {
+	      targets.insert (*pos);
+	    }
+	  }
+	  note_interest (clock::now ());
+	  break;
+	}
+
+	if (targets.empty ()) {
+	  m_metrics.datagrams_unrouted->add ();
+	  trace::record (TRACE_DATAGRAM_UNROUTED, about, 0, m->header.message_type);
+	}
+	else {
+	  const ioa::const_shared_ptr<mftp::message> msg (m.release ());
+	  for (std::set<ioa::aid_t>::const_iterator pos = targets.begin ();
+	       pos != targets.end ();
+	       ++pos) {
+	    m_incoming_messages[*pos].push (msg);
+	  }
+	}
       }
     }
   }
 
-  bool mftp_channel_automaton::receive_precondition () const {
-    return !m_incoming_messages.empty ()  && ioa::binding_count (&mftp_channel_automaton::receive) != 0;
+  bool mftp_channel_automaton::receive_precondition (ioa::aid_t aid) const {
+    return m_incoming_messages.count (aid) != 0 && ioa::binding_count (&mftp_channel_automaton::receive, aid) != 0;
   }
 
-  ioa::const_shared_ptr<mftp::message> mftp_channel_automaton::receive_effect () {
-    ioa::const_shared_ptr<mftp::message> m = m_incoming_messages.front ();
-    m_incoming_messages.pop ();
+  ioa::const_shared_ptr<mftp::message> mftp_channel_automaton::receive_effect (ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::receive_effect");
+    incoming_map::iterator pos = m_incoming_messages.find (aid);
+    ioa::const_shared_ptr<mftp::message> m = pos->second.front ();
+    pos->second.pop ();
+    if (pos->second.empty ()) {
+      m_incoming_messages.erase (pos);
+    }
     return m;
   }
 
+  uint64_t mftp_channel_automaton::tick_of (const ioa::time& t) const {
+    if (t <= m_epoch) {
+      return 0;
+    }
+    // Rounded up so that no timer fires early.
+    const uint64_t tick = to_microseconds (TIMER_TICK);
+    return (to_microseconds (t - m_epoch) + tick - 1) / tick;
+  }
+
+  ioa::time mftp_channel_automaton::time_of (const uint64_t tick) const {
+    return m_epoch + from_microseconds (tick * to_microseconds (TIMER_TICK));
+  }
+
+  void mftp_channel_automaton::advance_timers () {
+    // Only ticks that have ended.
+    const uint64_t now = to_microseconds (clock::now () - m_epoch) / to_microseconds (TIMER_TICK);
+    std::vector<ioa::aid_t> expired;
+    m_timers.advance (now, expired);
+    m_fired.insert (expired.begin (), expired.end ());
+  }
+
+  bool mftp_channel_automaton::wakeup_needed () const {
+    if (m_timers.empty ()) {
+      return false;
+    }
+    const ioa::time wakeup = time_of (m_timers.next_expiry ());
+    for (std::map<ioa::aid_t, ioa::time>::const_iterator pos = m_alarms.begin ();
+	 pos != m_alarms.end ();
+	 ++pos) {
+      if (pos->second != ioa::time () && pos->second <= wakeup) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void mftp_channel_automaton::set_timer_effect (const ioa::time& interval,
+						 ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::set_timer_effect");
+    advance_timers ();
+    m_fired.erase (aid);
+    m_timers.insert (aid, tick_of (clock::now () + interval));
+  }
+
+  bool mftp_channel_automaton::timer_precondition (ioa::aid_t aid) const {
+    return m_fired.count (aid) != 0 && ioa::binding_count (&mftp_channel_automaton::timer, aid) != 0;
+  }
+
+  void mftp_channel_automaton::timer_effect (ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::timer_effect");
+    m_fired.erase (aid);
+  }
+
+  bool mftp_channel_automaton::set_alarm_precondition (ioa::aid_t aid) const {
+    std::map<ioa::aid_t, ioa::time>::const_iterator pos = m_alarms.find (aid);
+    return pos != m_alarms.end () && pos->second == ioa::time () && wakeup_needed () && ioa::binding_count (&mftp_channel_automaton::set_alarm, aid) != 0;
+  }
+
+  ioa::time mftp_channel_automaton::set_alarm_effect (ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::set_alarm_effect");
+    // Sleeping at most MAX_SLEEP bounds the delay of a deadline that finds every alarm set for later.
+    const ioa::time now = clock::now ();
+    const ioa::time wakeup = std::min (time_of (m_timers.next_expiry ()), now + MAX_SLEEP);
+    m_alarms[aid] = wakeup;
+    if (wakeup <= now + TIMER_TICK) {
+      return TIMER_TICK;
+    }
+    return wakeup - now;
+  }
+
+  void mftp_channel_automaton::alarm_interrupt_effect (ioa::aid_t aid) {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::alarm_interrupt_effect");
+    m_alarms[aid] = ioa::time ();
+    advance_timers ();
+  }
+
+  void mftp_channel_automaton::hold (const fileid& fid) {
+    if (m_held[fid]++ == 0) {
+      // A new file is news so it goes out soon.
+      const ioa::time now = clock::now ();
+      note_interest (now);
+      m_catalog_time = std::min (m_catalog_time, now + CATALOG_INTERVAL);
+    }
+  }
+
+  void mftp_channel_automaton::release (const fileid& fid) {
+    std::map<fileid, size_t>::iterator pos = m_held.find (fid);
+    assert (pos != m_held.end ());
+    if (--pos->second == 0) {
+      m_held.erase (pos);
+    }
+  }
+
+  void mftp_channel_automaton::note_interest (const ioa::time& now) {
+    m_interest_time = now;
+    if (m_catalog_quiet) {
+      // Somebody new may be listening so start over.
+      m_catalog_quiet = false;
+      m_catalog_interval = CATALOG_INTERVAL;
+      m_catalog_time = now;
+    }
+  }
+
+  bool mftp_channel_automaton::own_catalog (const std::string& buffer) {
+    for (std::deque<ioa::const_shared_ptr<std::string> >::iterator pos = m_catalogs_sent.begin ();
+	 pos != m_catalogs_sent.end ();
+	 ++pos) {
+      if (**pos == buffer) {
+	// Each catalog comes back once.
+	m_catalogs_sent.erase (pos);
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void mftp_channel_automaton::queue_catalog (const ioa::time& now) {
+    // One catalog at a time so that catalogs don't crowd out other messages.
+    if (!m_catalog_pending || m_outgoing_set.count (m_aid) != 0 || m_pending_aid == m_aid) {
+      return;
+    }
+
+    message m ((catalog_type ()));
+    std::map<fileid, size_t>::const_iterator pos = m_catalog_listed == 0 ? m_held.begin () : m_held.upper_bound (m_catalog_last);
+    for (; pos != m_held.end () && m.cat.fileid_count != CATALOG_SIZE; ++pos) {
+      m.cat.fileids[m.cat.fileid_count++] = pos->first;
+      m_catalog_last = pos->first;
+      ++m_catalog_listed;
+    }
+
+    if (pos == m_held.end ()) {
+      // Every file has been listed.
+      m_catalog_pending = false;
+      m_catalog_time = now + m_catalog_interval;
+      m_catalog_interval += m_catalog_interval;
+      m_catalog_interval = std::min (m_catalog_interval, MAX_CATALOG_INTERVAL);
+    }
+
+    if (m.cat.fileid_count != 0) {
+      m.convert_to_network ();
+      m_outgoing_messages.push (ANNOUNCEMENT_CLASS, std::make_pair (ioa::const_shared_ptr<std::string> (new std::string (reinterpret_cast<char *> (&m), sizeof (m))), m_aid), now);
+      m_outgoing_set.insert (m_aid);
+    }
+  }
+
+  bool mftp_channel_automaton::set_catalog_alarm_precondition () const {
+    return m_catalog_alarm_state == SET_READY && !m_held.empty () && !m_catalog_pending && !m_catalog_quiet && ioa::binding_count (&mftp_channel_automaton::set_catalog_alarm) != 0;
+  }
+
+  ioa::time mftp_channel_automaton::set_catalog_alarm_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::set_catalog_alarm_effect");
+    m_catalog_alarm_state = INTERRUPT_WAIT;
+    // Not so late that a cycle brought forward in the meantime waits long.
+    const ioa::time now = clock::now ();
+    const ioa::time next = std::min (m_catalog_time, now + MAX_CATALOG_WAIT);
+    if (next <= now) {
+      return ioa::time ();
+    }
+    return next - now;
+  }
+
+  void mftp_channel_automaton::catalog_alarm_interrupt_effect () {
+    MFTP_PROFILE_SCOPE ("mftp_channel_automaton::catalog_alarm_interrupt_effect");
+    assert (m_catalog_alarm_state == INTERRUPT_WAIT);
+    m_catalog_alarm_state = SET_READY;
+    const ioa::time now = clock::now ();
+    if (m_catalog_pending || m_held.empty () || now < m_catalog_time) {
+      return;
+    }
+    if (m_interest_time + CATALOG_QUIET <= now) {
+      // Nobody has asked for anything in a while.
+      m_catalog_quiet = true;
+      return;
+    }
+    m_catalog_pending = true;
+    m_catalog_listed = 0;
+    queue_catalog (now);
+  }
+
 }
@@ -0,0 +1,270 @@
+#include <mftp/mftp_receiver_automaton.hpp>
+#include <mftp/message.hpp>
+
+#include <config.hpp>
+#include <cerrno>
+#include <iostream>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+namespace mftp {
+
+  const size_t mftp_receiver_automaton::MAX_BATCH (64); // Datagrams read per wakeup.
+
+  mftp_receiver_automaton::mftp_receiver_automaton (const ioa::inet_address& local_address,
+						    const std::string& metric_labels,
+						    const receiver_config& config) :
+    m_config (config),
+    m_fd (-1),
+    m_ring (0),
+    m_wakeup (0),
+    m_stop (0),
+    m_metrics (metric_labels)
+  {
+    open_socket (local_address);
+    start ();
+    read_schedule ();
+  }
+
+  mftp_receiver_automaton::mftp_receiver_automaton (const ioa::inet_address& group_address,
+						    const ioa::inet_address& local_address,
+						    const std::string& metric_labels,
+						    const receiver_config& config) :
+    m_config (config),
+    m_fd (-1),
+    m_ring (0),
+    m_wakeup (0),
+    m_stop (0),
+    m_metrics (metric_labels)
+  {
+    open_socket (local_address);
+
+    ip_mreq req;
+    req.imr_multiaddr = reinterpret_cast<const sockaddr_in*> (group_address.get_sockaddr ())->sin_addr;
+    req.imr_interface.s_addr = htonl (INADDR_ANY);
+    if (setsockopt (m_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &req, sizeof (req)) == -1) {
+      fail ("Couldn't join multicast group", errno);
+    }
+
+#ifdef IP_MULTICAST_ALL
+    // Other sockets bound to the same port join other groups.
+    const int all = 0;
+    if (setsockopt (m_fd, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof (all)) == -1) {
+      fail ("Couldn't clear IP_MULTICAST_ALL", errno);
+    }
+#endif
+
+    start ();
+    read_schedule ();
+  }
+
+  mftp_receiver_automaton::~mftp_receiver_automaton () {
+    if (m_ring != 0) {
+      __atomic_store_n (&m_stop, 1, __ATOMIC_RELEASE);
+      pthread_join (m_thread, 0);
+      close (m_notify[0]);
+      close (m_notify[1]);
+
+      std::string* s;
+      while (m_ring->pop (s)) {
+	delete s;
+      }
+      delete m_ring;
+    }
+
+    if (m_fd != -1) {
+      close (m_fd);
+    }
+  }
+
+  void mftp_receiver_automaton::open_socket (const ioa::inet_address& local_address) {
+    m_fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (m_fd == -1) {
+      fail ("Couldn't create socket", errno);
+    }
+
+    const int val = 1;
+    if (setsockopt (m_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof (val)) == -1) {
+      fail ("Couldn't set SO_REUSEADDR", errno);
+    }
+
+#ifdef SO_REUSEPORT
+    // One socket per group and process so groups can be received in parallel.
+    if (setsockopt (m_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof (val)) == -1) {
+      fail ("Couldn't set SO_REUSEPORT", errno);
+    }
+#endif
+
+    if (m_config.io_thread) {
+      // The I/O thread blocks but wakes up periodically to check if it should stop.
+      timeval timeout;
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 100000;
+      if (setsockopt (m_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout)) == -1) {
+	fail ("Couldn't set SO_RCVTIMEO", errno);
+      }
+    }
+    else if (fcntl (m_fd, F_SETFL, O_NONBLOCK) == -1) {
+      fail ("Couldn't make socket non-blocking", errno);
+    }
+
+#ifdef SO_BUSY_POLL
+    if (m_config.busy_poll != 0 &&
+	setsockopt (m_fd, SOL_SOCKET, SO_BUSY_POLL, &m_config.busy_poll, sizeof (m_config.busy_poll)) == -1) {
+      fail ("Couldn't set SO_BUSY_POLL", errno);
+    }
+#endif
+
+    if (bind (m_fd, local_address.get_sockaddr (), local_address.get_socklen ()) == -1) {
+      fail ("Couldn't bind socket", errno);
+    }
+  }
+
+  void mftp_receiver_automaton::start () {
+    if (!m_config.io_thread) {
+      return;
+    }
+
+    if (pipe (m_notify) == -1) {
+      fail ("Couldn't create pipe", errno);
+    }
+    if (fcntl (m_notify[0], F_SETFL, O_NONBLOCK) == -1 ||
+	fcntl (m_notify[1], F_SETFL, O_NONBLOCK) == -1) {
+      fail ("Couldn't make pipe non-blocking", errno);
+    }
+
+    m_ring = new spsc_ring<std::string*> (m_config.ring_size);
+
+    const int err = pthread_create (&m_thread, 0, io_thread, this);
+    if (err != 0) {
+      fail ("Couldn't create I/O thread", err);
+    }
+  }
+
+  void* mftp_receiver_automaton::io_thread (void* arg) {
+    static_cast<mftp_receiver_automaton*> (arg)->io_loop ();
+    return 0;
+  }
+
+  void mftp_receiver_automaton::io_loop () {
+    // Only this thread touches the socket and the producer side of the ring.
+    char buf[sizeof (message) + 1];
+    while (!__atomic_load_n (&m_stop, __ATOMIC_ACQUIRE)) {
+      const ssize_t r = recv (m_fd, buf, sizeof (buf), 0);
+      if (r == -1) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	  fail ("Couldn't receive", errno);
+	}
+	continue;
+      }
+
+      std::string* s = new std::string (buf, r);
+      if (!m_ring->push (s)) {
+	delete s;
+	m_metrics.datagrams_dropped->add ();
+	continue;
+      }
+
+      // Wake the automaton once per batch.
+      if (__atomic_exchange_n (&m_wakeup, 1, __ATOMIC_ACQ_REL) == 0) {
+	const char c = 0;
+	if (::write (m_notify[1], &c, 1) == -1 && errno != EAGAIN) {
+	  fail ("Couldn't wake receiver", errno);
+	}
+      }
+    }
+  }
+
+  void mftp_receiver_automaton::fail (const char* what,
+				      const int err) const {
+    char buf[256];
+#ifdef STRERROR_R_CHAR_P
+    std::cerr << what << ": " << strerror_r (err, buf, 256) << std::endl;
+#else
+    strerror_r (err, buf, 256);
+    std::cerr << what << ": " << buf << std::endl;
+#endif
+    exit (EXIT_FAILURE);
+  }
+
+  void mftp_receiver_automaton::schedule () const {
+    if (receive_precondition ()) {
+      ioa::schedule (&mftp_receiver_automaton::receive);
+    }
+  }
+
+  bool mftp_receiver_automaton::read_precondition () const {
+    return m_fd != -1;
+  }
+
+  void mftp_receiver_automaton::read_effect () {
+    if (m_ring != 0) {
+      // Clear the wakeup before draining so a datagram pushed after the drain causes another wakeup.
+      char buf[64];
+      while (::read (m_notify[0], buf, sizeof (buf)) > 0) { }
+      __atomic_store_n (&m_wakeup, 0, __ATOMIC_SEQ_CST);
+
+      std::string* s;
+      for (size_t count = 0; count < MAX_BATCH && m_ring->pop (s); ++count) {
+	m_incoming.push (receive_val (ioa::const_shared_ptr<std::string> (s)));
+      }
+      return;
+    }
+
+    // Drain what the kernel has queued.
+    // One byte more than a message so oversized datagrams can be detected and dropped.
+    char buf[sizeof (message) + 1];
+    for (size_t count = 0; count < MAX_BATCH; ++count) {
+      const ssize_t r = recv (m_fd, buf, sizeof (buf), 0);
+      if (r == -1) {
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+	  fail ("Couldn't receive", errno);
+	}
+	break;
+      }
+      m_incoming.push (receive_val (ioa::const_shared_ptr<std::string> (new std::string (buf, r))));
+    }
+  }
+
+  void mftp_receiver_automaton::read_schedule () const {
+    if (m_ring != 0) {
+      if (!m_ring->empty ()) {
+	// More than a batch is waiting.
+	ioa::schedule (&mftp_receiver_automaton::read);
+      }
+      else {
+	ioa::schedule_read_ready (&mftp_receiver_automaton::read, m_notify[0]);
+      }
+    }
+    else if (m_fd != -1) {
+      ioa::schedule_read_ready (&mftp_receiver_automaton::read, m_fd);
+    }
+    schedule ();
+  }
+
+  void mftp_receiver_automaton::set_filter_effect (const ioa::const_shared_ptr<fileid_filter>& filter) {
+    const int err = filter->attach (m_fd);
+    if (err != 0) {
+      // The filter is an optimization.  User space still demultiplexes everything.
+      char buf[256];
+#ifdef STRERROR_R_CHAR_P
+      std::cerr << "Couldn't attach socket filter: " << strerror_r (err, buf, 256) << std::endl;
+#else
+      strerror_r (err, buf, 256);
+      std::cerr << "Couldn't attach socket filter: " << buf << std::endl;
+#endif
+    }
+  }
+
+  bool mftp_receiver_automaton::receive_precondition () const {
+    return !m_incoming.empty () && ioa::binding_count (&mftp_receiver_automaton::receive) != 0;
+  }
+
+  mftp_receiver_automaton::receive_val mftp_receiver_automaton::receive_effect () {
+    receive_val rv = m_incoming.front ();
+    m_incoming.pop ();
+    return rv;
+  }
+
+}
@@ -0,0 +1,153 @@
+#include <mftp/profile.hpp>
+
+#include <config.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+namespace mftp {
+
+  namespace {
+
+    // Fixed storage so the dump can run in a signal handler.
+    const size_t MAX_HISTOGRAMS = 128;
+    cycle_histogram s_histograms[MAX_HISTOGRAMS];
+    size_t s_count = 0;
+    char s_path[4096];
+
+    // Formatting without stdio so it is async-signal-safe.
+    class writer {
+    private:
+      const int m_fd;
+      char m_buf[4096];
+      size_t m_size;
+
+    public:
+      writer (const int fd) :
+	m_fd (fd),
+	m_size (0)
+      { }
+
+      ~writer () {
+	flush ();
+      }
+
+      void flush () {
+	const char* ptr = m_buf;
+	while (m_size != 0) {
+	  const ssize_t w = write (m_fd, ptr, m_size);
+	  if (w <= 0) {
+	    break;
+	  }
+	  ptr += w;
+	  m_size -= w;
+	}
+	m_size = 0;
+      }
+
+      writer& operator<< (const char* s) {
+	for (; *s != 0; ++s) {
+	  if (m_size == sizeof (m_buf)) {
+	    flush ();
+	  }
+	  m_buf[m_size++] = *s;
+	}
+	return *this;
+      }
+
+      writer& operator<< (uint64_t n) {
+	char digits[21];
+	char* ptr = digits + sizeof (digits);
+	*--ptr = 0;
+	do {
+	  *--ptr = '0' + n % 10;
+	  n /= 10;
+	} while (n != 0);
+	return *this << ptr;
+      }
+    };
+
+    void dump_on_exit () {
+      profile::dump ();
+    }
+
+    void dump_on_signal (int) {
+      const int err = errno;
+      profile::dump ();
+      errno = err;
+    }
+
+  }
+
+  bool profile::available () {
+#ifdef MFTP_PROFILE
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  void profile::enable (const std::string& path) {
+    if (!available ()) {
+      std::cerr << "Not built with profiling (configure --enable-profiling)" << std::endl;
+      return;
+    }
+    if (path.size () >= sizeof (s_path)) {
+      std::cerr << "Profile path is too long" << std::endl;
+      exit (EXIT_FAILURE);
+    }
+    path.copy (s_path, path.size ());
+    s_path[path.size ()] = 0;
+
+    atexit (dump_on_exit);
+    signal (SIGUSR1, dump_on_signal);
+  }
+
+  cycle_histogram* profile::get (const char* name) {
+    // Actions run on one thread so sites register one at a time.
+    if (s_count == MAX_HISTOGRAMS) {
+      return 0;
+    }
+    cycle_histogram* h = &s_histograms[s_count];
+    memset (h, 0, sizeof (cycle_histogram));
+    h->name = name;
+    __atomic_store_n (&s_count, s_count + 1, __ATOMIC_RELEASE);
+    return h;
+  }
+
+  void profile::dump () {
+    if (s_path[0] == 0) {
+      return;
+    }
+    const int fd = open (s_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      return;
+    }
+
+    {
+      // For each site: a summary line and one line per non-empty bucket [2^k, 2^(k+1)).
+      writer out (fd);
+      const size_t count = __atomic_load_n (&s_count, __ATOMIC_ACQUIRE);
+      for (size_t i = 0; i != count; ++i) {
+	const cycle_histogram& h = s_histograms[i];
+	out << h.name << " count " << h.count << " cycles " << h.total;
+	if (h.count != 0) {
+	  out << " mean " << h.total / h.count;
+	}
+	out << "\n";
+	for (unsigned int b = 0; b != cycle_histogram::BUCKETS; ++b) {
+	  if (h.buckets[b] != 0) {
+	    out << "  " << (uint64_t (1) << b) << " " << h.buckets[b] << "\n";
+	  }
+	}
+      }
+    }
+
+    close (fd);
+  }
+
+}
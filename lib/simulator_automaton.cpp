@@ -0,0 +1,103 @@
+#include <mftp/simulator_automaton.hpp>
+
+namespace mftp {
+
+  simulator_automaton::simulator_automaton (const ioa::time& start) :
+    m_self (ioa::get_aid ()),
+    m_idle_state (IDLE_READY)
+  {
+    clock::simulate (ioa::get_aid (), start);
+
+    add_observable (&alarm);
+
+    ioa::automaton_manager<ioa::alarm_automaton>* idle_alarm = new ioa::automaton_manager<ioa::alarm_automaton> (this, ioa::make_generator<ioa::alarm_automaton> ());
+    ioa::make_binding_manager (this,
+			       &m_self,
+			       &simulator_automaton::set_idle,
+			       idle_alarm,
+			       &ioa::alarm_automaton::set);
+    ioa::make_binding_manager (this,
+			       idle_alarm,
+			       &ioa::alarm_automaton::alarm,
+			       &m_self,
+			       &simulator_automaton::idle);
+
+    schedule ();
+  }
+
+  simulator_automaton::~simulator_automaton () {
+    clock::stop_simulation ();
+  }
+
+  void simulator_automaton::observe (ioa::observable* o) {
+    if (o == &alarm && alarm.recent_op == ioa::UNBOUND) {
+      cancel (alarm.recent_parameter);
+      m_fired.erase (alarm.recent_parameter);
+    }
+  }
+
+  void simulator_automaton::cancel (const ioa::aid_t aid) {
+    std::map<ioa::aid_t, deadline_map::iterator>::iterator pos = m_pending.find (aid);
+    if (pos != m_pending.end ()) {
+      m_deadlines.erase (pos->second);
+      m_pending.erase (pos);
+    }
+  }
+
+  void simulator_automaton::schedule () const {
+    for (std::set<ioa::aid_t>::const_iterator pos = m_fired.begin ();
+	 pos != m_fired.end ();
+	 ++pos) {
+      if (alarm_precondition (*pos)) {
+	ioa::schedule (&simulator_automaton::alarm, *pos);
+      }
+    }
+    if (set_idle_precondition ()) {
+      ioa::schedule (&simulator_automaton::set_idle);
+    }
+  }
+
+  void simulator_automaton::set_effect (const ioa::time& interval,
+					ioa::aid_t aid) {
+    // A new alarm replaces the old one.
+    cancel (aid);
+    m_pending.insert (std::make_pair (aid, m_deadlines.insert (std::make_pair (clock::now () + interval, aid))));
+  }
+
+  bool simulator_automaton::alarm_precondition (ioa::aid_t aid) const {
+    return m_fired.count (aid) != 0 && ioa::binding_count (&simulator_automaton::alarm, aid) != 0;
+  }
+
+  void simulator_automaton::alarm_effect (ioa::aid_t aid) {
+    m_fired.erase (aid);
+  }
+
+  bool simulator_automaton::set_idle_precondition () const {
+    return m_idle_state == IDLE_READY && m_fired.empty () && !m_deadlines.empty () && ioa::binding_count (&simulator_automaton::set_idle) != 0;
+  }
+
+  ioa::time simulator_automaton::set_idle_effect () {
+    m_idle_state = IDLE_WAIT;
+    return ioa::time ();
+  }
+
+  void simulator_automaton::idle_effect () {
+    assert (m_idle_state == IDLE_WAIT);
+    m_idle_state = IDLE_READY;
+
+    if (!m_fired.empty () || m_deadlines.empty ()) {
+      return;
+    }
+
+    // Jump to the next deadline and fire everything due then.
+    const ioa::time next = m_deadlines.begin ()->first;
+    clock::advance (next);
+    while (!m_deadlines.empty () && m_deadlines.begin ()->first <= next) {
+      const ioa::aid_t aid = m_deadlines.begin ()->second;
+      m_fired.insert (aid);
+      m_pending.erase (aid);
+      m_deadlines.erase (m_deadlines.begin ());
+    }
+  }
+
+}
@@ -0,0 +1,166 @@
+#include <mftp/trace.hpp>
+#include <mftp/clock.hpp>
+
+#include <config.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+namespace mftp {
+
+  namespace {
+
+    struct trace_ring
+    {
+      trace_record* records;
+      uint32_t mask;
+      uint64_t count; // Records ever written.
+    };
+
+    // Fixed storage so the dump can run in a signal handler.
+    const size_t MAX_RINGS = 64;
+    trace_ring* s_rings[MAX_RINGS];
+    size_t s_ring_count = 0;
+
+    bool s_enabled = false;
+    uint32_t s_capacity = 0;
+    char s_path[4096];
+
+    __thread trace_ring* t_ring = 0;
+
+    void write_all (const int fd,
+		    const void* buf,
+		    size_t size) {
+      const char* ptr = static_cast<const char*> (buf);
+      while (size != 0) {
+	const ssize_t w = write (fd, ptr, size);
+	if (w <= 0) {
+	  return;
+	}
+	ptr += w;
+	size -= w;
+      }
+    }
+
+    void dump_on_exit () {
+      trace::dump ();
+    }
+
+    void dump_on_signal (int) {
+      const int err = errno;
+      trace::dump ();
+      errno = err;
+    }
+
+    trace_ring* create_ring () {
+      const size_t slot = __atomic_fetch_add (&s_ring_count, 1, __ATOMIC_ACQ_REL);
+      if (slot >= MAX_RINGS) {
+	// Too many threads.  Later threads are not traced.
+	return 0;
+      }
+      trace_ring* ring = new trace_ring;
+      ring->records = new trace_record[s_capacity];
+      ring->mask = s_capacity - 1;
+      ring->count = 0;
+      __atomic_store_n (&s_rings[slot], ring, __ATOMIC_RELEASE);
+      return ring;
+    }
+
+  }
+
+  void trace::enable (const std::string& path,
+		      const uint32_t capacity) {
+    if (path.size () >= sizeof (s_path)) {
+      std::cerr << "Trace path is too long" << std::endl;
+      exit (EXIT_FAILURE);
+    }
+    path.copy (s_path, path.size ());
+    s_path[path.size ()] = 0;
+
+    // Round up to a power of two.
+    s_capacity = 1;
+    while (s_capacity < capacity) {
+      s_capacity <<= 1;
+    }
+
+    atexit (dump_on_exit);
+    signal (SIGUSR2, dump_on_signal);
+    s_enabled = true;
+  }
+
+  bool trace::enabled () {
+    return s_enabled;
+  }
+
+  void trace::append (const trace_event event,
+		      const uint32_t file,
+		      const uint32_t index,
+		      const uint16_t message) {
+    if (t_ring == 0) {
+      t_ring = create_ring ();
+      if (t_ring == 0) {
+	return;
+      }
+    }
+
+    const ioa::time now = clock::now ();
+    trace_record& r = t_ring->records[t_ring->count & t_ring->mask];
+    r.time = uint64_t (now.sec ()) * 1000000 + now.usec ();
+    r.file = file;
+    r.index = index;
+    r.event = event;
+    r.message = message;
+    r.reserved = 0;
+    __atomic_store_n (&t_ring->count, t_ring->count + 1, __ATOMIC_RELEASE);
+  }
+
+  void trace::dump () {
+    // Only async-signal-safe calls from here on.
+    // A thread may be writing its ring while we read it so its newest record can be torn.
+    const int fd = open (s_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      return;
+    }
+
+    size_t rings = __atomic_load_n (&s_ring_count, __ATOMIC_ACQUIRE);
+    if (rings > MAX_RINGS) {
+      rings = MAX_RINGS;
+    }
+
+    trace_file_header header;
+    for (size_t i = 0; i != sizeof (header.magic); ++i) {
+      header.magic[i] = TRACE_MAGIC[i];
+    }
+    header.record_size = sizeof (trace_record);
+    header.record_count = 0;
+
+    // Take the counts once so the header agrees with the records.
+    uint64_t counts[MAX_RINGS];
+    for (size_t i = 0; i != rings; ++i) {
+      const trace_ring* ring = __atomic_load_n (&s_rings[i], __ATOMIC_ACQUIRE);
+      counts[i] = ring != 0 ? __atomic_load_n (&ring->count, __ATOMIC_ACQUIRE) : 0;
+      header.record_count += counts[i] < s_capacity ? counts[i] : s_capacity;
+    }
+    write_all (fd, &header, sizeof (header));
+
+    for (size_t i = 0; i != rings; ++i) {
+      const trace_ring* ring = __atomic_load_n (&s_rings[i], __ATOMIC_ACQUIRE);
+      if (ring == 0) {
+	continue;
+      }
+      const uint64_t first = counts[i] < s_capacity ? 0 : counts[i] - s_capacity;
+      // Oldest first: from the oldest record to the end of the array and then from the start.
+      const uint32_t start = first & ring->mask;
+      const uint32_t n = counts[i] - first;
+      const uint32_t tail = n < s_capacity - start ? n : s_capacity - start;
+      write_all (fd, ring->records + start, tail * sizeof (trace_record));
+      write_all (fd, ring->records, (n - tail) * sizeof (trace_record));
+    }
+
+    close (fd);
+  }
+
+}
@@ -2,13 +2,35 @@
 #include <ioa/global_fifo_scheduler.hpp>
 #include <ioa/ioa.hpp>
 
+#include <algorithm>
 #include <iostream>
 #include <queue>
 #include <set>
+#include <unistd.h>
 
 namespace jam {
 
   const size_t FRAG_COUNT = 100;
+  const uint32_t PROGRESS_RESOLUTION = 1000; // Progress is reported at least every 1/PROGRESS_RESOLUTION of a file.
+
+  // When a data file reached each phase of its transfer.
+  struct transfer
+  {
+    uint32_t fragment_count;
+    ioa::time meta; // The meta file naming it was complete.
+    ioa::time first_fragment;
+    ioa::time p50; // Half of the fragments had arrived.
+    ioa::time p90;
+    ioa::time p99;
+    uint32_t printed; // Fragments at the last progress line.
+
+    transfer (const mftp::fileid& fid,
+	      const ioa::time& m) :
+      fragment_count (mftp::mfileid (fid).get_fragment_count ()),
+      meta (m),
+      printed (0)
+    { }
+  };
 
   class mftp_client_automaton :
     public ioa::automaton,
@@ -19,19 +41,35 @@ namespace jam {
     std::set<mftp::fileid> meta_files;
     ioa::automaton_manager<mftp::mftp_channel_automaton>* channel;
     std::map<mftp::fileid, ioa::automaton_manager<mftp::mftp_automaton>* > data_files;
+    std::map<mftp::fileid, transfer*> m_transfers;
     std::string m_filename;
 
-    ioa::time m_transfer;
+    ioa::time m_query; // The query file was created.
+    ioa::time m_match; // A match naming the query was first heard.
 
   public:
-    mftp_client_automaton (std::string fname) :
+    mftp_client_automaton (std::string fname,
+			   const bool shard,
+			   const mftp::receiver_config& config) :
       m_self (ioa::get_aid ()),
       m_filename (fname)
     {
-      channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (jam::SEND_ADDR, jam::LOCAL_ADDR, true));
+      if (shard) {
+	channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (jam::make_shards (), jam::LOCAL_ADDR, true, config));
+      }
+      else {
+	channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (jam::SEND_ADDR, jam::LOCAL_ADDR, true, true, config));
+      }
 
       add_observable (channel);
     }
+
+    ~mftp_client_automaton () {
+      for (std::map<mftp::fileid, transfer*>::const_iterator pos = m_transfers.begin (); pos != m_transfers.end (); ++pos) {
+	delete pos->second;
+      }
+    }
+
   private:
     void schedule () const { }
 
@@ -58,13 +96,41 @@ namespace jam {
 	  // Create the query server.
 	  ioa::automaton_manager<mftp::mftp_automaton>* query = new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (f, channel->get_handle (), meta_predicate (m_filename), meta_filename_predicate (m_filename), true, false, 0));
 	  
+	  ioa::make_binding_manager (this,
+				     query, &mftp::mftp_automaton::match_heard,
+				     &m_self, &mftp_client_automaton::match_heard);
+
 	  ioa::make_binding_manager (this,
 				     query, &mftp::mftp_automaton::match_complete,
 				     &m_self, &mftp_client_automaton::match_complete);
+
+	  m_query = ioa::time::now ();
 	}
       }
     }
-  
+
+    static double to_seconds (const ioa::time& t) {
+      return double (t.sec ()) + double (t.usec ()) / 1000000.0;
+    }
+
+    // Prints a phase as seconds since the query was created.
+    void print_phase (const char* name,
+		      const ioa::time& t) const {
+      std::cout << "  " << name << " " << to_seconds (t - m_query) << std::endl;
+    }
+
+    void match_heard_effect () {
+      m_match = ioa::time::now ();
+    }
+
+    void match_heard_schedule () const {
+      schedule ();
+    }
+
+  public:
+    UV_UP_INPUT (mftp_client_automaton, match_heard);
+
+  private:
     void match_complete_effect (const ioa::const_shared_ptr<mftp::file>& meta_file) {
       // Create the meta server.
       new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (meta_file, channel->get_handle (), query_predicate (m_filename), query_filename_predicate (m_filename), false, false, 0));
@@ -74,7 +140,15 @@ namespace jam {
       fid.convert_to_host();
       std::auto_ptr<mftp::file> f (new mftp::file (fid));
 
-      ioa::automaton_manager<mftp::mftp_automaton>* file_home = new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (f, channel->get_handle(), false, FRAG_COUNT));
+      if (m_transfers.count (fid) != 0) {
+	return;
+      }
+      transfer* t = new transfer (fid, ioa::time::now ());
+      m_transfers.insert (std::make_pair (fid, t));
+
+      // Report often enough to place the percentiles.
+      const uint32_t threshold = std::max (uint32_t (1), std::min (uint32_t (FRAG_COUNT), t->fragment_count / PROGRESS_RESOLUTION));
+      ioa::automaton_manager<mftp::mftp_automaton>* file_home = new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (f, channel->get_handle(), false, threshold));
       
       data_files.insert(std::make_pair(fid, file_home));
       
@@ -85,8 +159,6 @@ namespace jam {
       ioa::make_binding_manager (this,
 				 file_home, &mftp::mftp_automaton::fragment_count,
 				 &m_self, &mftp_client_automaton::update_progress);
-      
-      m_transfer = ioa::time::now ();
     }
   
     void match_complete_schedule () const {
@@ -97,7 +169,27 @@ namespace jam {
     V_UP_INPUT (mftp_client_automaton, match_complete, ioa::const_shared_ptr<mftp::file>);
   
   private:
-    void file_complete_effect (const ioa::const_shared_ptr<mftp::file>& f, ioa::aid_t) {
+    // Records the phases reached with have fragments.
+    static void progress (transfer& t,
+			  const uint32_t have,
+			  const ioa::time& now) {
+      if (have != 0 && t.first_fragment == ioa::time ()) {
+	t.first_fragment = now;
+      }
+      if (uint64_t (have) * 100 >= uint64_t (t.fragment_count) * 50 && t.p50 == ioa::time ()) {
+	t.p50 = now;
+      }
+      if (uint64_t (have) * 100 >= uint64_t (t.fragment_count) * 90 && t.p90 == ioa::time ()) {
+	t.p90 = now;
+      }
+      if (uint64_t (have) * 100 >= uint64_t (t.fragment_count) * 99 && t.p99 == ioa::time ()) {
+	t.p99 = now;
+      }
+    }
+
+    void file_complete_effect (const ioa::const_shared_ptr<mftp::file>& f, ioa::aid_t aid) {
+      const ioa::time now = ioa::time::now ();
+
       std::string path (m_filename + "-" + f->get_mfileid ().get_fileid ().to_string ());
       // TODO:  Add error checking.
       FILE* fp = fopen (path.c_str (), "w");
@@ -119,9 +211,14 @@ namespace jam {
 	exit (EXIT_FAILURE);
       }
       
-      ioa::time t = ioa::time::now () - m_transfer;
+      std::map<mftp::fileid, transfer*>::iterator pos = m_transfers.find (f->get_mfileid ().get_fileid ());
+      transfer& tr = *pos->second;
+      // The last progress report can come after completion.
+      progress (tr, tr.fragment_count, now);
+
+      ioa::time t = now - tr.meta;
       double num_bytes = double (f->get_mfileid ().get_original_length ());
-      double time = double (t.sec ()) + double(t.usec ())/1000000.0;
+      double time = to_seconds (t);
       double rate = num_bytes / time;
       if(num_bytes > 1024) {
 	num_bytes /= 1024.0;
@@ -138,6 +235,23 @@ namespace jam {
       else {
 	std::cout << num_bytes << " Bytes in " << time << " seconds (" << rate << " Bytes per second)." << std::endl;
       }
+
+      // Discovery is query to meta; transfer is meta to complete.
+      std::cout << "Phases (seconds since the query was created):" << std::endl;
+      print_phase ("query", m_query);
+      if (m_match != ioa::time ()) {
+	print_phase ("first_match", m_match);
+      }
+      print_phase ("meta_complete", tr.meta);
+      print_phase ("first_fragment", tr.first_fragment);
+      print_phase ("fragments_50", tr.p50);
+      print_phase ("fragments_90", tr.p90);
+      print_phase ("fragments_99", tr.p99);
+      print_phase ("complete", now);
+      // Shares the series of the automaton that downloaded it.
+      const mftp::file_metrics metrics (f->get_mfileid ().get_fileid (), aid);
+      std::cout << "  requests_sent " << metrics.requests_sent->get () << std::endl;
+      std::cout << "  duplicates " << metrics.fragments_duplicate->get () << std::endl;
       
       std::cout << "Created " << path << std::endl;
     }
@@ -154,16 +268,20 @@ namespace jam {
       //Move the iterator to the right fileid.
       std::map<mftp::fileid, ioa::automaton_manager<mftp::mftp_automaton>*>::iterator it;
       for(it = data_files.begin ();
-	  it->second->get_handle() != id && it != data_files.end ();
+	  it != data_files.end () && it->second->get_handle() != id;
 	  ++it) { ;  }
 
       if (it == data_files.end ()){
 	std::cerr << "OH NOES" << std::endl;
+	return;
       }
 
-      mftp::mfileid mid (it->first);
-      if (have < mid.get_fragment_count ()) {
-	std::cout << "Received " << have << " of " << mid.get_fragment_count () << " fragments" << std::endl;
+      transfer& t = *m_transfers[it->first];
+      progress (t, have, ioa::time::now ());
+
+      if (have < t.fragment_count && have - t.printed >= FRAG_COUNT) {
+	std::cout << "Received " << have << " of " << t.fragment_count << " fragments" << std::endl;
+	t.printed = have;
       }
     }
     
@@ -178,14 +296,66 @@ namespace jam {
 }
 
 int main (int argc, char* argv[]) {
-  if (argc != 2){
-    std::cerr << "Usage: " << argv[0] << " FILE" << std::endl;
+  bool shard = false;
+  mftp::receiver_config config;
+  std::string metrics_path;
+  mftp::metrics_exporter::export_mode metrics_mode = mftp::metrics_exporter::FILE_EXPORT;
+  mftp::endgame_config endgame;
+  int opt;
+  while ((opt = getopt (argc, argv, "stb:x:X:e:E:T:C:P:")) != -1) {
+    switch (opt) {
+    case 's':
+      shard = true;
+      break;
+    case 't':
+      config.io_thread = true;
+      break;
+    case 'b':
+      config.busy_poll = strtol (optarg, 0, 10);
+      break;
+    case 'x':
+      metrics_path = optarg;
+      metrics_mode = mftp::metrics_exporter::FILE_EXPORT;
+      break;
+    case 'X':
+      metrics_path = optarg;
+      metrics_mode = mftp::metrics_exporter::SOCKET_EXPORT;
+      break;
+    case 'e':
+      endgame.threshold = strtoul (optarg, 0, 10);
+      break;
+    case 'E':
+      endgame.copies = strtoul (optarg, 0, 10);
+      break;
+    case 'T':
+      mftp::trace::enable (optarg);
+      break;
+    case 'C':
+      mftp::capture::enable (optarg);
+      break;
+    case 'P':
+      mftp::profile::enable (optarg);
+      break;
+    default:
+      std::cerr << "Usage: " << argv[0] << " [-s] [-t] [-b MICROSECONDS] [-x METRICS_FILE | -X METRICS_SOCKET] [-e FRAGMENTS] [-E COPIES] [-T TRACE] [-C CAPTURE] [-P PROFILE] FILE" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (argc - optind != 1){
+    std::cerr << "Usage: " << argv[0] << " [-s] [-t] [-b MICROSECONDS] [-x METRICS_FILE | -X METRICS_SOCKET] [-e FRAGMENTS] [-E COPIES] [-T TRACE] [-C CAPTURE] [-P PROFILE] FILE" << std::endl;
     exit(EXIT_FAILURE);
   }
   
-  std::string fname (argv[1]);
+  std::string fname (argv[optind]);
+  mftp::mftp_automaton::set_endgame (endgame);
   
+  std::auto_ptr<mftp::metrics_exporter> exporter;
+  if (!metrics_path.empty ()) {
+    exporter.reset (new mftp::metrics_exporter (metrics_path, metrics_mode));
+  }
+
   ioa::global_fifo_scheduler sched;
-  ioa::run (sched, ioa::make_generator<jam::mftp_client_automaton> (fname));
+  ioa::run (sched, ioa::make_generator<jam::mftp_client_automaton> (fname, shard, config));
   return 0;
 }
@@ -12,6 +12,18 @@ namespace jam {
   
   const ioa::inet_address SEND_ADDR ("224.0.0.137", 54321);
   const ioa::inet_address LOCAL_ADDR ("0.0.0.0", 54321);
+
+  // Discovery stays on SEND_ADDR while file data is spread over a pool of groups.
+  inline mftp::shard_map make_shards () {
+    mftp::shard_map shards (SEND_ADDR);
+    shards.add_control_type (META_TYPE);
+    shards.add_control_type (QUERY_TYPE);
+    shards.add_data_group (ioa::inet_address ("224.0.0.138", 54321));
+    shards.add_data_group (ioa::inet_address ("224.0.0.139", 54321));
+    shards.add_data_group (ioa::inet_address ("224.0.0.140", 54321));
+    shards.add_data_group (ioa::inet_address ("224.0.0.141", 54321));
+    return shards;
+  }
   
   struct meta_predicate :
     public mftp::match_candidate_predicate
@@ -26,6 +38,11 @@ namespace jam {
       return (fid.type == META_TYPE) && (fid.length == sizeof (mftp::fileid) + filename.size ());
     }
 
+    bool key (mftp::candidate_key& k) const {
+      k = mftp::candidate_key (META_TYPE, sizeof (mftp::fileid) + filename.size ());
+      return true;
+    }
+
     meta_predicate* clone () const {
       return new meta_predicate (*this);
     }
@@ -63,6 +80,11 @@ namespace jam {
       return (fid.type == QUERY_TYPE) && (fid.length == sizeof (uuid_t) + filename.size ());
     }
 
+    bool key (mftp::candidate_key& k) const {
+      k = mftp::candidate_key (QUERY_TYPE, sizeof (uuid_t) + filename.size ());
+      return true;
+    }
+
     query_predicate* clone () const {
       return new query_predicate (*this);
     }
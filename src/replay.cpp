@@ -0,0 +1,232 @@
+#include "jam.hpp"
+#include <mftp/capture.hpp>
+#include <mftp/loopback_medium_automaton.hpp>
+#include <ioa/global_fifo_scheduler.hpp>
+#include <ioa/ioa.hpp>
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace jam {
+
+  // Feeds a capture to a fresh channel with a download for every file that appears in it.
+  // Files the capture holds in full are also served so the requests for them are answered.
+  class replay_automaton :
+    public ioa::automaton,
+    private ioa::observer
+  {
+  private:
+    ioa::handle_manager<replay_automaton> m_self;
+    mftp::medium_config m_config;
+    mftp::medium_stats m_stats;
+    const std::set<mftp::fileid> m_files;
+    const std::vector<ioa::const_shared_ptr<mftp::file> > m_served;
+    ioa::automaton_manager<mftp::loopback_medium_automaton>* m_medium;
+    ioa::automaton_manager<mftp::mftp_channel_automaton>* m_channel;
+    bool m_populated; // Downloads have been created for every file.
+    std::set<ioa::observable*> m_starting; // Downloads that have not been created.
+    bool m_started;
+    size_t m_completed;
+    ioa::time m_real_start;
+
+  public:
+    replay_automaton (const mftp::medium_config& config,
+		      const std::set<mftp::fileid>& files,
+		      const std::vector<ioa::const_shared_ptr<mftp::file> >& served) :
+      m_self (ioa::get_aid ()),
+      m_config (config),
+      m_files (files),
+      m_served (served),
+      m_channel (0),
+      m_populated (false),
+      m_started (false),
+      m_completed (0)
+    {
+      m_config.stats = &m_stats;
+      m_medium = new ioa::automaton_manager<mftp::loopback_medium_automaton> (this, ioa::make_generator<mftp::loopback_medium_automaton> (m_config));
+      ioa::make_binding_manager (this,
+				 &m_self, &replay_automaton::start,
+				 m_medium, &mftp::loopback_medium_automaton::start);
+      ioa::make_binding_manager (this,
+				 m_medium, &mftp::loopback_medium_automaton::finished,
+				 &m_self, &replay_automaton::finished);
+      add_observable (m_medium);
+    }
+
+  private:
+    void observe (ioa::observable* o) {
+      if (o == m_medium && m_medium->get_handle () != -1 && m_channel == 0) {
+	m_channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (m_medium->get_handle ()));
+	add_observable (m_channel);
+      }
+      else if (o == m_channel && m_channel->get_handle () != -1 && !m_populated) {
+	m_populated = true;
+	for (std::set<mftp::fileid>::const_iterator pos = m_files.begin (); pos != m_files.end (); ++pos) {
+	  std::auto_ptr<mftp::file> f (new mftp::file (*pos));
+	  ioa::automaton_manager<mftp::mftp_automaton>* download = new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (f, m_channel->get_handle (), false, 0));
+	  ioa::make_binding_manager (this,
+				     download, &mftp::mftp_automaton::download_complete,
+				     &m_self, &replay_automaton::complete);
+	  m_starting.insert (download);
+	  add_observable (download);
+	}
+	for (std::vector<ioa::const_shared_ptr<mftp::file> >::const_iterator pos = m_served.begin (); pos != m_served.end (); ++pos) {
+	  ioa::automaton_manager<mftp::mftp_automaton>* server = new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (*pos, m_channel->get_handle (), false, 0));
+	  m_starting.insert (server);
+	  add_observable (server);
+	}
+      }
+      else if (m_starting.count (o) != 0 && static_cast<ioa::automaton_manager<mftp::mftp_automaton>*> (o)->get_handle () != -1) {
+	m_starting.erase (o);
+      }
+      schedule ();
+    }
+
+    static double to_seconds (const ioa::time& t) {
+      return double (t.sec ()) + double (t.usec ()) / 1000000.0;
+    }
+
+    void report () {
+      struct rusage usage;
+      getrusage (RUSAGE_SELF, &usage);
+      const double cpu = to_seconds (ioa::time (usage.ru_utime.tv_sec, usage.ru_utime.tv_usec)) + to_seconds (ioa::time (usage.ru_stime.tv_sec, usage.ru_stime.tv_usec));
+      const double real = to_seconds (ioa::time::now () - m_real_start);
+
+      std::cout << "files " << m_files.size () << std::endl;
+      std::cout << "served " << m_served.size () << std::endl;
+      std::cout << "completed " << m_completed << std::endl;
+      std::cout << "datagrams " << m_stats.delivered << std::endl;
+      std::cout << "real_seconds " << real << std::endl;
+      std::cout << "cpu_seconds " << cpu << std::endl;
+      if (m_stats.delivered != 0) {
+	std::cout << "datagrams_per_second " << double (m_stats.delivered) / real << std::endl;
+	std::cout << "cpu_microseconds_per_datagram " << cpu * 1000000.0 / double (m_stats.delivered) << std::endl;
+      }
+      std::cout << "datagrams_sent " << m_stats.sent << std::endl;
+    }
+
+    void schedule () const {
+      if (start_precondition ()) {
+	ioa::schedule (&replay_automaton::start);
+      }
+    }
+
+    bool start_precondition () const {
+      // Every download has been created (and so has subscribed).
+      return !m_started && m_populated && m_starting.empty () && ioa::binding_count (&replay_automaton::start) != 0;
+    }
+
+    void start_effect () {
+      m_started = true;
+      m_real_start = ioa::time::now ();
+    }
+
+    void start_schedule () const { schedule (); }
+    UV_UP_OUTPUT (replay_automaton, start);
+
+    void finished_effect () {
+      report ();
+      exit (EXIT_SUCCESS);
+    }
+
+    void finished_schedule () const { schedule (); }
+    UV_UP_INPUT (replay_automaton, finished);
+
+    void complete_effect (const ioa::const_shared_ptr<mftp::file>&,
+			  ioa::aid_t) {
+      ++m_completed;
+    }
+
+    void complete_schedule (ioa::aid_t) const { schedule (); }
+
+  public:
+    V_AP_INPUT (replay_automaton, complete, ioa::const_shared_ptr<mftp::file>);
+  };
+
+}
+
+// The files that fragments and requests in the capture are about.
+// Those with every fragment in the capture are rebuilt into served.
+static void files_in (const std::string& path,
+		      std::set<mftp::fileid>& files,
+		      std::vector<ioa::const_shared_ptr<mftp::file> >& served) {
+  std::map<mftp::fileid, mftp::file*> rebuilt;
+  mftp::capture_reader reader (path);
+  uint64_t time;
+  std::string datagram;
+  while (reader.next (time, datagram)) {
+    if (datagram.size () != sizeof (mftp::message)) {
+      continue;
+    }
+    mftp::message m;
+    memcpy (&m, datagram.data (), sizeof (m));
+    if (!m.convert_to_host ()) {
+      continue;
+    }
+    switch (m.header.message_type) {
+    case mftp::FRAGMENT:
+      files.insert (m.frag.fid);
+      if (m.frag.idx < mftp::mfileid (m.frag.fid).get_fragment_count ()) {
+	mftp::file*& f = rebuilt[m.frag.fid];
+	if (f == 0) {
+	  f = new mftp::file (m.frag.fid);
+	}
+	f->write_chunk (m.frag.idx, m.frag.data);
+      }
+      break;
+    case mftp::REQUEST:
+      files.insert (m.req.fid);
+      break;
+    }
+  }
+
+  for (std::map<mftp::fileid, mftp::file*>::const_iterator pos = rebuilt.begin (); pos != rebuilt.end (); ++pos) {
+    if (pos->second->complete ()) {
+      served.push_back (ioa::const_shared_ptr<mftp::file> (pos->second));
+    }
+    else {
+      delete pos->second;
+    }
+  }
+}
+
+static void usage (const char* program) {
+  std::cerr << "Usage: " << program << " [-f] [-P PROFILE] CAPTURE" << std::endl;
+  std::cerr << "  -f  play as fast as possible instead of at the recorded pace" << std::endl;
+  std::cerr << "Files whose every fragment is in the capture are served; requests for other files go unanswered." << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+int main (int argc, char* argv[]) {
+  mftp::medium_config config;
+  int opt;
+  while ((opt = getopt (argc, argv, "fP:")) != -1) {
+    switch (opt) {
+    case 'f':
+      config.replay_fast = true;
+      break;
+    case 'P':
+      mftp::profile::enable (optarg);
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage (argv[0]);
+  }
+  config.replay = argv[optind];
+
+  std::set<mftp::fileid> files;
+  std::vector<ioa::const_shared_ptr<mftp::file> > served;
+  files_in (config.replay, files, served);
+
+  ioa::global_fifo_scheduler sched;
+  ioa::run (sched, ioa::make_generator<jam::replay_automaton> (config, files, served));
+
+  return 0;
+}
@@ -3,12 +3,19 @@
 #include <ioa/ioa.hpp>
 
 #include <iostream>
+#include <sstream>
 #include <stdio.h>
 #include <string>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
 
 namespace jam {
   
+  // A path and the name it is shared as.
+  typedef std::pair<std::string, std::string> share_type;
+
   class mftp_server_automaton :
     public ioa::automaton,
     private ioa::observer
@@ -16,16 +23,20 @@ namespace jam {
   private:
     ioa::automaton_manager<mftp::mftp_channel_automaton>* channel;
     
-    const std::string m_filename;
-    const std::string m_sharename;
+    const std::vector<share_type> m_shares;
 
   public:
-    mftp_server_automaton (const std::string& fname,
-			   const std::string& sname):
-      m_filename (fname),
-      m_sharename (sname)
+    mftp_server_automaton (const std::vector<share_type>& shares,
+			   const bool shard,
+			   const mftp::receiver_config& config):
+      m_shares (shares)
     {
-      channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (jam::SEND_ADDR, jam::LOCAL_ADDR, true));
+      if (shard) {
+	channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (jam::make_shards (), jam::LOCAL_ADDR, true, config));
+      }
+      else {
+	channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (jam::SEND_ADDR, jam::LOCAL_ADDR, true, true, config));
+      }
       
       add_observable (channel);
     }
@@ -39,67 +50,238 @@ namespace jam {
 
       if (channel != 0) {
 	if (channel->get_handle () != -1) {
-	  int fd = open (m_filename.c_str (), O_RDONLY);
-	  if (fd == -1) {
-	    perror ("open");
-	    exit (EXIT_FAILURE);
+	  for (std::vector<share_type>::const_iterator pos = m_shares.begin ();
+	       pos != m_shares.end ();
+	       ++pos) {
+	    share (pos->first, pos->second);
 	  }
+	}
+      }
+    }
 
-	  struct stat stats;
-	  if (fstat (fd, &stats) == -1) {
-	    perror ("fstat");
-	    exit (EXIT_FAILURE);
-	  }
+  private:
+    void share (const std::string& filename,
+		const std::string& sharename) {
+      int fd = open (filename.c_str (), O_RDONLY);
+      if (fd == -1) {
+	perror ("open");
+	exit (EXIT_FAILURE);
+      }
 
-	  // TODO:  Use streams.
-	  char* buf = new char[stats.st_size];
-	  if (read (fd, buf, stats.st_size) != stats.st_size) {
-	    perror ("read");
-	    exit (EXIT_FAILURE);
-	  }
+      struct stat stats;
+      if (fstat (fd, &stats) == -1) {
+	perror ("fstat");
+	exit (EXIT_FAILURE);
+      }
 
-	  close (fd);
+      // TODO:  Use streams.
+      char* buf = new char[stats.st_size];
+      if (read (fd, buf, stats.st_size) != stats.st_size) {
+	perror ("read");
+	exit (EXIT_FAILURE);
+      }
 
-	  std::auto_ptr<mftp::file> file (new mftp::file (buf, stats.st_size, FILE_TYPE));
-	  delete[] buf;
+      close (fd);
 
-	  mftp::fileid copy = file->get_mfileid ().get_fileid ();
-	  std::cout << "Sharing " << m_filename << " as " << (m_sharename + "-" + copy.to_string ()) << std::endl;
-	  copy.convert_to_network ();
+      std::auto_ptr<mftp::file> file (new mftp::file (buf, stats.st_size, FILE_TYPE));
+      delete[] buf;
 
-	  std::auto_ptr<mftp::file> meta (new mftp::file ());
+      mftp::fileid copy = file->get_mfileid ().get_fileid ();
+      std::cout << "Sharing " << filename << " as " << (sharename + "-" + copy.to_string ()) << std::endl;
+      copy.convert_to_network ();
 
-	  meta->get_data ().append (reinterpret_cast<char *> (&copy), sizeof (mftp::fileid));
-	  meta->get_data ().append (m_sharename);
-	  meta->finalize (META_TYPE);
+      std::auto_ptr<mftp::file> meta (new mftp::file ());
 
-	  // Create the file server.
-	  new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (file, channel->get_handle(), false, 0));
-	
-	  // Create the meta server.
-	  new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (meta, channel->get_handle (), query_predicate (m_sharename), query_filename_predicate (m_sharename), false, false, 0));
-	}
-      }
+      meta->get_data ().append (reinterpret_cast<char *> (&copy), sizeof (mftp::fileid));
+      meta->get_data ().append (sharename);
+      meta->finalize (META_TYPE);
+
+      // Create the file server.
+      new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (file, channel->get_handle(), false, 0));
+    
+      // Create the meta server.
+      new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (meta, channel->get_handle (), query_predicate (sharename), query_filename_predicate (sharename), false, false, 0));
     }
 
   };
 
 }
 
-int main (int argc, char* argv[]) {
-  if (!(argc == 2 || argc == 3)) {
-    std::cerr << "Usage: " << argv[0] << " FILE [NAME]" << std::endl;
-    exit(EXIT_FAILURE);
+static void usage (const char* program) {
+  std::cerr << "Usage: " << program << " [-s] [-t] [-b MICROSECONDS] [-j WORKERS] [-x METRICS_FILE | -X METRICS_SOCKET] [-M FILES] [-A SECONDS] [-D DOWNLOADS] [-R MEGABYTES] [-T TRACE] [-C CAPTURE] [-P PROFILE] FILE [NAME]" << std::endl;
+  std::cerr << "       " << program << " [-s] [-t] [-b MICROSECONDS] [-j WORKERS] [-x METRICS_FILE | -X METRICS_SOCKET] [-M FILES] [-A SECONDS] [-D DOWNLOADS] [-R MEGABYTES] [-T TRACE] [-C CAPTURE] [-P PROFILE] -m FILE..." << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+// Where to export metrics (none if the path is empty).
+struct metrics_option
+{
+  std::string path;
+  mftp::metrics_exporter::export_mode mode;
+
+  metrics_option () :
+    mode (mftp::metrics_exporter::FILE_EXPORT)
+  { }
+};
+
+static void serve (const std::vector<jam::share_type>& shares,
+		   const bool shard,
+		   const mftp::receiver_config& config,
+		   const metrics_option& metrics,
+		   const std::string& trace_path,
+		   const std::string& capture_path,
+		   const std::string& profile_path) {
+  if (!trace_path.empty ()) {
+    mftp::trace::enable (trace_path);
+  }
+  if (!capture_path.empty ()) {
+    mftp::capture::enable (capture_path);
+  }
+  if (!profile_path.empty ()) {
+    mftp::profile::enable (profile_path);
   }
 
-  const char* real_path = argv[1];
-  char* shared_as = argv[1];
-  if (argc == 3) {
-    shared_as = argv[2];
+  std::auto_ptr<mftp::metrics_exporter> exporter;
+  if (!metrics.path.empty ()) {
+    exporter.reset (new mftp::metrics_exporter (metrics.path, metrics.mode));
   }
 
   ioa::global_fifo_scheduler sched;
-  ioa::run (sched, ioa::make_generator<jam::mftp_server_automaton> (real_path, shared_as));
+  ioa::run (sched, ioa::make_generator<jam::mftp_server_automaton> (shares, shard, config));
+}
+
+int main (int argc, char* argv[]) {
+  bool shard = false;
+  bool multiple = false;
+  long workers = 1;
+  mftp::receiver_config config;
+  metrics_option metrics;
+  std::string trace_path;
+  std::string capture_path;
+  std::string profile_path;
+  mftp::match_config match;
+  mftp::download_limits downloads;
+  int opt;
+  while ((opt = getopt (argc, argv, "stb:j:mx:X:M:A:D:R:T:C:P:")) != -1) {
+    switch (opt) {
+    case 's':
+      shard = true;
+      break;
+    case 't':
+      config.io_thread = true;
+      break;
+    case 'b':
+      config.busy_poll = strtol (optarg, 0, 10);
+      break;
+    case 'j':
+      workers = strtol (optarg, 0, 10);
+      if (workers < 1) {
+	usage (argv[0]);
+      }
+      break;
+    case 'm':
+      multiple = true;
+      break;
+    case 'x':
+      metrics.path = optarg;
+      metrics.mode = mftp::metrics_exporter::FILE_EXPORT;
+      break;
+    case 'X':
+      metrics.path = optarg;
+      metrics.mode = mftp::metrics_exporter::SOCKET_EXPORT;
+      break;
+    case 'M':
+      match.capacity = strtoul (optarg, 0, 10);
+      if (match.capacity == 0) {
+	usage (argv[0]);
+      }
+      break;
+    case 'A':
+      match.ttl = ioa::time (strtol (optarg, 0, 10), 0);
+      break;
+    case 'D':
+      downloads.downloads = strtoul (optarg, 0, 10);
+      if (downloads.downloads == 0) {
+	usage (argv[0]);
+      }
+      break;
+    case 'R':
+      downloads.bytes = uint64_t (strtoul (optarg, 0, 10)) << 20;
+      break;
+    case 'T':
+      trace_path = optarg;
+      break;
+    case 'C':
+      capture_path = optarg;
+      break;
+    case 'P':
+      profile_path = optarg;
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+
+  const int args = argc - optind;
+  std::vector<jam::share_type> shares;
+  if (multiple) {
+    if (args < 1) {
+      usage (argv[0]);
+    }
+    for (int idx = optind; idx < argc; ++idx) {
+      shares.push_back (std::make_pair (argv[idx], argv[idx]));
+    }
+  }
+  else {
+    if (!(args == 1 || args == 2)) {
+      usage (argv[0]);
+    }
+    shares.push_back (std::make_pair (argv[optind], args == 2 ? argv[optind + 1] : argv[optind]));
+  }
+
+  mftp::mftp_automaton::set_match_config (match);
+  mftp::mftp_automaton::set_download_limits (downloads);
+
+  if (workers == 1) {
+    serve (shares, shard, config, metrics, trace_path, capture_path, profile_path);
+    return 0;
+  }
+
+  // The scheduler is global to a process so each worker is a process with its own scheduler and channel.
+  // A file is served (and hashed) by exactly one worker so its state has a single writer.
+  // Channel sockets use SO_REUSEPORT so all workers listen on the same port.
+  for (long worker = 0; worker < workers; ++worker) {
+    std::vector<jam::share_type> part;
+    for (size_t idx = worker; idx < shares.size (); idx += workers) {
+      part.push_back (shares[idx]);
+    }
+    if (part.empty ()) {
+      break;
+    }
+
+    const pid_t pid = fork ();
+    if (pid == -1) {
+      perror ("fork");
+      exit (EXIT_FAILURE);
+    }
+    else if (pid == 0) {
+      // Each worker exports its own metrics, trace, capture and profile.
+      std::ostringstream suffix;
+      suffix << "." << worker;
+      metrics_option worker_metrics (metrics);
+      if (!worker_metrics.path.empty ()) {
+	worker_metrics.path += suffix.str ();
+      }
+      serve (part, shard, config, worker_metrics,
+	     trace_path.empty () ? trace_path : trace_path + suffix.str (),
+	     capture_path.empty () ? capture_path : capture_path + suffix.str (),
+	     profile_path.empty () ? profile_path : profile_path + suffix.str ());
+      return 0;
+    }
+  }
+
+  int status;
+  while (wait (&status) != -1) { }
 
   return 0;
 }
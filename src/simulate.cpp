@@ -0,0 +1,369 @@
+#include "jam.hpp"
+#include <mftp/loopback_medium_automaton.hpp>
+#include <mftp/prng.hpp>
+#include <mftp/simulator_automaton.hpp>
+#include <ioa/global_fifo_scheduler.hpp>
+#include <ioa/ioa.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+namespace jam {
+
+  struct simulation_config
+  {
+    size_t nodes; // Node 0 shares the file and every other node downloads it.
+    uint32_t file_size;
+    ioa::time limit; // Time after which the simulation gives up.
+    bool virtual_time; // Run on a simulator_automaton instead of the wall clock.
+    bool csv; // Report one comma separated row.
+    double loss; // Loss rate of the medium (for the report).
+    mftp::medium_config medium;
+
+    simulation_config () :
+      nodes (100),
+      file_size (1024 * 1024),
+      limit (3600, 0),
+      virtual_time (true),
+      csv (false),
+      loss (0)
+    { }
+  };
+
+  // Runs one share and many downloads over a simulated medium in virtual or real time.
+  class simulation_automaton :
+    public ioa::automaton,
+    private ioa::observer
+  {
+  private:
+    enum alarm_state_t {
+      SET_READY,
+      INTERRUPT_WAIT,
+    };
+
+    ioa::handle_manager<simulation_automaton> m_self;
+    simulation_config m_config;
+    mftp::medium_stats m_stats;
+    ioa::automaton_manager<mftp::simulator_automaton>* m_simulator;
+    ioa::automaton_manager<mftp::loopback_medium_automaton>* m_medium;
+    bool m_populated; // Channels have been created for every node.
+    std::map<ioa::observable*, size_t> m_starting; // Channels whose node has not been created.
+    mftp::fileid m_fileid; // The shared file.
+    ioa::time m_start;
+    ioa::time m_real_start;
+    std::vector<double> m_completions; // Seconds to download.
+    alarm_state_t m_alarm_state;
+
+  public:
+    simulation_automaton (const simulation_config& config) :
+      m_self (ioa::get_aid ()),
+      m_config (config),
+      m_medium (0),
+      m_populated (false),
+      m_real_start (ioa::time::now ()),
+      m_alarm_state (SET_READY)
+    {
+      m_config.medium.stats = &m_stats;
+
+      if (m_config.virtual_time) {
+	// Start well after the epoch so timers that start at zero have expired, as they have in real time.
+	m_simulator = new ioa::automaton_manager<mftp::simulator_automaton> (this, ioa::make_generator<mftp::simulator_automaton> (ioa::time (1000000, 0)));
+	add_observable (m_simulator);
+      }
+      else {
+	m_simulator = 0;
+	ioa::automaton_manager<ioa::alarm_automaton>* alarm = new ioa::automaton_manager<ioa::alarm_automaton> (this, ioa::make_generator<ioa::alarm_automaton> ());
+	ioa::make_binding_manager (this,
+				   &m_self, &simulation_automaton::set_alarm,
+				   alarm, &ioa::alarm_automaton::set);
+	ioa::make_binding_manager (this,
+				   alarm, &ioa::alarm_automaton::alarm,
+				   &m_self, &simulation_automaton::alarm_interrupt);
+	create_medium ();
+      }
+    }
+
+  private:
+    void create_medium () {
+      m_start = mftp::clock::now ();
+      m_medium = new ioa::automaton_manager<mftp::loopback_medium_automaton> (this, ioa::make_generator<mftp::loopback_medium_automaton> (m_config.medium));
+      add_observable (m_medium);
+    }
+
+    void observe (ioa::observable* o) {
+      if (o == m_simulator && m_simulator->get_handle () != -1 && m_medium == 0) {
+	ioa::make_binding_manager (this,
+				   &m_self, &simulation_automaton::set_alarm,
+				   m_simulator, &mftp::simulator_automaton::set);
+	ioa::make_binding_manager (this,
+				   m_simulator, &mftp::simulator_automaton::alarm,
+				   &m_self, &simulation_automaton::alarm_interrupt);
+	create_medium ();
+      }
+      else if (o == m_medium && m_medium->get_handle () != -1 && !m_populated) {
+	m_populated = true;
+	for (size_t node = 0; node != m_config.nodes; ++node) {
+	  ioa::automaton_manager<mftp::mftp_channel_automaton>* channel = new ioa::automaton_manager<mftp::mftp_channel_automaton> (this, ioa::make_generator<mftp::mftp_channel_automaton> (m_medium->get_handle ()));
+	  m_starting.insert (std::make_pair (channel, node));
+	  add_observable (channel);
+	}
+      }
+      else {
+	std::map<ioa::observable*, size_t>::iterator pos = m_starting.find (o);
+	if (pos != m_starting.end ()) {
+	  ioa::automaton_manager<mftp::mftp_channel_automaton>* channel = static_cast<ioa::automaton_manager<mftp::mftp_channel_automaton>*> (o);
+	  if (channel->get_handle () != -1) {
+	    start_node (channel, pos->second);
+	    m_starting.erase (pos);
+	  }
+	}
+      }
+      schedule ();
+    }
+
+    void start_node (ioa::automaton_manager<mftp::mftp_channel_automaton>* channel,
+		     const size_t node) {
+      if (node == 0) {
+	mftp::prng prng (m_config.medium.seed);
+	std::string data (m_config.file_size, 0);
+	for (std::string::iterator pos = data.begin (); pos != data.end (); ++pos) {
+	  *pos = static_cast<char> (prng.next ());
+	}
+	std::auto_ptr<mftp::file> file (new mftp::file (data, FILE_TYPE));
+	m_fileid = file->get_mfileid ().get_fileid ();
+	new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (file, channel->get_handle (), false, 0));
+      }
+      else {
+	std::auto_ptr<mftp::file> file (new mftp::file (m_fileid));
+	ioa::automaton_manager<mftp::mftp_automaton>* download = new ioa::automaton_manager<mftp::mftp_automaton> (this, ioa::make_generator<mftp::mftp_automaton> (file, channel->get_handle (), false, 0));
+	ioa::make_binding_manager (this,
+				   download, &mftp::mftp_automaton::download_complete,
+				   &m_self, &simulation_automaton::complete);
+      }
+    }
+
+    static double to_seconds (const ioa::time& t) {
+      return double (t.sec ()) + double (t.usec ()) / 1000000.0;
+    }
+
+    static const char* type_name (const uint32_t type) {
+      switch (type) {
+      case mftp::FRAGMENT:
+	return "fragment";
+      case mftp::REQUEST:
+	return "request";
+      case mftp::MATCH:
+	return "match";
+      case mftp::MATCH_FILTER:
+	return "match_filter";
+      case mftp::CATALOG:
+	return "catalog";
+      }
+      return "other";
+    }
+
+    static double cpu_seconds () {
+      struct rusage usage;
+      getrusage (RUSAGE_SELF, &usage);
+      return to_seconds (ioa::time (usage.ru_utime.tv_sec, usage.ru_utime.tv_usec)) + to_seconds (ioa::time (usage.ru_stime.tv_sec, usage.ru_stime.tv_usec));
+    }
+
+    uint64_t sent (const uint32_t type) const {
+      std::map<uint32_t, uint64_t>::const_iterator pos = m_stats.sent_by_type.find (type);
+      return pos != m_stats.sent_by_type.end () ? pos->second : 0;
+    }
+
+    uint64_t delivered (const uint32_t type) const {
+      std::map<uint32_t, uint64_t>::const_iterator pos = m_stats.delivered_by_type.find (type);
+      return pos != m_stats.delivered_by_type.end () ? pos->second : 0;
+    }
+
+    void report () {
+      std::sort (m_completions.begin (), m_completions.end ());
+
+      const double receivers = double (m_config.nodes - 1);
+      const double median = m_completions.empty () ? 0 : m_completions[m_completions.size () / 2];
+      const double max = m_completions.empty () ? 0 : m_completions.back ();
+      // Bytes delivered to receivers per second until the last one finished.
+      const double goodput = max == 0 ? 0 : double (m_config.file_size) * double (m_completions.size ()) / max;
+      const double requests = double (sent (mftp::REQUEST)) / receivers;
+      // Fragments seen by a node beyond the number in the file.
+      const double fragments = double (mftp::file (m_fileid).get_mfileid ().get_fragment_count ());
+      const double duplicates = std::max (0.0, double (delivered (mftp::FRAGMENT)) / double (m_config.nodes) - fragments);
+      const double cpu = cpu_seconds () / (double (m_config.file_size) * receivers / (1024.0 * 1024.0));
+      const double real = to_seconds (ioa::time::now () - m_real_start);
+
+      if (m_config.csv) {
+	std::cout << m_config.nodes << ','
+		  << m_config.file_size << ','
+		  << m_config.loss << ','
+		  << (m_config.virtual_time ? "virtual" : "real") << ','
+		  << m_completions.size () << ','
+		  << median << ','
+		  << max << ','
+		  << goodput << ','
+		  << requests << ','
+		  << duplicates << ','
+		  << m_stats.sent << ','
+		  << m_stats.bytes << ','
+		  << cpu << ','
+		  << real << std::endl;
+	return;
+      }
+
+      std::cout << "nodes " << m_config.nodes << std::endl;
+      std::cout << "file_bytes " << m_config.file_size << std::endl;
+      std::cout << "loss " << m_config.loss << std::endl;
+      std::cout << "clock " << (m_config.virtual_time ? "virtual" : "real") << std::endl;
+      std::cout << "completed " << m_completions.size () << std::endl;
+      if (!m_completions.empty ()) {
+	std::cout << "seconds_min " << m_completions.front () << std::endl;
+	std::cout << "seconds_median " << median << std::endl;
+	std::cout << "seconds_p90 " << m_completions[m_completions.size () * 9 / 10] << std::endl;
+	std::cout << "seconds_p99 " << m_completions[m_completions.size () * 99 / 100] << std::endl;
+	std::cout << "seconds_max " << max << std::endl;
+      }
+      std::cout << "goodput_bytes_per_second " << goodput << std::endl;
+      std::cout << "requests_per_receiver " << requests << std::endl;
+      std::cout << "duplicate_fragments_per_receiver " << duplicates << std::endl;
+      std::cout << "datagrams_sent " << m_stats.sent << std::endl;
+      std::cout << "bytes_sent " << m_stats.bytes << std::endl;
+      std::cout << "datagrams_delivered " << m_stats.delivered << std::endl;
+      std::cout << "datagrams_lost " << m_stats.lost << std::endl;
+      for (std::map<uint32_t, uint64_t>::const_iterator pos = m_stats.sent_by_type.begin ();
+	   pos != m_stats.sent_by_type.end ();
+	   ++pos) {
+	std::cout << "sent_" << type_name (pos->first) << " " << pos->second << std::endl;
+      }
+      std::cout << "cpu_seconds_per_mb " << cpu << std::endl;
+      std::cout << "real_seconds " << real << std::endl;
+    }
+
+    void schedule () const {
+      if (set_alarm_precondition ()) {
+	ioa::schedule (&simulation_automaton::set_alarm);
+      }
+    }
+
+    void complete_effect (const ioa::const_shared_ptr<mftp::file>&,
+			  ioa::aid_t) {
+      m_completions.push_back (to_seconds (mftp::clock::now () - m_start));
+      if (m_completions.size () == m_config.nodes - 1) {
+	report ();
+	exit (EXIT_SUCCESS);
+      }
+    }
+
+    void complete_schedule (ioa::aid_t) const { schedule (); }
+
+  public:
+    V_AP_INPUT (simulation_automaton, complete, ioa::const_shared_ptr<mftp::file>);
+
+  private:
+    bool set_alarm_precondition () const {
+      return m_alarm_state == SET_READY && ioa::binding_count (&simulation_automaton::set_alarm) != 0;
+    }
+
+    ioa::time set_alarm_effect () {
+      m_alarm_state = INTERRUPT_WAIT;
+      return m_config.limit;
+    }
+
+    void set_alarm_schedule () const { schedule (); }
+    V_UP_OUTPUT (simulation_automaton, set_alarm, ioa::time);
+
+    void alarm_interrupt_effect () {
+      std::cerr << "simulation did not finish in " << m_config.limit.sec () << " seconds" << std::endl;
+      report ();
+      exit (EXIT_FAILURE);
+    }
+
+    void alarm_interrupt_schedule () const { schedule (); }
+    UV_UP_INPUT (simulation_automaton, alarm_interrupt);
+  };
+
+}
+
+static void usage (const char* program) {
+  std::cerr << "Usage: " << program << " [-R] [-c] [-n NODES] [-f BYTES] [-l LOSS] [-b BYTES_PER_SECOND] [-d DELAY_MS] [-r SEED] [-t LIMIT_SECONDS] [-e FRAGMENTS] [-E COPIES] [-T TRACE] [-P PROFILE]" << std::endl;
+  std::cerr << "  -R  run on the wall clock instead of virtual time" << std::endl;
+  std::cerr << "  -c  print one comma separated row" << std::endl;
+  std::cerr << "  -e  start the endgame with this many fragments missing (0 for never)" << std::endl;
+  std::cerr << "  -E  send this many copies of each endgame request" << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+int main (int argc, char* argv[]) {
+  jam::simulation_config config;
+  config.medium.bandwidth = 12500000; // 100 Mbit/s
+  config.medium.delay = ioa::time (0, 1000);
+  mftp::endgame_config endgame;
+  int opt;
+  while ((opt = getopt (argc, argv, "Rcn:f:l:b:d:r:t:e:E:T:P:")) != -1) {
+    switch (opt) {
+    case 'R':
+      config.virtual_time = false;
+      break;
+    case 'c':
+      config.csv = true;
+      break;
+    case 'n':
+      config.nodes = strtoul (optarg, 0, 10);
+      if (config.nodes < 2) {
+	usage (argv[0]);
+      }
+      break;
+    case 'f':
+      config.file_size = strtoul (optarg, 0, 10);
+      break;
+    case 'l':
+      config.loss = strtod (optarg, 0);
+      config.medium.loss = mftp::loss_model::bernoulli (config.loss);
+      break;
+    case 'b':
+      config.medium.bandwidth = strtod (optarg, 0);
+      break;
+    case 'd':
+      {
+	const long ms = strtol (optarg, 0, 10);
+	config.medium.delay = ioa::time (ms / 1000, (ms % 1000) * 1000);
+      }
+      break;
+    case 'r':
+      config.medium.seed = strtoull (optarg, 0, 10);
+      break;
+    case 't':
+      config.limit = ioa::time (strtol (optarg, 0, 10), 0);
+      break;
+    case 'e':
+      endgame.threshold = strtoul (optarg, 0, 10);
+      break;
+    case 'E':
+      endgame.copies = strtoul (optarg, 0, 10);
+      break;
+    case 'T':
+      // Events of all nodes land in one ring since they share a thread.
+      mftp::trace::enable (optarg);
+      break;
+    case 'P':
+      mftp::profile::enable (optarg);
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+
+  if (optind != argc) {
+    usage (argv[0]);
+  }
+  mftp::mftp_automaton::set_endgame (endgame);
+
+  ioa::global_fifo_scheduler sched;
+  ioa::run (sched, ioa::make_generator<jam::simulation_automaton> (config));
+
+  return 0;
+}
@@ -0,0 +1,314 @@
+#include <mftp/message.hpp>
+#include <mftp/trace.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <unistd.h>
+#include <vector>
+
+// Decodes trace dumps written by mftp::trace.
+
+static const char* event_name (const uint16_t event) {
+  switch (event) {
+  case mftp::TRACE_FRAGMENT_RECEIVED:
+    return "received";
+  case mftp::TRACE_FRAGMENT_DUPLICATE:
+    return "duplicate";
+  case mftp::TRACE_FRAGMENT_CORRUPT:
+    return "corrupt";
+  case mftp::TRACE_FRAGMENT_REQUESTED:
+    return "requested";
+  case mftp::TRACE_FRAGMENT_QUEUED:
+    return "queued";
+  case mftp::TRACE_FRAGMENT_SENT:
+    return "sent";
+  case mftp::TRACE_REQUEST_SENT:
+    return "request_sent";
+  case mftp::TRACE_REQUEST_RECEIVED:
+    return "request_received";
+  case mftp::TRACE_MATCH_SENT:
+    return "match_sent";
+  case mftp::TRACE_MATCH_RECEIVED:
+    return "match_received";
+  case mftp::TRACE_DATAGRAM_SENT:
+    return "datagram_sent";
+  case mftp::TRACE_DATAGRAM_RECEIVED:
+    return "datagram_received";
+  case mftp::TRACE_DATAGRAM_INVALID:
+    return "datagram_invalid";
+  case mftp::TRACE_DATAGRAM_UNROUTED:
+    return "datagram_unrouted";
+  }
+  return "unknown";
+}
+
+static const char* message_name (const uint16_t type) {
+  switch (type) {
+  case mftp::FRAGMENT:
+    return "fragment";
+  case mftp::REQUEST:
+    return "request";
+  case mftp::MATCH:
+    return "match";
+  case mftp::MATCH_FILTER:
+    return "match_filter";
+  case mftp::CATALOG:
+    return "catalog";
+  }
+  return "other";
+}
+
+static bool time_lt (const mftp::trace_record& x,
+		     const mftp::trace_record& y) {
+  return x.time < y.time;
+}
+
+static void load (const char* path,
+		  std::vector<mftp::trace_record>& records) {
+  FILE* fp = fopen (path, "r");
+  if (fp == NULL) {
+    perror ("fopen");
+    exit (EXIT_FAILURE);
+  }
+
+  mftp::trace_file_header header;
+  if (fread (&header, sizeof (header), 1, fp) != 1 ||
+      memcmp (header.magic, mftp::TRACE_MAGIC, sizeof (header.magic)) != 0 ||
+      header.record_size != sizeof (mftp::trace_record)) {
+    std::cerr << path << ": not a trace" << std::endl;
+    exit (EXIT_FAILURE);
+  }
+
+  const size_t offset = records.size ();
+  records.resize (offset + header.record_count);
+  const size_t n = fread (&records[offset], sizeof (mftp::trace_record), header.record_count, fp);
+  // A dump taken while the process was running can be short.
+  records.resize (offset + n);
+  fclose (fp);
+}
+
+struct fragment_key
+{
+  uint32_t file;
+  uint32_t index;
+
+  fragment_key (const uint32_t f,
+		const uint32_t i) :
+    file (f),
+    index (i)
+  { }
+
+  bool operator< (const fragment_key& other) const {
+    return file != other.file ? file < other.file : index < other.index;
+  }
+};
+
+static double seconds (const uint64_t us) {
+  return double (us) / 1000000.0;
+}
+
+static void timelines (const std::vector<mftp::trace_record>& records) {
+  if (records.empty ()) {
+    return;
+  }
+  const uint64_t start = records.front ().time;
+
+  std::map<fragment_key, std::vector<const mftp::trace_record*> > fragments;
+  for (std::vector<mftp::trace_record>::const_iterator pos = records.begin (); pos != records.end (); ++pos) {
+    switch (pos->event) {
+    case mftp::TRACE_FRAGMENT_RECEIVED:
+    case mftp::TRACE_FRAGMENT_DUPLICATE:
+    case mftp::TRACE_FRAGMENT_CORRUPT:
+    case mftp::TRACE_FRAGMENT_REQUESTED:
+    case mftp::TRACE_FRAGMENT_QUEUED:
+    case mftp::TRACE_FRAGMENT_SENT:
+    case mftp::TRACE_REQUEST_RECEIVED:
+      fragments[fragment_key (pos->file, pos->index)].push_back (&*pos);
+      break;
+    }
+  }
+
+  std::cout << std::fixed << std::setprecision (6);
+  for (std::map<fragment_key, std::vector<const mftp::trace_record*> >::const_iterator f = fragments.begin (); f != fragments.end (); ++f) {
+    std::cout << "file " << std::hex << std::setw (8) << std::setfill ('0') << f->first.file << std::dec << std::setfill (' ') << " fragment " << f->first.index << std::endl;
+    for (std::vector<const mftp::trace_record*>::const_iterator r = f->second.begin (); r != f->second.end (); ++r) {
+      std::cout << "  " << seconds ((*r)->time - start) << " " << event_name ((*r)->event) << std::endl;
+    }
+  }
+}
+
+struct file_stats
+{
+  uint64_t received;
+  uint64_t duplicate;
+  uint64_t corrupt;
+  uint64_t requested; // Fragments put in requests.
+  uint64_t rerequested; // Fragments requested again before they arrived.
+  uint64_t requests_sent;
+  uint64_t requests_received; // Fragments requested by others.
+  uint64_t queued;
+  uint64_t sent;
+  std::vector<uint64_t> rtt; // Microseconds from the last request for a fragment to its arrival.
+
+  file_stats () :
+    received (0),
+    duplicate (0),
+    corrupt (0),
+    requested (0),
+    rerequested (0),
+    requests_sent (0),
+    requests_received (0),
+    queued (0),
+    sent (0)
+  { }
+};
+
+static void statistics (const std::vector<mftp::trace_record>& records) {
+  std::map<uint32_t, file_stats> files;
+  std::map<fragment_key, uint64_t> outstanding; // Time of the last request for a fragment not yet received.
+  std::map<uint16_t, uint64_t> datagrams_sent;
+  std::map<uint16_t, uint64_t> datagrams_received;
+  uint64_t invalid = 0;
+  uint64_t unrouted = 0;
+
+  for (std::vector<mftp::trace_record>::const_iterator pos = records.begin (); pos != records.end (); ++pos) {
+    file_stats& s = files[pos->file];
+    const fragment_key key (pos->file, pos->index);
+    switch (pos->event) {
+    case mftp::TRACE_FRAGMENT_RECEIVED:
+      {
+	++s.received;
+	std::map<fragment_key, uint64_t>::iterator o = outstanding.find (key);
+	if (o != outstanding.end ()) {
+	  s.rtt.push_back (pos->time - o->second);
+	  outstanding.erase (o);
+	}
+      }
+      break;
+    case mftp::TRACE_FRAGMENT_DUPLICATE:
+      ++s.duplicate;
+      break;
+    case mftp::TRACE_FRAGMENT_CORRUPT:
+      ++s.corrupt;
+      break;
+    case mftp::TRACE_FRAGMENT_REQUESTED:
+      {
+	++s.requested;
+	std::pair<std::map<fragment_key, uint64_t>::iterator, bool> r = outstanding.insert (std::make_pair (key, pos->time));
+	if (!r.second) {
+	  // The last request (or its answer) was lost.
+	  ++s.rerequested;
+	  r.first->second = pos->time;
+	}
+      }
+      break;
+    case mftp::TRACE_REQUEST_SENT:
+      ++s.requests_sent;
+      break;
+    case mftp::TRACE_REQUEST_RECEIVED:
+      ++s.requests_received;
+      break;
+    case mftp::TRACE_FRAGMENT_QUEUED:
+      ++s.queued;
+      break;
+    case mftp::TRACE_FRAGMENT_SENT:
+      ++s.sent;
+      break;
+    case mftp::TRACE_DATAGRAM_SENT:
+      ++datagrams_sent[pos->message];
+      break;
+    case mftp::TRACE_DATAGRAM_RECEIVED:
+      ++datagrams_received[pos->message];
+      break;
+    case mftp::TRACE_DATAGRAM_INVALID:
+      ++invalid;
+      break;
+    case mftp::TRACE_DATAGRAM_UNROUTED:
+      ++unrouted;
+      break;
+    }
+  }
+
+  std::cout << std::fixed << std::setprecision (6);
+  for (std::map<uint32_t, file_stats>::iterator f = files.begin (); f != files.end (); ++f) {
+    file_stats& s = f->second;
+    if (s.received + s.duplicate + s.corrupt + s.requested + s.requests_received + s.queued + s.sent == 0) {
+      continue;
+    }
+    std::cout << "file " << std::hex << std::setw (8) << std::setfill ('0') << f->first << std::dec << std::setfill (' ') << std::endl;
+    std::cout << "  received " << s.received << std::endl;
+    std::cout << "  duplicate " << s.duplicate << std::endl;
+    std::cout << "  corrupt " << s.corrupt << std::endl;
+    std::cout << "  requests_sent " << s.requests_sent << std::endl;
+    std::cout << "  fragments_requested " << s.requested << std::endl;
+    std::cout << "  fragments_rerequested " << s.rerequested << std::endl;
+    if (s.requested != 0) {
+      std::cout << "  loss_estimate " << double (s.rerequested) / double (s.requested) << std::endl;
+    }
+    std::cout << "  fragments_requested_by_others " << s.requests_received << std::endl;
+    std::cout << "  fragments_queued " << s.queued << std::endl;
+    std::cout << "  fragments_sent " << s.sent << std::endl;
+    if (!s.rtt.empty ()) {
+      std::sort (s.rtt.begin (), s.rtt.end ());
+      std::cout << "  rtt_min " << seconds (s.rtt.front ()) << std::endl;
+      std::cout << "  rtt_median " << seconds (s.rtt[s.rtt.size () / 2]) << std::endl;
+      std::cout << "  rtt_p90 " << seconds (s.rtt[s.rtt.size () * 9 / 10]) << std::endl;
+      std::cout << "  rtt_max " << seconds (s.rtt.back ()) << std::endl;
+    }
+  }
+
+  std::cout << "channel" << std::endl;
+  for (std::map<uint16_t, uint64_t>::const_iterator pos = datagrams_sent.begin (); pos != datagrams_sent.end (); ++pos) {
+    std::cout << "  sent_" << message_name (pos->first) << " " << pos->second << std::endl;
+  }
+  for (std::map<uint16_t, uint64_t>::const_iterator pos = datagrams_received.begin (); pos != datagrams_received.end (); ++pos) {
+    std::cout << "  received_" << message_name (pos->first) << " " << pos->second << std::endl;
+  }
+  std::cout << "  invalid " << invalid << std::endl;
+  std::cout << "  unrouted " << unrouted << std::endl;
+}
+
+static void usage (const char* program) {
+  std::cerr << "Usage: " << program << " [-t] TRACE..." << std::endl;
+  std::cerr << "  -t  print a timeline for every fragment instead of statistics" << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+int main (int argc, char* argv[]) {
+  bool timeline = false;
+  int opt;
+  while ((opt = getopt (argc, argv, "t")) != -1) {
+    switch (opt) {
+    case 't':
+      timeline = true;
+      break;
+    default:
+      usage (argv[0]);
+    }
+  }
+
+  if (optind == argc) {
+    usage (argv[0]);
+  }
+
+  // Dumps from several processes (or threads) are merged by time.
+  std::vector<mftp::trace_record> records;
+  for (int idx = optind; idx < argc; ++idx) {
+    load (argv[idx], records);
+  }
+  std::stable_sort (records.begin (), records.end (), time_lt);
+
+  if (timeline) {
+    timelines (records);
+  }
+  else {
+    statistics (records);
+  }
+
+  return 0;
+}
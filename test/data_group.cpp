@@ -0,0 +1,56 @@
+#include <mftp/fileid.hpp>
+#include "minunit.h"
+
+#include <iostream>
+
+using namespace mftp;
+
+static fileid make_fileid (const uint8_t a,
+			   const uint8_t b,
+			   const uint8_t c,
+			   const uint8_t d) {
+  fileid fid;
+  fid.type = 1;
+  fid.length = 1000;
+  memset (fid.hash, 0xff, HASH_SIZE);
+  fid.hash[4] = a;
+  fid.hash[5] = b;
+  fid.hash[6] = c;
+  fid.hash[7] = d;
+  return fid;
+}
+
+static const char* pinned () {
+  std::cout << __func__ << std::endl;
+  // These go on the wire so they must hold on every host and in every version.
+  mu_assert (data_group (make_fileid (0x00, 0x00, 0x01, 0x00), 3) == 2);
+  mu_assert (data_group (make_fileid (0x12, 0x34, 0x56, 0x78), 7) == 6);
+  mu_assert (data_group (make_fileid (0xde, 0xad, 0xbe, 0xef), 5) == 5);
+  mu_assert (data_group (make_fileid (0xde, 0xad, 0xbe, 0xef), 1) == 1);
+  return 0;
+}
+
+static const char* digest_only () {
+  std::cout << __func__ << std::endl;
+  // The type and length don't move a file.
+  fileid fid = make_fileid (0x12, 0x34, 0x56, 0x78);
+  fid.type = 2;
+  fid.length = 7;
+  mu_assert (data_group (fid, 7) == 6);
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (pinned);
+  mu_run_test (digest_only);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+  return result != 0;
+}
@@ -0,0 +1,147 @@
+#include <mftp/download_budget.hpp>
+#include "minunit.h"
+
+#include <cstring>
+#include <iostream>
+
+using namespace mftp;
+
+static fileid make_fileid (const uint32_t n) {
+  fileid fid;
+  fid.type = 1;
+  fid.length = n;
+  memset (fid.hash, 0, HASH_SIZE);
+  return fid;
+}
+
+static download_limits make_limits (const size_t downloads,
+				    const uint64_t bytes) {
+  download_limits limits;
+  limits.downloads = downloads;
+  limits.bytes = bytes;
+  return limits;
+}
+
+static const char* count_limit () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (2, 1000));
+  mu_assert (b.reserve (10));
+  mu_assert (b.reserve (10));
+  mu_assert (!b.reserve (10));
+  mu_assert (b.downloads () == 2);
+  mu_assert (b.bytes () == 20);
+  b.release (10);
+  mu_assert (b.reserve (10));
+  return 0;
+}
+
+static const char* byte_limit () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (10, 100));
+  mu_assert (b.reserve (60));
+  mu_assert (!b.reserve (50));
+  mu_assert (b.reserve (40));
+  mu_assert (b.bytes () == 100);
+  b.release (60);
+  b.release (40);
+  mu_assert (b.downloads () == 0);
+  mu_assert (b.bytes () == 0);
+  return 0;
+}
+
+static const char* oversized () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (10, 100));
+  // Alone it runs.
+  mu_assert (b.reserve (500));
+  mu_assert (!b.reserve (1));
+  b.release (500);
+  mu_assert (b.reserve (1));
+  mu_assert (!b.reserve (500));
+  return 0;
+}
+
+static const char* new_limits () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (1, 100));
+  mu_assert (b.reserve (10));
+  mu_assert (!b.reserve (10));
+  b.set_limits (make_limits (2, 100));
+  mu_assert (b.reserve (10));
+  return 0;
+}
+
+static const char* leases () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (2, 1000));
+  download_leases l (b, 100);
+  mu_assert (l.acquire (make_fileid (1), 10, 0));
+  mu_assert (!l.acquire (make_fileid (1), 10, 0));
+  mu_assert (l.acquire (make_fileid (2), 20, 0));
+  mu_assert (!l.acquire (make_fileid (3), 10, 0));
+  mu_assert (b.downloads () == 2 && b.bytes () == 30);
+  mu_assert (l.release (make_fileid (1)));
+  mu_assert (!l.release (make_fileid (1)));
+  mu_assert (b.downloads () == 1 && b.bytes () == 20);
+  return 0;
+}
+
+static const char* idle () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (2, 1000));
+  download_leases l (b, 100);
+  mu_assert (l.next_deadline () == 0);
+  l.acquire (make_fileid (1), 10, 0);
+  l.acquire (make_fileid (2), 20, 10);
+  mu_assert (l.next_deadline () == 100);
+  // Progress puts the deadline off.
+  l.renew (make_fileid (1), 50);
+  mu_assert (l.next_deadline () == 110);
+
+  std::vector<fileid> expired;
+  l.expire (109, expired);
+  mu_assert (expired.empty ());
+  l.expire (110, expired);
+  mu_assert (expired.size () == 1 && expired[0] == make_fileid (2));
+  mu_assert (!l.contains (make_fileid (2)));
+  mu_assert (b.downloads () == 1 && b.bytes () == 10);
+  // The room is free for another.
+  mu_assert (l.acquire (make_fileid (3), 10, 110));
+  // A download that finishes after it expired releases nothing.
+  mu_assert (!l.release (make_fileid (2)));
+  mu_assert (b.downloads () == 2);
+  return 0;
+}
+
+static const char* leases_released () {
+  std::cout << __func__ << std::endl;
+  download_budget b (make_limits (2, 1000));
+  {
+    download_leases l (b, 100);
+    l.acquire (make_fileid (1), 10, 0);
+    l.acquire (make_fileid (2), 20, 0);
+  }
+  // The budget gets back what an automaton held when it goes.
+  mu_assert (b.downloads () == 0 && b.bytes () == 0);
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (count_limit);
+  mu_run_test (byte_limit);
+  mu_run_test (oversized);
+  mu_run_test (new_limits);
+  mu_run_test (leases);
+  mu_run_test (idle);
+  mu_run_test (leases_released);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+  return result != 0;
+}
@@ -0,0 +1,84 @@
+#include <mftp/loss_model.hpp>
+#include "minunit.h"
+
+#include <iostream>
+
+using namespace mftp;
+
+static const int COUNT = 100000;
+
+static const char* no_loss () {
+  std::cout << __func__ << std::endl;
+  prng r (1);
+  loss_model m;
+  for (int i = 0; i < COUNT; ++i) {
+    mu_assert (!m.drop (r));
+  }
+  return 0;
+}
+
+static const char* bernoulli () {
+  std::cout << __func__ << std::endl;
+  prng r (1);
+  loss_model m = loss_model::bernoulli (0.1);
+  int lost = 0;
+  for (int i = 0; i < COUNT; ++i) {
+    lost += m.drop (r);
+  }
+  mu_assert (lost > COUNT / 10 - COUNT / 100 && lost < COUNT / 10 + COUNT / 100);
+  return 0;
+}
+
+static const char* gilbert_elliott () {
+  std::cout << __func__ << std::endl;
+  prng r (1);
+  // Lose everything in the bad state and stay there for 10 packets on average.
+  loss_model m = loss_model::gilbert_elliott (0.01, 0.1, 0, 1);
+  int lost = 0;
+  int bursts = 0;
+  bool last = false;
+  for (int i = 0; i < COUNT; ++i) {
+    const bool d = m.drop (r);
+    lost += d;
+    if (d && !last) {
+      ++bursts;
+    }
+    last = d;
+  }
+  // Stationary loss is 0.01 / (0.01 + 0.1).
+  mu_assert (lost > COUNT * 8 / 100 && lost < COUNT * 10 / 100);
+  // Mean burst length is 1 / 0.1.
+  mu_assert (lost / bursts > 8 && lost / bursts < 12);
+  return 0;
+}
+
+static const char* reproducible () {
+  std::cout << __func__ << std::endl;
+  prng r1 (42);
+  prng r2 (42);
+  loss_model m1 = loss_model::gilbert_elliott (0.05, 0.3, 0.01, 0.5);
+  loss_model m2 = m1;
+  for (int i = 0; i < COUNT; ++i) {
+    mu_assert (m1.drop (r1) == m2.drop (r2));
+  }
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (no_loss);
+  mu_run_test (bernoulli);
+  mu_run_test (gilbert_elliott);
+  mu_run_test (reproducible);
+
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+
+  return result != 0;
+}
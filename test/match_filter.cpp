@@ -0,0 +1,101 @@
+#include <mftp/message.hpp>
+#include <mftp/prng.hpp>
+#include "minunit.h"
+
+#include <iostream>
+#include <vector>
+
+using namespace mftp;
+
+static fileid random_fileid (prng& p) {
+  fileid fid;
+  fid.type = 1;
+  fid.length = 1000;
+  for (size_t idx = 0; idx < HASH_SIZE; ++idx) {
+    fid.hash[idx] = uint8_t (p.next ());
+  }
+  return fid;
+}
+
+static const char* empty () {
+  std::cout << __func__ << std::endl;
+  prng p (1);
+  message m (match_filter_type (), random_fileid (p));
+  for (int count = 0; count != 1000; ++count) {
+    mu_assert (!m.filt.contains (random_fileid (p)));
+  }
+  return 0;
+}
+
+static const char* no_false_negatives () {
+  std::cout << __func__ << std::endl;
+  prng p (2);
+  message m (match_filter_type (), random_fileid (p));
+  std::vector<fileid> inserted;
+  for (uint32_t count = 0; count != MATCH_FILTER_CAPACITY; ++count) {
+    inserted.push_back (random_fileid (p));
+    m.filt.insert (inserted.back ());
+  }
+  mu_assert (m.filt.match_count == MATCH_FILTER_CAPACITY);
+  for (size_t idx = 0; idx != inserted.size (); ++idx) {
+    mu_assert (m.filt.contains (inserted[idx]));
+  }
+  return 0;
+}
+
+static const char* false_positives () {
+  std::cout << __func__ << std::endl;
+  prng p (3);
+  message m (match_filter_type (), random_fileid (p));
+  for (uint32_t count = 0; count != MATCH_FILTER_CAPACITY; ++count) {
+    m.filt.insert (random_fileid (p));
+  }
+  const int trials = 200000;
+  int positives = 0;
+  for (int count = 0; count != trials; ++count) {
+    if (m.filt.contains (random_fileid (p))) {
+      ++positives;
+    }
+  }
+  // About one in 2000 when full.
+  mu_assert (positives < trials / 1000);
+  return 0;
+}
+
+static const char* network_order () {
+  std::cout << __func__ << std::endl;
+  prng p (4);
+  const fileid fid = random_fileid (p);
+  const fileid member = random_fileid (p);
+  message m (match_filter_type (), fid);
+  m.filt.insert (member);
+  m.convert_to_network ();
+  mu_assert (m.convert_to_host ());
+  mu_assert (m.header.message_type == MATCH_FILTER);
+  mu_assert (m.filt.fid == fid);
+  mu_assert (m.filt.match_count == 1);
+  mu_assert (m.filt.contains (member));
+
+  // A receiver refuses a filter it can't test.
+  m.filt.hash_count = MAX_MATCH_FILTER_HASHES + 1;
+  m.convert_to_network ();
+  mu_assert (!m.convert_to_host ());
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (empty);
+  mu_run_test (no_false_negatives);
+  mu_run_test (false_positives);
+  mu_run_test (network_order);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+  return result != 0;
+}
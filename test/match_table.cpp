@@ -0,0 +1,210 @@
+#include <mftp/match_table.hpp>
+#include "minunit.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace mftp;
+
+static fileid make_fileid (const uint32_t n) {
+  fileid fid;
+  fid.type = 1;
+  fid.length = n;
+  memset (fid.hash, 0, HASH_SIZE);
+  // Spread the keys like digests would be.
+  uint64_t h = (n + 1) * 0x9e3779b97f4a7c15ull;
+  h ^= h >> 29;
+  memcpy (fid.hash, &h, sizeof (h));
+  return fid;
+}
+
+// Keys that all land in the same home slot.
+static fileid colliding_fileid (const uint32_t n) {
+  fileid fid;
+  fid.type = 1;
+  fid.length = n;
+  memset (fid.hash, 0, HASH_SIZE);
+  uint32_t h = n;
+  memcpy (fid.hash, &h, sizeof (h));
+  return fid;
+}
+
+static const char* keys () {
+  std::cout << __func__ << std::endl;
+  // Fileids that share a type and length differ by their hash alone.
+  fileid other = make_fileid (1);
+  other.hash[HASH_SIZE - 1] ^= 1;
+  mu_assert (other != make_fileid (1));
+  mu_assert (!(other == make_fileid (1)));
+  mu_assert (!(make_fileid (1) != make_fileid (1)));
+  return 0;
+}
+
+static const char* empty () {
+  std::cout << __func__ << std::endl;
+  match_table t (10, 0);
+  mu_assert (t.size () == 0);
+  mu_assert (t.state (make_fileid (1), 0) == MATCH_UNKNOWN);
+  t.erase (make_fileid (1));
+  t.touch (make_fileid (1), 5);
+  mu_assert (t.size () == 0);
+  return 0;
+}
+
+static const char* states () {
+  std::cout << __func__ << std::endl;
+  match_table t (10, 0);
+  t.set (make_fileid (1), MATCH_PENDING, 0);
+  t.set (make_fileid (2), MATCH_NO, 0);
+  mu_assert (t.state (make_fileid (1), 0) == MATCH_PENDING);
+  mu_assert (t.state (make_fileid (2), 0) == MATCH_NO);
+  mu_assert (t.count (MATCH_PENDING) == 1);
+  t.set (make_fileid (1), MATCH_YES, 1);
+  mu_assert (t.state (make_fileid (1), 1) == MATCH_YES);
+  mu_assert (t.count (MATCH_PENDING) == 0);
+  mu_assert (t.count (MATCH_YES) == 1);
+  mu_assert (t.size () == 2);
+
+  std::vector<fileid> matches;
+  t.collect (MATCH_YES, matches);
+  mu_assert (matches.size () == 1 && matches[0] == make_fileid (1));
+
+  t.erase (make_fileid (1));
+  mu_assert (t.state (make_fileid (1), 1) == MATCH_UNKNOWN);
+  mu_assert (t.count (MATCH_YES) == 0);
+  mu_assert (t.size () == 1);
+  return 0;
+}
+
+static const char* collisions () {
+  std::cout << __func__ << std::endl;
+  match_table t (100, 0);
+  // Same home slot in a table of 16, then grown.
+  for (uint32_t n = 0; n != 6; ++n) {
+    t.set (colliding_fileid (n << 8), MATCH_NO, n);
+  }
+  t.erase (colliding_fileid (1 << 8));
+  t.erase (colliding_fileid (3 << 8));
+  for (uint32_t n = 0; n != 6; ++n) {
+    const match_state expected = (n == 1 || n == 3) ? MATCH_UNKNOWN : MATCH_NO;
+    mu_assert (t.state (colliding_fileid (n << 8), 10) == expected);
+  }
+  mu_assert (t.size () == 4);
+  return 0;
+}
+
+static const char* ttl () {
+  std::cout << __func__ << std::endl;
+  match_table t (10, 100);
+  t.set (make_fileid (1), MATCH_YES, 0);
+  t.set (make_fileid (2), MATCH_NO, 0);
+  t.set (make_fileid (3), MATCH_PENDING, 0);
+  t.touch (make_fileid (2), 50);
+  mu_assert (t.state (make_fileid (1), 100) == MATCH_YES);
+  mu_assert (t.state (make_fileid (1), 101) == MATCH_UNKNOWN);
+  mu_assert (t.state (make_fileid (2), 101) == MATCH_NO);
+  // Pending entries wait for their download.
+  mu_assert (t.state (make_fileid (3), 1000) == MATCH_PENDING);
+  t.expire (101);
+  mu_assert (t.size () == 2);
+  mu_assert (t.count (MATCH_YES) == 0);
+  // Too soon to sweep again.
+  t.set (make_fileid (4), MATCH_NO, 0);
+  t.expire (102);
+  mu_assert (t.size () == 3);
+  t.expire (1000);
+  mu_assert (t.size () == 1);
+  mu_assert (t.state (make_fileid (3), 1000) == MATCH_PENDING);
+  return 0;
+}
+
+static const char* capacity () {
+  std::cout << __func__ << std::endl;
+  match_table t (4, 0);
+  t.set (make_fileid (1), MATCH_PENDING, 0);
+  for (uint32_t n = 2; n != 100; ++n) {
+    t.set (make_fileid (n), MATCH_NO, n);
+    mu_assert (t.size () <= 4);
+    // The newest entry is never the one dropped.
+    mu_assert (t.state (make_fileid (n), n) == MATCH_NO);
+  }
+  mu_assert (t.size () == 4);
+  // Pending entries are kept over older ones that are not.
+  mu_assert (t.state (make_fileid (1), 100) == MATCH_PENDING);
+  return 0;
+}
+
+static const char* least_recent () {
+  std::cout << __func__ << std::endl;
+  match_table t (8, 0);
+  for (uint32_t n = 0; n != 8; ++n) {
+    t.set (make_fileid (n), MATCH_NO, 10 + n);
+  }
+  t.touch (make_fileid (0), 100);
+  t.set (make_fileid (8), MATCH_NO, 101);
+  // The sample covers the whole table so the oldest goes.
+  mu_assert (t.state (make_fileid (1), 101) == MATCH_UNKNOWN);
+  mu_assert (t.state (make_fileid (0), 101) == MATCH_NO);
+  mu_assert (t.size () == 8);
+  return 0;
+}
+
+static const char* many () {
+  std::cout << __func__ << std::endl;
+  const uint32_t count = 100000;
+  match_table t (count, 0);
+  for (uint32_t n = 0; n != count; ++n) {
+    t.set (make_fileid (n), (n % 3) == 0 ? MATCH_YES : MATCH_NO, n);
+  }
+  mu_assert (t.size () == count);
+  for (uint32_t n = 0; n < count; n += 7) {
+    t.erase (make_fileid (n));
+  }
+  for (uint32_t n = 0; n != count; ++n) {
+    match_state expected = (n % 3) == 0 ? MATCH_YES : MATCH_NO;
+    if (n % 7 == 0) {
+      expected = MATCH_UNKNOWN;
+    }
+    mu_assert (t.state (make_fileid (n), count) == expected);
+  }
+  std::vector<fileid> matches;
+  t.collect (MATCH_YES, matches);
+  mu_assert (matches.size () == t.count (MATCH_YES));
+  return 0;
+}
+
+static const char* shrink () {
+  std::cout << __func__ << std::endl;
+  match_table t (1000, 10);
+  for (uint32_t n = 0; n != 1000; ++n) {
+    t.set (make_fileid (n), MATCH_NO, 0);
+  }
+  t.set (make_fileid (1000), MATCH_YES, 100);
+  t.expire (100);
+  mu_assert (t.size () == 1);
+  mu_assert (t.state (make_fileid (1000), 100) == MATCH_YES);
+  mu_assert (t.state (make_fileid (5), 100) == MATCH_UNKNOWN);
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (keys);
+  mu_run_test (empty);
+  mu_run_test (states);
+  mu_run_test (collisions);
+  mu_run_test (ttl);
+  mu_run_test (capacity);
+  mu_run_test (least_recent);
+  mu_run_test (many);
+  mu_run_test (shrink);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+  return result != 0;
+}
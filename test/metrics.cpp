@@ -0,0 +1,100 @@
+#include <mftp/metrics.hpp>
+#include "minunit.h"
+
+#include <iostream>
+
+static const char* counting () {
+  std::cout << __func__ << std::endl;
+  mftp::metric m;
+  mu_assert (m.get () == 0);
+  m.add ();
+  m.add (4);
+  mu_assert (m.get () == 5);
+  m.set (2);
+  mu_assert (m.get () == 2);
+  return 0;
+}
+
+static const char* render () {
+  std::cout << __func__ << std::endl;
+  mftp::metrics_registry registry;
+  registry.get ("x_total", "a=\"1\"", mftp::COUNTER, "Some x.")->add (3);
+  registry.get ("y", "", mftp::GAUGE, "A y.")->set (7);
+  const std::string text = registry.render ();
+  mu_assert (text ==
+	     "# HELP x_total Some x.\n"
+	     "# TYPE x_total counter\n"
+	     "x_total{a=\"1\"} 3\n"
+	     "# HELP y A y.\n"
+	     "# TYPE y gauge\n"
+	     "y 7\n");
+  return 0;
+}
+
+static const char* shared () {
+  std::cout << __func__ << std::endl;
+  mftp::metrics_registry registry;
+  mftp::metric* a = registry.get ("x_total", "a=\"1\"", mftp::COUNTER, "Some x.");
+  mftp::metric* b = registry.get ("x_total", "a=\"1\"", mftp::COUNTER, "Some x.");
+  mu_assert (a == b);
+  a->add ();
+  registry.release ("a=\"1\"");
+  // Still owned by b.
+  b->add ();
+  mu_assert (registry.render () == "# HELP x_total Some x.\n# TYPE x_total counter\nx_total{a=\"1\"} 2\n");
+  registry.release ("a=\"1\"");
+  mu_assert (registry.render () == "");
+  return 0;
+}
+
+static const char* file () {
+  std::cout << __func__ << std::endl;
+  mftp::fileid fid;
+  memset (&fid, 0, sizeof (fid));
+  {
+    mftp::file_metrics m (fid, 7);
+    m.fragments_sent->add ();
+    mu_assert (mftp::metrics_registry::instance ().render ().find ("mftp_file_fragments_sent_total{fileid=\"" + fid.to_string () + "\",aid=\"7\"} 1\n") != std::string::npos);
+    m.queue_delays.data.delay->add (250);
+    mu_assert (mftp::metrics_registry::instance ().render ().find ("mftp_file_send_queue_delay_microseconds_total{fileid=\"" + fid.to_string () + "\",aid=\"7\",class=\"data\"} 250\n") != std::string::npos);
+  }
+  mu_assert (mftp::metrics_registry::instance ().render () == "");
+  return 0;
+}
+
+static const char* two_automatons () {
+  std::cout << __func__ << std::endl;
+  mftp::fileid fid;
+  memset (&fid, 0, sizeof (fid));
+  {
+    // Two automatons for one file keep gauges of their own.
+    mftp::file_metrics a (fid, 1);
+    mftp::file_metrics b (fid, 2);
+    a.send_queue_depth->set (3);
+    b.send_queue_depth->set (5);
+    mu_assert (a.send_queue_depth->get () == 3);
+    mu_assert (b.send_queue_depth->get () == 5);
+  }
+  mu_assert (mftp::metrics_registry::instance ().render () == "");
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (counting);
+  mu_run_test (render);
+  mu_run_test (shared);
+  mu_run_test (file);
+  mu_run_test (two_automatons);
+
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+
+  return result != 0;
+}
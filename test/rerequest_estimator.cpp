@@ -0,0 +1,90 @@
+#include <mftp/rerequest_estimator.hpp>
+#include "minunit.h"
+
+#include <algorithm>
+#include <iostream>
+
+using namespace mftp;
+
+static const uint64_t MIN_RTO = 10000;
+static const uint64_t MIN_SUPPRESS = 1000;
+static const uint64_t MAX_SUPPRESS = 500000;
+
+// The window of a server, as mftp_automaton sizes it.
+static uint64_t window (const rerequest_estimator& e) {
+  const uint64_t w = e.sampled () ? e.interval () / 2 : MIN_RTO;
+  return std::max (MIN_SUPPRESS, std::min (MAX_SUPPRESS, w));
+}
+
+static const char* one_receiver () {
+  std::cout << __func__ << std::endl;
+  rerequest_estimator e (100000, 2 * MAX_SUPPRESS);
+  e.request (7, 0, window (e));
+  mu_assert (!e.sampled ());
+  e.request (7, 40000, window (e));
+  mu_assert (e.sampled ());
+  mu_assert (e.interval () == 40000);
+  mu_assert (window (e) == 20000);
+  return 0;
+}
+
+static const char* copies () {
+  std::cout << __func__ << std::endl;
+  rerequest_estimator e (100000, 2 * MAX_SUPPRESS);
+  // The copies of an endgame request go out back to back.
+  e.request (7, 0, window (e));
+  e.request (7, 0, window (e));
+  e.request (7, 50, window (e));
+  mu_assert (!e.sampled ());
+  return 0;
+}
+
+static const char* many_receivers () {
+  std::cout << __func__ << std::endl;
+  const uint64_t rtt = 40000;
+  const uint32_t receivers = 50;
+  rerequest_estimator e (100000, 2 * MAX_SUPPRESS);
+  // Every receiver misses the same fragments and asks again each round trip.
+  // Their requests arrive spread over a few milliseconds.
+  for (uint64_t round = 0; round != 20; ++round) {
+    for (uint32_t r = 0; r != receivers; ++r) {
+      const uint64_t now = round * rtt + r * 60;
+      for (uint32_t idx = 0; idx != 4; ++idx) {
+	e.request (idx, now, window (e));
+      }
+    }
+  }
+  mu_assert (e.sampled ());
+  // About half a round trip, not the burst spacing.
+  mu_assert (window (e) >= rtt / 2 - rtt / 10);
+  mu_assert (window (e) <= rtt / 2 + rtt / 10);
+  return 0;
+}
+
+static const char* horizon () {
+  std::cout << __func__ << std::endl;
+  rerequest_estimator e (100000, 1000);
+  e.request (1, 0, window (e));
+  e.request (2, 2000, window (e));
+  // Forgotten so the long gap isn't sampled.
+  e.request (1, 3000, window (e));
+  mu_assert (!e.sampled ());
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (one_receiver);
+  mu_run_test (copies);
+  mu_run_test (many_receivers);
+  mu_run_test (horizon);
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+  return result != 0;
+}
@@ -0,0 +1,66 @@
+#include <mftp/rtt_estimator.hpp>
+#include "minunit.h"
+
+#include <iostream>
+
+using namespace mftp;
+
+static const char* initial () {
+  std::cout << __func__ << std::endl;
+  rtt_estimator e (100000);
+  mu_assert (!e.sampled ());
+  mu_assert (e.srtt () == 100000);
+  mu_assert (e.rttvar () == 50000);
+  return 0;
+}
+
+static const char* first_sample () {
+  std::cout << __func__ << std::endl;
+  rtt_estimator e (100000);
+  e.sample (2000);
+  mu_assert (e.sampled ());
+  mu_assert (e.srtt () == 2000);
+  mu_assert (e.rttvar () == 1000);
+  return 0;
+}
+
+static const char* converge () {
+  std::cout << __func__ << std::endl;
+  rtt_estimator e (100000);
+  e.sample (50000);
+  for (int i = 0; i < 100; ++i) {
+    e.sample (1000);
+  }
+  mu_assert (e.srtt () >= 1000 && e.srtt () < 1100);
+  mu_assert (e.rttvar () < 100);
+  return 0;
+}
+
+static const char* timeout () {
+  std::cout << __func__ << std::endl;
+  rtt_estimator e (100000);
+  e.sample (1000);
+  mu_assert (e.timeout (0, 1000000) == 1000 + 4 * 500);
+  mu_assert (e.timeout (10000, 1000000) == 10000);
+  mu_assert (e.timeout (0, 2000) == 2000);
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (initial);
+  mu_run_test (first_sample);
+  mu_run_test (converge);
+  mu_run_test (timeout);
+
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+
+  return result != 0;
+}
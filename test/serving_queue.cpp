@@ -0,0 +1,123 @@
+#include <mftp/serving_queue.hpp>
+#include "minunit.h"
+
+#include <iostream>
+#include <set>
+
+using namespace mftp;
+
+static const char* empty () {
+  std::cout << __func__ << std::endl;
+  serving_queue q (1);
+  mu_assert (q.empty ());
+  mu_assert (q.size () == 0);
+  mu_assert (!q.contains (0));
+  mu_assert (q.count (0) == 0);
+  return 0;
+}
+
+static const char* deduplicate () {
+  std::cout << __func__ << std::endl;
+  serving_queue q (1);
+  q.request (7);
+  q.request (7);
+  q.request (7);
+  mu_assert (q.size () == 1);
+  mu_assert (q.count (7) == 3);
+  mu_assert (q.front () == 7);
+  q.pop ();
+  mu_assert (q.empty ());
+  mu_assert (!q.contains (7));
+  return 0;
+}
+
+static const char* popular_first () {
+  std::cout << __func__ << std::endl;
+  serving_queue q (1);
+  for (uint32_t idx = 0; idx < 100; ++idx) {
+    q.request (idx);
+  }
+  q.request (42);
+  q.request (42);
+  q.request (17);
+  mu_assert (q.front () == 42);
+  q.pop ();
+  mu_assert (q.front () == 17);
+  q.pop ();
+  mu_assert (q.size () == 98);
+  return 0;
+}
+
+static const char* erase () {
+  std::cout << __func__ << std::endl;
+  serving_queue q (1);
+  q.request (1);
+  q.request (2);
+  q.request (2);
+  q.erase (2);
+  q.erase (3);
+  mu_assert (q.size () == 1);
+  mu_assert (q.front () == 1);
+  // A fragment that leaves and is requested again starts over.
+  q.request (2);
+  mu_assert (q.count (2) == 1);
+  return 0;
+}
+
+static const char* drains () {
+  std::cout << __func__ << std::endl;
+  serving_queue q (1);
+  for (uint32_t idx = 0; idx < 1000; ++idx) {
+    q.request (idx);
+  }
+  std::set<uint32_t> seen;
+  while (!q.empty ()) {
+    seen.insert (q.front ());
+    q.pop ();
+  }
+  mu_assert (seen.size () == 1000);
+  return 0;
+}
+
+static const char* randomized () {
+  std::cout << __func__ << std::endl;
+  // Equally popular fragments come out in an order that depends on the seed.
+  serving_queue q1 (1);
+  serving_queue q2 (2);
+  for (uint32_t idx = 0; idx < 100; ++idx) {
+    q1.request (idx);
+    q2.request (idx);
+  }
+  uint32_t in_order = 0;
+  uint32_t same = 0;
+  for (uint32_t idx = 0; idx < 100; ++idx) {
+    in_order += q1.front () == idx;
+    same += q1.front () == q2.front ();
+    q1.pop ();
+    q2.pop ();
+  }
+  mu_assert (in_order < 10);
+  mu_assert (same < 10);
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (empty);
+  mu_run_test (deduplicate);
+  mu_run_test (popular_first);
+  mu_run_test (erase);
+  mu_run_test (drains);
+  mu_run_test (randomized);
+
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+
+  return result != 0;
+}
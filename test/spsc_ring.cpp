@@ -0,0 +1,111 @@
+#include <mftp/spsc_ring.hpp>
+#include "minunit.h"
+
+#include <iostream>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace mftp;
+
+static const char* ctor () {
+  std::cout << __func__ << std::endl;
+  spsc_ring<int> ring (5);
+  mu_assert (ring.capacity () == 8);
+  mu_assert (ring.empty ());
+  int x;
+  mu_assert (!ring.pop (x));
+  return 0;
+}
+
+static const char* push_pop () {
+  std::cout << __func__ << std::endl;
+  spsc_ring<int> ring (4);
+  mu_assert (ring.push (1));
+  mu_assert (ring.push (2));
+  mu_assert (!ring.empty ());
+  int x;
+  mu_assert (ring.pop (x) && x == 1);
+  mu_assert (ring.pop (x) && x == 2);
+  mu_assert (ring.empty ());
+  return 0;
+}
+
+static const char* full () {
+  std::cout << __func__ << std::endl;
+  spsc_ring<int> ring (4);
+  for (int i = 0; i < 4; ++i) {
+    mu_assert (ring.push (i));
+  }
+  mu_assert (!ring.push (4));
+  int x;
+  mu_assert (ring.pop (x) && x == 0);
+  mu_assert (ring.push (4));
+  return 0;
+}
+
+static const char* wrap () {
+  std::cout << __func__ << std::endl;
+  spsc_ring<int> ring (4);
+  int x;
+  for (int i = 0; i < 100; ++i) {
+    mu_assert (ring.push (i));
+    mu_assert (ring.push (i + 1000));
+    mu_assert (ring.pop (x) && x == i);
+    mu_assert (ring.pop (x) && x == i + 1000);
+  }
+  mu_assert (ring.empty ());
+  return 0;
+}
+
+static const int COUNT = 100000;
+
+static void* produce (void* arg) {
+  spsc_ring<int>* ring = static_cast<spsc_ring<int>*> (arg);
+  for (int i = 0; i < COUNT; ++i) {
+    while (!ring->push (i)) {
+      sched_yield ();
+    }
+  }
+  return 0;
+}
+
+static const char* threads () {
+  std::cout << __func__ << std::endl;
+  spsc_ring<int> ring (64);
+  pthread_t producer;
+  mu_assert (pthread_create (&producer, 0, produce, &ring) == 0);
+  int expected = 0;
+  while (expected != COUNT) {
+    int x;
+    if (ring.pop (x)) {
+      mu_assert (x == expected);
+      ++expected;
+    }
+    else {
+      sched_yield ();
+    }
+  }
+  pthread_join (producer, 0);
+  mu_assert (ring.empty ());
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (ctor);
+  mu_run_test (push_pop);
+  mu_run_test (full);
+  mu_run_test (wrap);
+  mu_run_test (threads);
+
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+
+  return result != 0;
+}
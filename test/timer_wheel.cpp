@@ -0,0 +1,128 @@
+#include <mftp/timer_wheel.hpp>
+#include "minunit.h"
+
+#include <iostream>
+#include <map>
+
+using namespace mftp;
+
+static const char* empty () {
+  std::cout << __func__ << std::endl;
+  timer_wheel<int> w;
+  std::vector<int> expired;
+  mu_assert (w.empty ());
+  w.advance (1000000, expired);
+  mu_assert (expired.empty ());
+  mu_assert (w.now () == 1000000);
+  mu_assert (w.next_expiry () == 1000000);
+  return 0;
+}
+
+static const char* expire () {
+  std::cout << __func__ << std::endl;
+  timer_wheel<int> w;
+  std::vector<int> expired;
+  w.insert (1, 10);
+  w.insert (2, 5);
+  mu_assert (w.next_expiry () == 5);
+  w.advance (4, expired);
+  mu_assert (expired.empty ());
+  w.advance (5, expired);
+  mu_assert (expired.size () == 1 && expired[0] == 2);
+  w.advance (100, expired);
+  mu_assert (expired.size () == 2 && expired[1] == 1);
+  mu_assert (w.empty ());
+  return 0;
+}
+
+static const char* replace_and_cancel () {
+  std::cout << __func__ << std::endl;
+  timer_wheel<int> w;
+  std::vector<int> expired;
+  w.insert (1, 10);
+  w.insert (1, 20);
+  w.insert (2, 15);
+  w.cancel (2);
+  mu_assert (w.size () == 1);
+  w.advance (19, expired);
+  mu_assert (expired.empty ());
+  w.advance (20, expired);
+  mu_assert (expired.size () == 1 && expired[0] == 1);
+  return 0;
+}
+
+static const char* overdue () {
+  std::cout << __func__ << std::endl;
+  timer_wheel<int> w;
+  std::vector<int> expired;
+  w.advance (100, expired);
+  w.insert (1, 50);
+  w.advance (101, expired);
+  mu_assert (expired.size () == 1);
+  return 0;
+}
+
+static const char* cascade () {
+  std::cout << __func__ << std::endl;
+  // Deadlines on every level, expired in one step each, in order.
+  timer_wheel<int> w;
+  std::vector<int> expired;
+  const uint64_t deadlines[] = { 3, 300, 70000, 20000000, 5000000000ULL };
+  for (int i = 0; i != 5; ++i) {
+    w.insert (i, deadlines[i]);
+  }
+  for (int i = 0; i != 5; ++i) {
+    mu_assert (w.next_expiry () <= deadlines[i]);
+    w.advance (deadlines[i] - 1, expired);
+    mu_assert (expired.size () == size_t (i));
+    w.advance (deadlines[i], expired);
+    mu_assert (expired.size () == size_t (i + 1) && expired[i] == i);
+  }
+  return 0;
+}
+
+static const char* many () {
+  std::cout << __func__ << std::endl;
+  // Pseudo-random deadlines expire exactly on time.
+  timer_wheel<int> w;
+  std::map<int, uint64_t> deadline;
+  uint64_t x = 12345;
+  for (int i = 0; i != 10000; ++i) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    deadline[i] = 1 + (x >> 33) % 1000000;
+    w.insert (i, deadline[i]);
+  }
+  std::vector<int> expired;
+  uint64_t t = 0;
+  size_t done = 0;
+  while (!w.empty ()) {
+    t += 997;
+    w.advance (t, expired);
+    for (; done != expired.size (); ++done) {
+      mu_assert (deadline[expired[done]] <= t && deadline[expired[done]] > t - 997);
+    }
+  }
+  mu_assert (expired.size () == 10000);
+  return 0;
+}
+
+const char* all_tests () {
+  mu_run_test (empty);
+  mu_run_test (expire);
+  mu_run_test (replace_and_cancel);
+  mu_run_test (overdue);
+  mu_run_test (cascade);
+  mu_run_test (many);
+
+  return 0;
+}
+
+int main (int argc, char **argv)
+{
+  const char* result = all_tests();
+  if (result != 0) {
+    std::cout << result << std::endl;
+  }
+
+  return result != 0;
+}